@@ -0,0 +1,378 @@
+/* vim: sw=2 ts=2 sts=2 et
+ *
+ * Command buffer builder for kyouko3 clients. See k3cmd.h.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "k3cmd.h"
+
+#define K3_OP_TRIANGLES 0x14
+
+static __u32 k3_hdr(enum k3_vfmt fmt, unsigned int tris) {
+  struct kyouko3_dma_hdr hdr = {
+      .stride = k3_vfmt_words(fmt) - 1,
+      .w = fmt == K3_VTX_XYZW || fmt == K3_VTX_RGB_XYZW,
+      .rgb = fmt >= K3_VTX_RGB_XYZ,
+      .b12 = 1,
+      .count = tris * 3,
+      .opcode = K3_OP_TRIANGLES,
+  };
+  __u32 word;
+
+  memcpy(&word, &hdr, sizeof(word));
+  return word;
+}
+
+static void k3cmd_reset(struct k3cmd *c, __u64 buf) {
+  c->base = c->cur = (__u32 *)(unsigned long)buf;
+  c->end = c->base + c->bufsize / sizeof(__u32);
+  c->pkt = NULL;
+}
+
+int k3cmd_init(struct k3cmd *c, int fd, const struct kyouko3_dma_bind *geom) {
+  struct kyouko3_dma_bind bind = {0};
+
+  if (geom) {
+    bind = *geom;
+  }
+  if (ioctl(fd, BIND_DMA_GEOM, &bind) < 0) {
+    return -1;
+  }
+  memset(c, 0, sizeof(*c));
+  c->fd = fd;
+  c->nbufs = bind.nbufs;
+  c->bufsize = bind.bufsize;
+  k3cmd_reset(c, bind.u_base);
+  return 0;
+}
+
+int k3cmd_init_ring(struct k3cmd *c, int fd,
+                    const struct kyouko3_dma_bind *geom) {
+  __u64 addr = 0;
+
+  if (k3cmd_init(c, fd, geom) < 0) {
+    return -1;
+  }
+  if (ioctl(fd, SETUP_RING, &addr) < 0) {
+    int err = errno;
+    ioctl(fd, UNBIND_DMA, 0);
+    errno = err;
+    return -1;
+  }
+  c->ring = (struct kyouko3_ring *)(unsigned long)addr;
+  k3cmd_reset(c, c->ring->bufs[c->ring->first]);
+  return 0;
+}
+
+unsigned int k3cmd_reap(struct k3cmd *c, __u64 *fences, unsigned int max) {
+  struct kyouko3_ring *r = c->ring;
+  __u32 head = r->cq_head;
+  __u32 tail = __atomic_load_n(&r->cq_tail, __ATOMIC_ACQUIRE);
+  unsigned int n = 0;
+
+  while (head != tail && n < max) {
+    fences[n++] = r->cq[head++ % K3_RING_CQ_ENTRIES];
+  }
+  __atomic_store_n(&r->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+void k3cmd_init_worker(struct k3cmd *c, const struct k3cmd *owner) {
+  memset(c, 0, sizeof(*c));
+  c->fd = owner->fd;
+  c->nbufs = owner->nbufs;
+  c->bufsize = owner->bufsize;
+  c->ticketed = 1;
+}
+
+int k3cmd_acquire(struct k3cmd *c) {
+  struct kyouko3_dma_ticket t = {0};
+
+  if (!c->ticketed || c->base) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (ioctl(c->fd, ACQUIRE_DMA, &t) < 0) {
+    return -1;
+  }
+  c->ticket = t.ticket;
+  k3cmd_reset(c, t.u_base);
+  return 0;
+}
+
+int k3cmd_fini(struct k3cmd *c) {
+  int ret = k3cmd_submit(c);
+
+  if (!c->ticketed && ioctl(c->fd, UNBIND_DMA, 0) < 0) {
+    ret = -1;
+  }
+  c->base = c->cur = c->end = NULL;
+  c->ring = NULL;
+  return ret;
+}
+
+// Bookkeeping after the driver has taken c's ticket back as sub.
+static void k3cmd_retire_ticket(struct k3cmd *c,
+                                const struct kyouko3_dma_submit *sub) {
+  c->fence = sub->fence;
+  if (c->cur != c->base) {
+    c->bufs_submitted++;
+    c->bytes_submitted += sub->count;
+  }
+  c->base = c->cur = c->end = c->pkt = NULL;
+}
+
+static int k3cmd_submit_ticket(struct k3cmd *c) {
+  struct kyouko3_dma_submit sub = {.ticket = c->ticket};
+
+  if (!c->base) {
+    return 0;
+  }
+  sub.count = (c->cur - c->base) * sizeof(__u32);
+  if (ioctl(c->fd, SUBMIT_DMA, &sub) < 0) {
+    return -1;
+  }
+  k3cmd_retire_ticket(c, &sub);
+  return 0;
+}
+
+int k3cmd_submit_batch(struct k3cmd **cs, unsigned int n) {
+  struct kyouko3_dma_submit *subs;
+  struct kyouko3_dma_submit_batch batch = {0};
+  struct k3cmd **held;
+  int ret = 0;
+
+  if (n == 0) {
+    return 0;
+  }
+  subs = calloc(n, sizeof(*subs));
+  held = calloc(n, sizeof(*held));
+  batch.subs = (unsigned long)subs;
+  if (!subs || !held) {
+    free(subs);
+    free(held);
+    return -1;
+  }
+  for (unsigned int i = 0; i < n; i++) {
+    if (!cs[i]->ticketed || cs[i]->fd != cs[0]->fd) {
+      errno = EINVAL;
+      ret = -1;
+      goto out;
+    }
+    if (cs[i]->base) {
+      subs[batch.count].ticket = cs[i]->ticket;
+      subs[batch.count].count = (cs[i]->cur - cs[i]->base) * sizeof(__u32);
+      held[batch.count++] = cs[i];
+    }
+  }
+  if (batch.count && ioctl(cs[0]->fd, SUBMIT_DMA_BATCH, &batch) < 0) {
+    ret = -1;
+  } else {
+    for (unsigned int i = 0; i < batch.count; i++) {
+      k3cmd_retire_ticket(held[i], &subs[i]);
+    }
+  }
+out:
+  free(subs);
+  free(held);
+  return ret;
+}
+
+/*
+ * Post the buffer as the next submission ring entry and move on to the
+ * entry after it, waiting for the card to retire that buffer's previous
+ * contents if it has not yet.
+ */
+static int k3cmd_submit_ring(struct k3cmd *c) {
+  struct kyouko3_ring *r = c->ring;
+  __u32 n = r->sq_tail;
+  __u64 next_fence = r->fence_base + n + 2;
+  struct kyouko3_fence_wait fw = {.timeout_ms = 10000};
+
+  if (c->cur == c->base) {
+    return 0;
+  }
+  r->sq[n % K3_RING_SQ_ENTRIES] = (struct kyouko3_sqe){
+      .buf = (r->first + n) % r->nbufs,
+      .count = (c->cur - c->base) * sizeof(__u32),
+  };
+  __atomic_store_n(&r->sq_tail, n + 1, __ATOMIC_RELEASE);
+  // Pairs with the driver setting the flag before its last look at sq_tail.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->flags, __ATOMIC_RELAXED) & K3_RING_NEED_WAKEUP) {
+    c->wakeups++;
+    if (ioctl(c->fd, RING_ENTER, 0) < 0) {
+      return -1;
+    }
+  }
+  if (__atomic_load_n(&r->flags, __ATOMIC_RELAXED) & K3_RING_ERROR) {
+    errno = EIO;
+    return -1;
+  }
+  c->fence = r->fence_base + n + 1;
+  c->bufs_submitted++;
+  c->bytes_submitted += r->sq[n % K3_RING_SQ_ENTRIES].count;
+
+  // The next slot was last used by the entry nbufs before it.
+  if (next_fence > r->nbufs) {
+    fw.fence = next_fence - r->nbufs;
+  }
+  if (__atomic_load_n(&r->fence_done, __ATOMIC_ACQUIRE) < fw.fence &&
+      ioctl(c->fd, WAIT_FENCE, &fw) < 0) {
+    return -1;
+  }
+  k3cmd_reset(c, r->bufs[(r->first + n + 1) % r->nbufs]);
+  return 0;
+}
+
+int k3cmd_submit(struct k3cmd *c) {
+  struct kyouko3_dma_start start = {0};
+
+  if (c->ticketed) {
+    return k3cmd_submit_ticket(c);
+  }
+  if (c->ring) {
+    return k3cmd_submit_ring(c);
+  }
+  if (c->cur == c->base) {
+    return 0;
+  }
+  start.count = (c->cur - c->base) * sizeof(__u32);
+  if (ioctl(c->fd, START_DMA_FENCE, &start) < 0) {
+    return -1;
+  }
+  c->fence = start.fence;
+  c->bufs_submitted++;
+  c->bytes_submitted += start.count;
+  k3cmd_reset(c, start.next_buf);
+  return 0;
+}
+
+int k3cmd_finish(struct k3cmd *c, unsigned int timeout_ms) {
+  struct kyouko3_fence_wait fw = {.timeout_ms = timeout_ms};
+
+  if (k3cmd_submit(c) < 0) {
+    return -1;
+  }
+  if (!c->fence) {
+    return 0;
+  }
+  fw.fence = c->fence;
+  return ioctl(c->fd, WAIT_FENCE, &fw);
+}
+
+/*
+ * k3cmd_tris(), with the vertices of a new packet starting on an align-word
+ * boundary. The gap in front of the header is filled with empty triangle
+ * packets, which the card skips like any other packet.
+ */
+static void *k3cmd_reserve(struct k3cmd *c, enum k3_vfmt fmt,
+                           unsigned int *ntris, unsigned int align) {
+  unsigned int tri_words = 3 * k3_vfmt_words(fmt);
+  unsigned int fit, pad;
+  void *out;
+
+  for (;;) {
+    if (!c->base) {
+      if (!c->ticketed) {
+        errno = EINVAL;
+        return NULL;
+      }
+      if (k3cmd_acquire(c) < 0) {
+        return NULL;
+      }
+    }
+    if (*ntris == 0) {
+      return c->cur;
+    }
+    // Extend the open packet if the format matches, else start a new one.
+    if (c->pkt && c->pkt_fmt == fmt && c->pkt_tris < K3_PKT_MAX_TRIS) {
+      fit = (c->end - c->cur) / tri_words;
+      if (fit > K3_PKT_MAX_TRIS - c->pkt_tris) {
+        fit = K3_PKT_MAX_TRIS - c->pkt_tris;
+      }
+    } else {
+      pad = (align - ((unsigned long)(c->cur + 1) / 4) % align) % align;
+      fit = c->end - c->cur > 1 + pad
+                ? (c->end - c->cur - 1 - pad) / tri_words
+                : 0;
+      if (fit > K3_PKT_MAX_TRIS) {
+        fit = K3_PKT_MAX_TRIS;
+      }
+      if (fit) {
+        while (pad--) {
+          *c->cur++ = k3_hdr(fmt, 0);
+        }
+        c->pkt = c->cur++;
+        c->pkt_fmt = fmt;
+        c->pkt_tris = 0;
+      }
+    }
+    if (fit) {
+      break;
+    }
+    if (c->cur == c->base) {
+      // Not even one triangle fits in an empty buffer.
+      errno = EINVAL;
+      return NULL;
+    }
+    if (k3cmd_submit(c) < 0) {
+      return NULL;
+    }
+  }
+
+  if (*ntris > fit) {
+    *ntris = fit;
+  }
+  out = c->cur;
+  c->cur += *ntris * tri_words;
+  c->pkt_tris += *ntris;
+  *c->pkt = k3_hdr(fmt, c->pkt_tris);
+  return out;
+}
+
+void *k3cmd_tris(struct k3cmd *c, enum k3_vfmt fmt, unsigned int *ntris) {
+  return k3cmd_reserve(c, fmt, ntris, 1);
+}
+
+int k3cmd_emit_soa(struct k3cmd *c, const struct k3_soa *a,
+                   unsigned int ntris) {
+  size_t first = 0;
+
+  while (ntris) {
+    unsigned int n = ntris;
+    // 32 bytes, so the packer can use aligned 256-bit streaming stores.
+    __u32 *dst = k3cmd_reserve(c, K3_VTX_RGB_XYZ, &n, 8);
+
+    if (!dst) {
+      return -1;
+    }
+    k3_pack_rgb_xyz(dst, a, first, 3 * n);
+    first += 3 * n;
+    ntris -= n;
+  }
+  return 0;
+}
+
+int k3cmd_emit(struct k3cmd *c, enum k3_vfmt fmt, const void *verts,
+               unsigned int ntris) {
+  size_t tri_bytes = 3 * k3_vfmt_words(fmt) * sizeof(__u32);
+  const char *src = verts;
+
+  while (ntris) {
+    unsigned int n = ntris;
+    void *dst = k3cmd_tris(c, fmt, &n);
+
+    if (!dst) {
+      return -1;
+    }
+    memcpy(dst, src, n * tri_bytes);
+    src += n * tri_bytes;
+    ntris -= n;
+  }
+  return 0;
+}
@@ -0,0 +1,175 @@
+/* vim: sw=2 ts=2 sts=2 et
+ *
+ * Command buffer builder for kyouko3 clients.
+ *
+ * Vertices are written straight into the mmapped DMA buffer. Consecutive
+ * triangles of the same vertex format share one packet, packets of different
+ * formats are packed back to back, and a full buffer is handed to the card
+ * with START_DMA_FENCE before building continues in the next one.
+ *
+ *   struct k3cmd c;
+ *   k3cmd_init(&c, fd, NULL);
+ *   struct k3_vtx_rgb_xyz *v = k3cmd_tris(&c, K3_VTX_RGB_XYZ, &n);
+ *   ... fill 3 * n vertices ...
+ *   k3cmd_finish(&c, 1000);
+ *   k3cmd_fini(&c);
+ *
+ * Functions returning int give 0 or -1 with errno set, like the syscalls
+ * underneath.
+ */
+#ifndef K3CMD_H
+#define K3CMD_H
+
+#include <stddef.h>
+
+#include "kyouko3.h"
+
+// Vertex layouts a packet can carry. Colours come first, as the card reads
+// them; formats without colour use the current VERTEX_COLOR state.
+enum k3_vfmt {
+  K3_VTX_XYZ,
+  K3_VTX_XYZW,
+  K3_VTX_RGB_XYZ,
+  K3_VTX_RGB_XYZW,
+};
+
+struct k3_vtx_xyz {
+  float x, y, z;
+};
+
+struct k3_vtx_xyzw {
+  float x, y, z, w;
+};
+
+struct k3_vtx_rgb_xyz {
+  float r, g, b;
+  float x, y, z;
+};
+
+struct k3_vtx_rgb_xyzw {
+  float r, g, b;
+  float x, y, z, w;
+};
+
+// Most vertices a packet header can count, rounded down to whole triangles.
+#define K3_PKT_MAX_TRIS (1023 / 3)
+
+struct k3cmd {
+  int fd;
+  // The buffer being filled.
+  __u32 *base;
+  __u32 *cur;
+  __u32 *end;
+  // Header of the open packet, or NULL when the next vertices need a new one.
+  __u32 *pkt;
+  enum k3_vfmt pkt_fmt;
+  __u32 pkt_tris;
+  // Geometry the driver chose at bind time.
+  __u32 nbufs;
+  __u32 bufsize;
+  // Fence of the most recently submitted buffer.
+  __u64 fence;
+  // Workers fill buffers taken with ACQUIRE_DMA; ticket is the current one's.
+  int ticketed;
+  __u64 ticket;
+  // Shared rings after k3cmd_init_ring(), and the RING_ENTER calls made.
+  struct kyouko3_ring *ring;
+  __u64 wakeups;
+  // Totals, for reporting.
+  __u64 bufs_submitted;
+  __u64 bytes_submitted;
+};
+
+// Words per vertex of a format.
+static inline unsigned int k3_vfmt_words(enum k3_vfmt fmt) {
+  return (fmt >= K3_VTX_RGB_XYZ ? 3 : 0) +
+         (fmt == K3_VTX_XYZW || fmt == K3_VTX_RGB_XYZW ? 4 : 3);
+}
+
+// Bind a DMA ring on fd. geom may be NULL for the default geometry.
+int k3cmd_init(struct k3cmd *c, int fd, const struct kyouko3_dma_bind *geom);
+// Submit what is left and unbind the ring. A worker only submits.
+int k3cmd_fini(struct k3cmd *c);
+
+/*
+ * k3cmd_init() followed by SETUP_RING. Buffers are then submitted through
+ * the shared submission ring without a system call, unless the driver had
+ * gone idle and asks for a RING_ENTER, or the next buffer is still in use
+ * and has to be waited for.
+ */
+int k3cmd_init_ring(struct k3cmd *c, int fd,
+                    const struct kyouko3_dma_bind *geom);
+// Copy up to max fences off the completion ring and return how many.
+unsigned int k3cmd_reap(struct k3cmd *c, __u64 *fences, unsigned int max);
+
+/*
+ * Set c up to record into the ring owner bound, from a thread of its own.
+ * Each buffer a worker fills is taken with ACQUIRE_DMA and handed back with
+ * SUBMIT_DMA, and the card runs them in the order they were acquired, not
+ * submitted. A worker takes its first buffer when it first records, or
+ * earlier with k3cmd_acquire(), which lets the owner fix the order up front:
+ *
+ *   for (i = 0; i < n; i++) {
+ *     k3cmd_init_worker(&w[i], &c);
+ *     k3cmd_acquire(&w[i]);
+ *   }
+ *   ... each thread records into w[i] and calls k3cmd_submit(&w[i]) ...
+ *
+ * A worker that runs out of room submits and acquires again, so its later
+ * triangles land behind every buffer acquired in the meantime. Legacy
+ * START_DMA fails with EBUSY on the ring while any ticket is held.
+ */
+void k3cmd_init_worker(struct k3cmd *c, const struct k3cmd *owner);
+// Take the next ticket and its buffer. Blocks while the ring is full.
+int k3cmd_acquire(struct k3cmd *c);
+/*
+ * k3cmd_submit() for the workers in cs, with a single SUBMIT_DMA_BATCH. A
+ * thread recording several buffers per frame can keep one worker per buffer
+ * and hand them all over at the end. Workers without a buffer are skipped.
+ */
+int k3cmd_submit_batch(struct k3cmd **cs, unsigned int n);
+
+/*
+ * Reserve room for up to *ntris triangles of fmt and return where their
+ * 3 * *ntris vertices go. *ntris is lowered to what fits in the current
+ * packet and buffer; when nothing fits the buffer is submitted first. Returns
+ * NULL if that submission fails.
+ */
+void *k3cmd_tris(struct k3cmd *c, enum k3_vfmt fmt, unsigned int *ntris);
+
+// Copy ntris triangles in, across as many packets and buffers as it takes.
+int k3cmd_emit(struct k3cmd *c, enum k3_vfmt fmt, const void *verts,
+               unsigned int ntris);
+
+/*
+ * Vertices as separate position and colour arrays, element i of each
+ * belonging to vertex i, the way applications tend to keep them.
+ */
+struct k3_soa {
+  const float *x, *y, *z;
+  const float *r, *g, *b;
+};
+
+/*
+ * Interleave vertices [first, first + n) of a into dst in K3_VTX_RGB_XYZ
+ * layout. dst must be 8-byte aligned. Uses AVX2 or SSE2 with non-temporal
+ * stores when the CPU has them, so the DMA buffer does not evict the
+ * application's data from the cache; K3_PACK=scalar|sse2|avx2 overrides the
+ * choice. The stores are fenced before returning.
+ */
+void k3_pack_rgb_xyz(__u32 *dst, const struct k3_soa *a, size_t first,
+                     size_t n);
+// Name of the implementation k3_pack_rgb_xyz() uses.
+const char *k3_pack_name(void);
+
+// Pack 3 * ntris vertices of a into K3_VTX_RGB_XYZ triangles.
+int k3cmd_emit_soa(struct k3cmd *c, const struct k3_soa *a,
+                   unsigned int ntris);
+
+// Hand the current buffer to the card, if anything is in it. A worker always
+// gives its ticket back, empty or not.
+int k3cmd_submit(struct k3cmd *c);
+// Submit and wait until the card has consumed everything submitted so far.
+int k3cmd_finish(struct k3cmd *c, unsigned int timeout_ms);
+
+#endif
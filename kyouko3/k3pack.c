@@ -0,0 +1,177 @@
+/* vim: sw=2 ts=2 sts=2 et
+ *
+ * Structure-of-arrays to DMA vertex packing. See k3_pack_rgb_xyz() in
+ * k3cmd.h.
+ *
+ * Four vertices of r g b x y z are 24 words, exactly six 16-byte vectors, so
+ * the SIMD versions transpose (r g b x) as a 4x4 block and splice the (y z)
+ * pairs in between. AVX2 does the same on two groups of four at once, one
+ * per 128-bit lane, and then reorders the lanes.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "k3cmd.h"
+
+#define VTX_WORDS 6
+
+static void put_vtx(__u32 *dst, const struct k3_soa *a, size_t i) {
+  float v[VTX_WORDS] = {a->r[i], a->g[i], a->b[i], a->x[i], a->y[i], a->z[i]};
+  memcpy(dst, v, sizeof(v));
+}
+
+static void pack_scalar(__u32 *dst, const struct k3_soa *a, size_t first,
+                        size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    put_vtx(dst + i * VTX_WORDS, a, first + i);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+#define SSE2 __attribute__((target("sse2")))
+
+// Plain stores until dst is aligned to `bytes`, one vertex at a time. With an
+// 8-byte aligned dst that takes at most three vertices.
+static size_t pack_head(__u32 **dst, const struct k3_soa *a, size_t first,
+                        size_t n, size_t bytes) {
+  size_t i = 0;
+
+  while (i < n && ((uintptr_t)*dst & (bytes - 1))) {
+    put_vtx(*dst, a, first + i++);
+    *dst += VTX_WORDS;
+  }
+  return i;
+}
+
+static SSE2 void pack_sse2(__u32 *dst, const struct k3_soa *a, size_t first,
+                           size_t n) {
+  size_t i = pack_head(&dst, a, first, n, 16);
+
+  if ((uintptr_t)dst & 15) {
+    pack_scalar(dst, a, first + i, n - i);
+    return;
+  }
+  for (; i + 4 <= n; i += 4, dst += 4 * VTX_WORDS) {
+    size_t k = first + i;
+    __m128 r = _mm_loadu_ps(a->r + k), g = _mm_loadu_ps(a->g + k);
+    __m128 b = _mm_loadu_ps(a->b + k), x = _mm_loadu_ps(a->x + k);
+    __m128 y = _mm_loadu_ps(a->y + k), z = _mm_loadu_ps(a->z + k);
+    __m128 t0 = _mm_unpacklo_ps(r, g), t1 = _mm_unpackhi_ps(r, g);
+    __m128 t2 = _mm_unpacklo_ps(b, x), t3 = _mm_unpackhi_ps(b, x);
+    __m128 yz01 = _mm_unpacklo_ps(y, z), yz23 = _mm_unpackhi_ps(y, z);
+    // v_j = r_j g_j b_j x_j
+    __m128 v0 = _mm_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m128 v1 = _mm_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m128 v2 = _mm_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m128 v3 = _mm_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    float *o = (float *)dst;
+
+    _mm_stream_ps(o, v0);
+    _mm_stream_ps(o + 4, _mm_shuffle_ps(yz01, v1, _MM_SHUFFLE(1, 0, 1, 0)));
+    _mm_stream_ps(o + 8, _mm_shuffle_ps(v1, yz01, _MM_SHUFFLE(3, 2, 3, 2)));
+    _mm_stream_ps(o + 12, v2);
+    _mm_stream_ps(o + 16, _mm_shuffle_ps(yz23, v3, _MM_SHUFFLE(1, 0, 1, 0)));
+    _mm_stream_ps(o + 20, _mm_shuffle_ps(v3, yz23, _MM_SHUFFLE(3, 2, 3, 2)));
+  }
+  pack_scalar(dst, a, first + i, n - i);
+  _mm_sfence();
+}
+
+static AVX2 void pack_avx2(__u32 *dst, const struct k3_soa *a, size_t first,
+                           size_t n) {
+  size_t i = pack_head(&dst, a, first, n, 32);
+
+  if ((uintptr_t)dst & 31) {
+    pack_scalar(dst, a, first + i, n - i);
+    return;
+  }
+  for (; i + 8 <= n; i += 8, dst += 8 * VTX_WORDS) {
+    size_t k = first + i;
+    __m256 r = _mm256_loadu_ps(a->r + k), g = _mm256_loadu_ps(a->g + k);
+    __m256 b = _mm256_loadu_ps(a->b + k), x = _mm256_loadu_ps(a->x + k);
+    __m256 y = _mm256_loadu_ps(a->y + k), z = _mm256_loadu_ps(a->z + k);
+    __m256 t0 = _mm256_unpacklo_ps(r, g), t1 = _mm256_unpackhi_ps(r, g);
+    __m256 t2 = _mm256_unpacklo_ps(b, x), t3 = _mm256_unpackhi_ps(b, x);
+    __m256 yz01 = _mm256_unpacklo_ps(y, z), yz23 = _mm256_unpackhi_ps(y, z);
+    __m256 v0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 v1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 v2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 v3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    // The six 16-byte outputs of the SSE2 version, for vertices 0-3 in the
+    // low lane and 4-7 in the high lane.
+    __m256 o0 = v0;
+    __m256 o1 = _mm256_shuffle_ps(yz01, v1, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 o2 = _mm256_shuffle_ps(v1, yz01, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 o3 = v2;
+    __m256 o4 = _mm256_shuffle_ps(yz23, v3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 o5 = _mm256_shuffle_ps(v3, yz23, _MM_SHUFFLE(3, 2, 3, 2));
+    float *o = (float *)dst;
+
+    _mm256_stream_ps(o, _mm256_permute2f128_ps(o0, o1, 0x20));
+    _mm256_stream_ps(o + 8, _mm256_permute2f128_ps(o2, o3, 0x20));
+    _mm256_stream_ps(o + 16, _mm256_permute2f128_ps(o4, o5, 0x20));
+    _mm256_stream_ps(o + 24, _mm256_permute2f128_ps(o0, o1, 0x31));
+    _mm256_stream_ps(o + 32, _mm256_permute2f128_ps(o2, o3, 0x31));
+    _mm256_stream_ps(o + 40, _mm256_permute2f128_ps(o4, o5, 0x31));
+  }
+  pack_scalar(dst, a, first + i, n - i);
+  _mm_sfence();
+}
+#endif
+
+static const struct {
+  const char *name;
+  void (*fn)(__u32 *, const struct k3_soa *, size_t, size_t);
+} packers[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", pack_avx2},
+    {"sse2", pack_sse2},
+#endif
+    {"scalar", pack_scalar},
+};
+
+#define NPACKERS (sizeof(packers) / sizeof(packers[0]))
+
+static pthread_once_t packer_once = PTHREAD_ONCE_INIT;
+static unsigned int packer = NPACKERS - 1;
+
+static int cpu_has(const char *name) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (!strcmp(name, "avx2")) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (!strcmp(name, "sse2")) {
+    return __builtin_cpu_supports("sse2");
+  }
+#endif
+  return !strcmp(name, "scalar");
+}
+
+static void pick_packer(void) {
+  const char *want = getenv("K3_PACK");
+
+  for (unsigned int i = 0; i < NPACKERS; i++) {
+    if (cpu_has(packers[i].name) && (!want || !strcmp(want, packers[i].name))) {
+      packer = i;
+      return;
+    }
+  }
+}
+
+const char *k3_pack_name(void) {
+  pthread_once(&packer_once, pick_packer);
+  return packers[packer].name;
+}
+
+void k3_pack_rgb_xyz(__u32 *dst, const struct k3_soa *a, size_t first,
+                     size_t n) {
+  pthread_once(&packer_once, pick_packer);
+  packers[packer].fn(dst, a, first, n);
+}
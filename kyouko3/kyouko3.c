@@ -18,7 +18,18 @@
 #include <linux/cdev.h>
 #include <linux/pci.h>
 #include <linux/spinlock.h>
-#include <linux/circ_buf.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/kref.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/io.h>
+#include <linux/workqueue.h>
 
 #include "kyouko3.h"
 
@@ -26,11 +37,29 @@ MODULE_LICENSE("Proprietary");
 MODULE_AUTHOR("Sriram Madhivanan, Tyler Allen, Keerthan Jaic,"
 	      " Praarthana Ramakrishnan");
 
-// This queue head is used for snoozing while DMA buffers are full.
-DECLARE_WAIT_QUEUE_HEAD(dma_snooze);
-// This queue head is used for snoozing while waiting for DMA buffers to
-// completely empty before exiting.
-DECLARE_WAIT_QUEUE_HEAD(unbind_snooze);
+// Flushers sleep here until the hardware FIFO catches up.
+DECLARE_WAIT_QUEUE_HEAD(fifo_snooze);
+// CAPTURE and CAPTURE_WAIT sleep here until capture_work() lands a capture.
+DECLARE_WAIT_QUEUE_HEAD(capture_snooze);
+// LIST_REPLAY, BO_SUBMIT, BO_WAIT, list and buffer object teardown and
+// flushers sleep here until a job is dispatched or done.
+DECLARE_WAIT_QUEUE_HEAD(job_snooze);
+
+// Give up on a FIFO flush after this long without the tail catching up.
+#define FIFO_FLUSH_TIMEOUT_MS 2000
+// Bounds for the interval at which a sleeping flusher re-reads FIFO_TAIL.
+#define FIFO_POLL_MIN_US 10UL
+#define FIFO_POLL_MAX_US 1000UL
+// Ring occupancy histogram buckets: 1, 2, 3-4, ... up to DMA_BUFNUM_MAX.
+#define STATS_OCC_BUCKETS 7
+// Pipeline events kept for the events file.
+#define K3_EVENTS 256
+// Most DMA buffers, and bytes of them, kept in k3.pool between binds.
+#define DMA_POOL_MAX 64
+#define DMA_POOL_MAXSIZE (16 * 1024 * 1024)
+// Most replays of one display list, or submissions of one buffer object,
+// queued for the card at once.
+#define JOB_DEPTH 64
 
 struct phys_region {
 	phys_addr_t p_base;
@@ -43,55 +72,580 @@ struct _fifo {
 	struct fifo_entry *k_base;
 	u32 head;
 	u32 tail_cache;
+	// Last head value written to FIFO_HEAD.
+	u32 kicked;
+	// Entries ever written, and ever consumed as of tail_cache.
+	u64 queued;
+	u64 retired;
 };
 
 struct k3_dma_buf {
 	unsigned int *k_base;
-	unsigned long u_base;
 	dma_addr_t handle;
 	int size;
-} dma[DMA_BUFNUM];
+	// Fence that signals once the card has consumed this buffer.
+	u64 fence;
+	// Submitted through SUBMIT_DMA but waiting for earlier tickets.
+	bool ready;
+};
+
+/*
+ * Context memory the driver maps into the client with vm_mmap(), under lock.
+ * vma is the mapping that call made and addr its address, both cleared once
+ * it is unmapped or split; the driver never unmaps anything else. maps
+ * counts every vma onto the memory, the client's own mmap()s included, and
+ * the memory is not freed while it is non-zero.
+ */
+struct k3_umap {
+	spinlock_t lock;
+	struct vm_area_struct *vma;
+	unsigned long addr;
+	unsigned long len;
+	int maps;
+	// Task inside umap_map(), whose mmap() is the driver's own.
+	struct task_struct *mapper;
+};
+
+/*
+ * Coherent buffers given back by rings that went away, kept for the next
+ * bind of the same buffer size instead of being freed. The pool lives as
+ * long as the device. Protected by k3.open_lock.
+ */
+struct k3_pool_buf {
+	unsigned int *k_base;
+	dma_addr_t handle;
+	u32 size;
+};
+
+struct k3_pool {
+	struct k3_pool_buf bufs[DMA_POOL_MAX];
+	int n;
+	u32 bytes;
+};
+
+/*
+ * A display list from LIST_CREATE. The entries are copied into the FIFO on
+ * every replay; the packets stay in coherent memory and the card runs them
+ * from there.
+ */
+struct k3_list {
+	struct fifo_entry *entries;
+	u32 count;
+	void *k_base;
+	dma_addr_t handle;
+	u32 size;
+	// Replays queued, and replays the card has finished. Changed under
+	// k3.lock.
+	u64 queued;
+	u64 done;
+};
+
+/*
+ * A buffer object from BO_CREATE. One reference belongs to the handle, one
+ * to every mapping and one to every submission until the card has run it.
+ * After the last, bo_free_work() gives the memory back to k3.pool.
+ */
+struct k3_bo {
+	struct kref ref;
+	// On k3.bo_free once released.
+	struct list_head free_node;
+	unsigned int *k_base;
+	dma_addr_t handle;
+	u32 size;
+	// Submissions queued, and submissions the card has finished. Changed
+	// under k3.lock.
+	u64 queued;
+	u64 done;
+};
+
+/*
+ * A DMA of packets the driver keeps rather than of a context's ring buffer,
+ * queued on k3.jobs. dma_kick_idle() hands jobs to the card in turn with the
+ * contexts' buffers, one per interrupt. The tag says whose packets they are.
+ */
+enum k3_job_tag {
+	K3_JOB_LIST,
+	K3_JOB_BO,
+};
+
+struct k3_job {
+	struct list_head node;
+	enum k3_job_tag tag;
+	// K3_JOB_LIST: the list replayed.
+	struct k3_list *list;
+	// K3_JOB_BO: the buffer object, and the bytes of it submitted.
+	struct k3_bo *bo;
+	u32 offset;
+	u32 count;
+};
+
+/*
+ * Per-open-file state. Every client gets its own ring of DMA buffers with its
+ * own fill/drain indices and its own snooze queues. Buffers from all bound
+ * contexts are funnelled into the single hardware FIFO by dma_dispatch().
+ */
+struct k3_ctx {
+	struct k3_dma_buf *dma;
+	// The buffers, back to back, in the client.
+	struct k3_umap dma_map;
+	// Ring geometry chosen at bind time.
+	u32 nbufs;
+	u32 bufsize;
+	u32 fill;
+	u32 drain;
+	// Set while a ring is bound, and the submission paths using it, under
+	// k3.lock. UNBIND_DMA waits for dma_pins to drop to 0.
+	bool dma_on;
+	u32 dma_pins;
+	// Snoozing while this context's DMA buffers are full.
+	wait_queue_head_t dma_snooze;
+	// Snoozing while waiting for this context's DMA buffers to completely
+	// empty, and for its submission paths to leave, before unbinding.
+	wait_queue_head_t unbind_snooze;
+	// Entry in k3.ctxs while DMA is bound.
+	struct list_head node;
+	// Last fence handed out, last fence the card finished and last fence
+	// returned by read().
+	u64 fence_submitted;
+	u64 fence_done;
+	u64 fence_read;
+	// Next ACQUIRE_DMA ticket. Tickets in [fence_submitted, ticket_next)
+	// are held by userspace; ticket t becomes fence t + 1 once queued.
+	u64 ticket_next;
+	// Waiters on fence_done: WAIT_FENCE, read() and poll().
+	wait_queue_head_t fence_snooze;
+	// Page shared with userspace by SETUP_RING, its mapping, and the
+	// same page once the ring is live.
+	struct kyouko3_ring *ring_page;
+	struct k3_umap ring_map;
+	struct kyouko3_ring *ring;
+	// Buffer from SETUP_CAPTURE that capture_work() copies device RAM
+	// into, and its mapping.
+	void *cap_base;
+	dma_addr_t cap_handle;
+	u32 cap_size;
+	struct k3_umap cap_map;
+	// Last capture queued and last one landed, under k3.lock. Per capture,
+	// indexed by seq % K3_CAPTURE_DEPTH: the request, the FIFO position
+	// (fifo.queued) the card must get past before it is copied, and once
+	// it has landed, how that went.
+	u64 cap_seq;
+	u64 cap_done;
+	struct kyouko3_capture cap_req[K3_CAPTURE_DEPTH];
+	u64 cap_pos[K3_CAPTURE_DEPTH];
+	int cap_err[K3_CAPTURE_DEPTH];
+	// Copies queued captures out as the card gets past them. Always queued
+	// with no delay; it is delayed work for flush_delayed_work(), which
+	// unlike flush_work() is not EXPORT_SYMBOL_GPL.
+	struct delayed_work cap_work;
+	// Display lists, indexed by handle - 1, and the lock that serializes
+	// creating, patching and destroying them.
+	struct k3_list *lists[K3_LIST_MAX];
+	struct mutex list_lock;
+	// Buffer objects, indexed by handle - 1, under bo_lock.
+	struct k3_bo *bos[K3_BO_MAX];
+	struct mutex bo_lock;
+	// Serializes binding and unbinding the DMA ring.
+	struct mutex bind_lock;
+	// Number (k3.jobs_queued) of the last list replay or buffer object
+	// submission this context queued, under k3.lock.
+	u64 last_job;
+};
+
+/*
+ * Device RAM blocks, sorted by offset. Clients get blocks from the top of
+ * RAM down; the bottom is left to the scanout surface, which the driver
+ * reserves at a fixed offset.
+ */
+struct k3_vram_ext {
+	u32 off;
+	u32 len;
+	u32 handle;
+	// NULL for the driver's own reservations.
+	struct k3_ctx *owner;
+};
+
+struct k3_vram {
+	// Serializes allocations. Taken after open_lock, before k3.lock.
+	struct mutex lock;
+	struct k3_vram_ext ext[K3_VRAM_MAX];
+	int n;
+	u32 next_handle;
+	u32 used;
+	u32 peak;
+	// Reservation for the scanout surface while graphics are on.
+	u32 screen;
+};
+
+/*
+ * Page flipping between surfaces of device RAM, owned by the client that set
+ * it up. The rasterizer draws into the surface FRAME_STARTADDRESS describes;
+ * a write to ENC_FRAME has the encoder take up that surface and keep showing
+ * it until the next one. A flip waits for the owner's DMA buffers submitted
+ * before it, then goes into the FIFO behind them; see flip_write(). owner
+ * changes under both k3.vram.lock and k3.lock, the rest under k3.lock.
+ */
+struct k3_flip {
+	struct k3_ctx *owner;
+	u32 nbufs;
+	u32 size;
+	// The driver's reservation of surfaces 1 and up.
+	u32 vram;
+	// Surface drawn into once every requested flip has run.
+	u32 back;
+	// Last flip requested, last written to the FIFO, last the card ran.
+	u64 seq;
+	u64 queued;
+	u64 done;
+	// Per flip in flight, indexed by seq % K3_FLIP_MAX: the surface it
+	// shows, the owner's fence it waits for and, once written, the FIFO
+	// position (fifo.queued) at which it has run.
+	u32 surf[K3_FLIP_MAX];
+	u64 fence[K3_FLIP_MAX];
+	u64 pos[K3_FLIP_MAX];
+};
+
+/*
+ * Counters behind the stats file, under k3.lock. Times are in ns; each *_ns
+ * total goes with the count above it.
+ */
+struct k3_stats {
+	u64 submitted;
+	u64 bytes;
+	// Buffers queued or in flight on the ring, counted at each submit.
+	u64 occupancy[STATS_OCC_BUCKETS];
+	u64 dispatches;
+	// DMA interrupts, and the time from the top half to the thread.
+	u64 interrupts;
+	u64 irq_ns;
+	u64 irq_max_ns;
+	// Waits for a free buffer in initiate_transfer().
+	u64 snoozes;
+	u64 snooze_ns;
+	u64 snooze_max_ns;
+	u64 flushes;
+	u64 flush_ns;
+	u64 flush_max_ns;
+	u64 flush_timeouts;
+};
+
+enum k3_event_type {
+	K3_EV_SUBMIT,
+	K3_EV_DISPATCH,
+	K3_EV_COMPLETE,
+	K3_EV_FLUSH,
+};
+
+/*
+ * A step of the submission pipeline, for the events file. What a and b hold
+ * depends on the type:
+ *  - K3_EV_SUBMIT: the buffer's size, and the buffers queued on its ring,
+ *    itself and those in flight included.
+ *  - K3_EV_DISPATCH: the bytes handed to the card, and the FIFO position
+ *    (fifo.queued) after them.
+ *  - K3_EV_COMPLETE: the time from the interrupt to the threaded handler
+ *    that retired the buffer.
+ *  - K3_EV_FLUSH: the FIFO_FLUSH's wait in ns, and what it returned. fence
+ *    is the FIFO index it waited for.
+ */
+struct k3_event {
+	u64 ns;
+	enum k3_event_type type;
+	const void *ctx;
+	u64 fence;
+	u64 a;
+	s64 b;
+};
 
 struct kyouko3_vars {
 	struct phys_region control;
 	struct phys_region fb;
 	bool graphics_on;
-	bool dma_on;
 	struct _fifo fifo;
 	struct pci_dev *pdev;
-	u32 fill;
-	u32 drain;
+	// Protects the FIFO, the context list and every context's fill/drain.
 	spinlock_t lock;
-	bool dma_snoozing;
-	bool unbind_snoozing;
-	bool dma_bufs_dirty;
+	// Serializes open/release and DMA bind/unbind.
+	struct mutex open_lock;
+	int users;
+	int dma_users;
+	// Contexts with DMA bound, in round-robin dispatch order.
+	struct list_head ctxs;
+	// Context whose buffer the hardware is currently consuming,
+	// or NULL.
+	struct k3_ctx *active;
+	// A context was torn down while the card still owned its buffer.
+	// Nothing is dispatched until the interrupt for that buffer comes in,
+	// or the DMA interrupt is set up again from scratch.
+	bool wedged;
+	// Jobs waiting for the card, oldest first, and the one it is running
+	// in place of a context's buffer, or NULL. job_ran is set while the
+	// last dispatch was a job, so that a context goes next.
+	struct list_head jobs;
+	struct k3_job *job;
+	bool job_ran;
+	// Jobs ever queued and ever handed to the card. Jobs go out in the
+	// order they were queued, so job number n has been written to the
+	// FIFO once jobs_dispatched >= n.
+	u64 jobs_queued;
+	u64 jobs_dispatched;
+	// A dispatch found the FIFO full; dispatch_work retries it.
+	bool dispatch_pending;
+	struct delayed_work dispatch_work;
+	// Released buffer objects, freed by bo_free_work in process context.
+	// The last reference can go from the interrupt thread, under k3.lock.
+	// Delayed work, queued with no delay, for flush_delayed_work().
+	spinlock_t bo_free_lock;
+	struct list_head bo_free;
+	struct delayed_work bo_free_work;
+	struct k3_vram vram;
+	struct k3_flip flip;
+	struct k3_pool pool;
+	struct k3_stats stats;
+	// When dma_isr() last woke dma_irq_thread().
+	u64 irq_stamp;
+	// The last K3_EVENTS pipeline events, oldest at events_next %
+	// K3_EVENTS once it has wrapped, under k3.lock.
+	struct k3_event events[K3_EVENTS];
+	u64 events_next;
+	struct proc_dir_entry *proc;
 } k3;
 
-/* Efficient way to increment index of circ buffer whose size is a power of two.
- * Equivalent to (idx + 1) % size
- * Inspired by Documentation/circ-buf.txt */
-static inline void dmaq_inc_idx(u32 *idx)
+/* Increment an index into the context's dma ring.
+ * Equivalent to (idx + 1) % nbufs, but the ring depth is no longer a power
+ * of two so a compare is cheaper than the division. */
+static inline void dmaq_inc_idx(struct k3_ctx *ctx, u32 *idx)
 {
-	*idx = (*idx + 1) & (DMA_BUFNUM - 1);
+	if (++*idx == ctx->nbufs) {
+		*idx = 0;
+	}
+}
+
+// Returns the number of buffers queued or in flight on the context's ring.
+// Counted from the fences rather than from fill and drain, because with
+// ACQUIRE_DMA every buffer of the ring can be queued at once, and then
+// fill == drain.
+static inline u32 dmaq_cnt(struct k3_ctx *ctx)
+{
+	return ctx->fence_submitted - READ_ONCE(ctx->fence_done);
+}
+
+// True when every buffer but the one userspace is filling is queued.
+static inline bool dmaq_full(struct k3_ctx *ctx)
+{
+	return dmaq_cnt(ctx) >= ctx->nbufs - 1;
+}
+
+/*
+ * ktime_get_ns() and friends are EXPORT_SYMBOL_GPL; the raw monotonic clock
+ * is not, and is as good for timing the pipeline.
+ */
+static inline u64 k3_now_ns(void)
+{
+	struct timespec64 ts;
+
+	ktime_get_raw_ts64(&ts);
+	return timespec64_to_ns(&ts);
+}
+
+// Record a pipeline event. Must be called with k3.lock held.
+static void k3_event(enum k3_event_type type, const void *ctx, u64 fence,
+		     u64 a, s64 b)
+{
+	struct k3_event *e = &k3.events[k3.events_next++ % K3_EVENTS];
+
+	e->ns = k3_now_ns();
+	e->type = type;
+	e->ctx = ctx;
+	e->fence = fence;
+	e->a = a;
+	e->b = b;
+}
+
+static inline void stats_time(u64 *total, u64 *max, u64 ns)
+{
+	*total += ns;
+	if (ns > *max) {
+		*max = ns;
+	}
+}
+
+/*
+ * Account for the buffer just queued at the context's fill index.
+ * Must be called with k3.lock held.
+ */
+static void dma_note_submit(struct k3_ctx *ctx, struct k3_dma_buf *buf)
+{
+	u32 cnt = dmaq_cnt(ctx);
+
+	k3.stats.submitted++;
+	k3.stats.bytes += buf->size;
+	k3.stats.occupancy[min(fls(cnt - 1), STATS_OCC_BUCKETS - 1)]++;
+	k3_event(K3_EV_SUBMIT, ctx, buf->fence, buf->size, cnt);
+}
+
+// True when ACQUIRE_DMA can hand out a buffer: the one ticket_next maps to
+// has been retired by the card.
+static inline bool dmaq_ticket_free(struct k3_ctx *ctx)
+{
+	return ctx->ticket_next - READ_ONCE(ctx->fence_done) < ctx->nbufs;
+}
+
+// Ring index of a held ticket's buffer. Must be called with k3.lock held.
+static inline u32 dmaq_ticket_idx(struct k3_ctx *ctx, u64 ticket)
+{
+	return (ctx->fill + (u32)(ticket - ctx->fence_submitted)) % ctx->nbufs;
+}
+
+static void umap_init(struct k3_umap *um)
+{
+	spin_lock_init(&um->lock);
+}
+
+// Address of the driver's own mapping, or 0 once it has gone away.
+static inline unsigned long umap_addr(struct k3_umap *um)
+{
+	return READ_ONCE(um->addr);
+}
+
+// User address of buffer i of the context's ring, or 0 if it is not mapped.
+static inline unsigned long dma_u_base(struct k3_ctx *ctx, u32 i)
+{
+	unsigned long addr = umap_addr(&ctx->dma_map);
+
+	return addr ? addr + (unsigned long)i * ctx->bufsize : 0;
+}
+
+// Count a new vma onto um from kyouko3_mmap(), once it has succeeded.
+static void umap_attach(struct k3_umap *um, struct vm_area_struct *vma)
+{
+	spin_lock(&um->lock);
+	um->maps++;
+	if (um->mapper == current && !um->vma) {
+		um->vma = vma;
+	}
+	spin_unlock(&um->lock);
+	vma->vm_private_data = um;
+}
+
+/*
+ * A vma copied by fork() or split off by munmap() or mprotect(). After a
+ * split, the driver's own mapping is no longer whole.
+ */
+static void umap_vm_open(struct vm_area_struct *vma)
+{
+	struct k3_umap *um = vma->vm_private_data;
+
+	spin_lock(&um->lock);
+	um->maps++;
+	if (um->vma && um->vma->vm_mm == vma->vm_mm) {
+		um->vma = NULL;
+		WRITE_ONCE(um->addr, 0);
+	}
+	spin_unlock(&um->lock);
+}
+
+static void umap_vm_close(struct vm_area_struct *vma)
+{
+	struct k3_umap *um = vma->vm_private_data;
+
+	spin_lock(&um->lock);
+	um->maps--;
+	if (um->vma == vma) {
+		um->vma = NULL;
+		WRITE_ONCE(um->addr, 0);
+	}
+	spin_unlock(&um->lock);
+}
+
+static const struct vm_operations_struct umap_vm_ops = {.open = umap_vm_open,
+						       .close = umap_vm_close};
+
+// Map len bytes at pgoff into the caller and remember the mapping as um's.
+static unsigned long umap_map(struct file *fp, struct k3_umap *um,
+			      unsigned long len, unsigned long prot,
+			      unsigned long pgoff)
+{
+	unsigned long addr;
+
+	spin_lock(&um->lock);
+	um->mapper = current;
+	spin_unlock(&um->lock);
+	addr = vm_mmap(fp, 0, len, prot, MAP_SHARED, pgoff);
+	spin_lock(&um->lock);
+	um->mapper = NULL;
+	if (!IS_ERR_VALUE(addr) && um->vma && um->vma->vm_start == addr) {
+		um->len = len;
+		WRITE_ONCE(um->addr, addr);
+	} else {
+		um->vma = NULL;
+	}
+	spin_unlock(&um->lock);
+	return addr;
 }
 
-// Returns the number of elements pressent in the dma circ buffer.
-// (k3.fill - k3.tail) & (DMA_BUFNUM -1)
-// CIRC_CNT is in include/linux/circ_buf.h
-static inline int dmaq_cnt(void)
+/*
+ * Unmap the driver's own mapping of um, if it still has it and it lives in
+ * the caller. Returns true if nothing maps the memory any more and it can
+ * be freed.
+ */
+static bool umap_unmap(struct k3_umap *um)
 {
-	return CIRC_CNT(k3.fill, k3.drain, DMA_BUFNUM);
+	unsigned long addr = 0;
+	unsigned long len = 0;
+	bool idle;
+
+	spin_lock(&um->lock);
+	if (um->vma && um->vma->vm_mm == current->mm) {
+		addr = um->addr;
+		len = um->len;
+	}
+	spin_unlock(&um->lock);
+	if (addr) {
+		vm_munmap(addr, len);
+	}
+	spin_lock(&um->lock);
+	idle = um->maps == 0;
+	spin_unlock(&um->lock);
+	return idle;
 }
 
 static inline void K_WRITE_REG(u32 reg, u32 value)
 {
-	*(k3.control.k_base + (reg >> 2)) = value;
+	iowrite32(value, k3.control.k_base + (reg >> 2));
 }
 
 static inline u32 K_READ_REG(u32 reg)
 {
 	rmb();
-	return *(k3.control.k_base + (reg >> 2));
+	return ioread32(k3.control.k_base + (reg >> 2));
+}
+
+static void dma_kick_idle(void);
+
+/*
+ * The FIFO had no room for a dispatch, and nothing here may sleep until it
+ * has. The card raises no interrupt for FIFO space, so dispatch_work tries
+ * again a jiffy later, and keeps doing so for as long as the FIFO stays full.
+ * Must be called with k3.lock held.
+ */
+static void dma_defer(void)
+{
+	if (!k3.dispatch_pending) {
+		k3.dispatch_pending = true;
+		schedule_delayed_work(&k3.dispatch_work, 1);
+	}
+}
+
+static void dma_dispatch_work(struct work_struct *work)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	k3.dispatch_pending = false;
+	dma_kick_idle();
+	spin_unlock_irqrestore(&k3.lock, flags);
+	wake_up_interruptible(&fifo_snooze);
 }
 
 void fifo_init(void)
@@ -102,204 +656,2591 @@ void fifo_init(void)
 	K_WRITE_REG(FIFO_END, k3.fifo.p_base + 8 * FIFO_ENTRIES);
 	k3.fifo.head = 0;
 	k3.fifo.tail_cache = 0;
+	k3.fifo.kicked = 0;
+	k3.fifo.queued = 0;
+	k3.fifo.retired = 0;
 }
 
-void fifo_flush(void)
+/*
+ * Ring the doorbell if anything was written since the last kick. Writers
+ * only touch FIFO_HEAD once per logical batch through here, so back to back
+ * bursts cost a single uncached MMIO write.
+ * Must be called with k3.lock held.
+ */
+static inline void fifo_kick(void)
 {
-	pr_debug("fifo flush starting\n");
-	K_WRITE_REG(FIFO_HEAD, k3.fifo.head);
-	while (k3.fifo.tail_cache != k3.fifo.head) {
-		k3.fifo.tail_cache = K_READ_REG(FIFO_TAIL);
-		schedule();
+	if (k3.fifo.kicked != k3.fifo.head) {
+		K_WRITE_REG(FIFO_HEAD, k3.fifo.head);
+		k3.fifo.kicked = k3.fifo.head;
 	}
-	pr_debug("fifo flush done\n");
 }
 
-void fifo_write(u32 cmd, u32 val)
+/*
+ * Free slots in the ring as of the last tail we read. One slot stays empty
+ * so that head == tail always means empty.
+ * Must be called with k3.lock held.
+ */
+static inline u32 fifo_credits(void)
 {
-	k3.fifo.k_base[k3.fifo.head].command = cmd;
-	k3.fifo.k_base[k3.fifo.head].value = val;
-	k3.fifo.head++;
-	if (k3.fifo.head >= FIFO_ENTRIES) {
-		k3.fifo.head = 0;
-	}
+	return (k3.fifo.tail_cache - k3.fifo.head - 1) & (FIFO_ENTRIES - 1);
 }
 
 /*
- * DMA interrupt handler.
+ * Refresh tail_cache from FIFO_TAIL, adding what the card consumed since the
+ * last read to fifo.retired. Writers read the tail before they can get more
+ * than FIFO_ENTRIES - 1 entries ahead of tail_cache, so the tail never laps
+ * unnoticed.
+ * Must be called with k3.lock held.
  */
-irqreturn_t dma_isr(int irq, void *dev_id, struct pt_regs *regs)
+static void fifo_read_tail(void)
 {
-	int cnt;
-	u32 iflags = K_READ_REG(INFO_STATUS);
+	u32 tail = K_READ_REG(FIFO_TAIL);
 
-	K_WRITE_REG(INFO_STATUS, 0xf);
+	k3.fifo.retired += (tail - k3.fifo.tail_cache) & (FIFO_ENTRIES - 1);
+	k3.fifo.tail_cache = tail;
+}
 
-	// spurious interrupt
-	if ((iflags & 0x02) == 0) {
-		return IRQ_NONE;
+/*
+ * Check that n more entries fit without overwriting anything the hardware
+ * has not consumed yet. FIFO_TAIL is only read once the cached credits run
+ * out. If there is still no room, whatever is queued gets kicked so the
+ * hardware can make progress.
+ * Must be called with k3.lock held.
+ */
+static bool fifo_reserve(u32 n)
+{
+	if (fifo_credits() >= n) {
+		return true;
 	}
+	fifo_read_tail();
+	if (fifo_credits() >= n) {
+		return true;
+	}
+	fifo_kick();
+	return false;
+}
 
-	// we just drained a buffer
-	dmaq_inc_idx(&k3.drain);
+// Unlocked peek used as a wakeup condition by fifo_wait_room().
+static bool fifo_has_room(u32 n)
+{
+	u32 tail = K_READ_REG(FIFO_TAIL);
 
-	// number of elements in the DMA queue now.
-	cnt = dmaq_cnt();
+	return ((tail - READ_ONCE(k3.fifo.head) - 1) & (FIFO_ENTRIES - 1)) >= n;
+}
 
-	pr_debug("dma_isr: cnt %d\n", cnt);
+/*
+ * Sleep on fifo_snooze until cond holds, for at most about poll_us. The card
+ * raises no interrupt for FIFO progress, so a sleeper has to re-read the tail
+ * now and then; intervals shorter than a jiffy are slept out with
+ * usleep_range(), which a wakeup does not cut short. Gives 0 once cond holds,
+ * -ETIME if it still does not, or -ERESTARTSYS on a signal.
+ */
+#define fifo_poll(cond, poll_us)                                               \
+	({                                                                     \
+		unsigned long __us = (poll_us);                                \
+		long __ret = 0;                                                \
+		if (cond) {                                                    \
+		} else if (__us < jiffies_to_usecs(1)) {                       \
+			usleep_range(__us, 2 * __us);                          \
+			if (!(cond)) {                                         \
+				__ret = signal_pending(current) ? -ERESTARTSYS \
+								: -ETIME;      \
+			}                                                      \
+		} else {                                                       \
+			__ret = wait_event_interruptible_timeout(              \
+			    fifo_snooze, cond, usecs_to_jiffies(__us));        \
+			__ret = __ret > 0 ? 0 : __ret ? __ret : -ETIME;        \
+		}                                                              \
+		__ret;                                                         \
+	})
 
-	if (cnt == 0) {
-		// Queue is empty. If user was ready to unbind, wake him up.
-		if (k3.unbind_snoozing) {
-			pr_debug("unbind_snoozing\n");
-			k3.unbind_snoozing = false;
-			wake_up_interruptible(&unbind_snooze);
-			return IRQ_HANDLED;
+/*
+ * Make room for n entries, dropping k3.lock and sleeping on fifo_snooze while
+ * the hardware catches up. Gives up once FIFO_TAIL has not moved for
+ * FIFO_FLUSH_TIMEOUT_MS.
+ * Must be called with k3.lock held; returns with it held.
+ */
+static int fifo_wait_room(u32 n, unsigned long *flags)
+{
+	unsigned long deadline;
+	unsigned long poll_us = FIFO_POLL_MIN_US;
+	u32 tail = k3.fifo.tail_cache;
+	int ret;
+
+	deadline = jiffies + msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS);
+	while (!fifo_reserve(n)) {
+		if (k3.fifo.tail_cache != tail) {
+			tail = k3.fifo.tail_cache;
+			deadline = jiffies +
+				   msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS);
 		}
-	} else {
-		// Queue is non-empty. dispatch the next entry
-		fifo_write(BUFA_ADDR, dma[k3.drain].handle);
-		fifo_write(BUFA_CONF, dma[k3.drain].size);
-		K_WRITE_REG(FIFO_HEAD, k3.fifo.head);
+		spin_unlock_irqrestore(&k3.lock, *flags);
+		ret = fifo_poll(fifo_has_room(n), poll_us);
+		spin_lock_irqsave(&k3.lock, *flags);
+		if (ret == -ERESTARTSYS) {
+			return ret;
+		}
+		if (time_after(jiffies, deadline)) {
+			pr_warn("fifo stalled\n");
+			return -ETIMEDOUT;
+		}
+		poll_us = min(poll_us * 2, FIFO_POLL_MAX_US);
 	}
+	return 0;
+}
 
-	if (k3.dma_snoozing) {
-		k3.dma_snoozing = false;
-		wake_up_interruptible(&dma_snooze);
-	}
+/*
+ * True once the hardware has consumed every entry written before `target`.
+ * Other clients may keep queueing while we wait, so instead of waiting for
+ * tail == head we check whether the tail has moved into [target, head].
+ */
+static bool fifo_consumed(u32 target)
+{
+	u32 tail = K_READ_REG(FIFO_TAIL);
+	u32 head = READ_ONCE(k3.fifo.head);
 
-	return IRQ_HANDLED;
+	return ((tail - target) & (FIFO_ENTRIES - 1)) <=
+	       ((head - target) & (FIFO_ENTRIES - 1));
+}
+
+// True once job number n has been written to the FIFO.
+static bool jobs_dispatched(u64 n)
+{
+	return READ_ONCE(k3.jobs_dispatched) >= n;
 }
 
 /*
- * Initiate a DMA request if possible.
+ * Wait for the hardware to consume everything queued so far.
+ *
+ * Jobs only go into the FIFO as the dispatcher gets to them, so we first
+ * wait for ctx's last list replay or buffer object submission to go out, or
+ * with a NULL ctx for every job queued so far. Other clients' jobs queued
+ * later are not waited for. If that wait times out, the FIFO is not waited
+ * for either.
+ *
+ * Rather than spinning on FIFO_TAIL we sleep on fifo_snooze. dma_irq_thread()
+ * wakes it on every DMA interrupt; in between fifo_poll() re-checks the tail
+ * at exponentially backed off intervals so short flushes stay fast and long
+ * ones cost next to no CPU. Returns -ETIMEDOUT if FIFO_TAIL stops moving for
+ * FIFO_FLUSH_TIMEOUT_MS, however long the whole flush takes.
  */
-void initiate_transfer(unsigned long size)
+int fifo_flush(struct k3_ctx *ctx)
 {
-	int cnt;
+	u32 target, tail;
 	unsigned long flags;
-	pr_debug("initiate_transfer\n");
+	unsigned long deadline;
+	unsigned long poll_us = FIFO_POLL_MIN_US;
+	u64 start = k3_now_ns();
+	u64 wait_ns, job;
+	int ret, err = 0;
 
+	pr_debug("fifo flush starting\n");
 	spin_lock_irqsave(&k3.lock, flags);
-	dma[k3.fill].size = size;
+	job = ctx ? ctx->last_job : k3.jobs_queued;
+	spin_unlock_irqrestore(&k3.lock, flags);
+	ret = wait_event_interruptible_timeout(
+	    job_snooze, jobs_dispatched(job),
+	    msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS));
+	if (ret < 0) {
+		return ret;
+	}
+	if (ret == 0) {
+		pr_warn("fifo flush gave up on queued jobs\n");
+		err = -ETIMEDOUT;
+		target = 0;
+		goto out;
+	}
+	spin_lock_irqsave(&k3.lock, flags);
+	dma_kick_idle();
+	fifo_kick();
+	target = k3.fifo.head;
+	spin_unlock_irqrestore(&k3.lock, flags);
 
-	// This is the number of items currently in the DMA queue.
-	// It will lie between 0 and DMA_BUFNUM-1 (Almost full).
-	// The Queue could be in three possible states: Empty, partially full,
-	// and almost full.
-	cnt = dmaq_cnt();
+	tail = K_READ_REG(FIFO_TAIL);
+	deadline = jiffies + msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS);
+	while (!fifo_consumed(target)) {
+		if (K_READ_REG(FIFO_TAIL) != tail) {
+			tail = K_READ_REG(FIFO_TAIL);
+			deadline = jiffies +
+				   msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS);
+		}
+		ret = fifo_poll(fifo_consumed(target), poll_us);
+		if (ret == -ERESTARTSYS) {
+			return ret;
+		}
+		if (ret == 0) {
+			break;
+		}
+		if (time_after(jiffies, deadline)) {
+			pr_warn("fifo flush timed out\n");
+			err = -ETIMEDOUT;
+			break;
+		}
+		poll_us = min(poll_us * 2, FIFO_POLL_MAX_US);
+	}
 
-	// Increment the fill pointer for the next producer
-	dmaq_inc_idx(&k3.fill);
+out:
+	wait_ns = k3_now_ns() - start;
+	spin_lock_irqsave(&k3.lock, flags);
+	k3.stats.flushes++;
+	stats_time(&k3.stats.flush_ns, &k3.stats.flush_max_ns, wait_ns);
+	if (err) {
+		k3.stats.flush_timeouts++;
+	}
+	k3_event(K3_EV_FLUSH, ctx, target, wait_ns, err);
+	spin_unlock_irqrestore(&k3.lock, flags);
+	pr_debug("fifo flush done\n");
+	return err;
+}
 
-	if (cnt == 0) {
-		// Queue was empty, dispatch buffer.
-		fifo_write(BUFA_ADDR, dma[k3.drain].handle);
-		fifo_write(BUFA_CONF, dma[k3.drain].size);
-		K_WRITE_REG(FIFO_HEAD, k3.fifo.head);
+// Must be called with k3.lock held, after reserving room with fifo_reserve()
+// or one of its wrappers. Does not ring the doorbell; see fifo_kick().
+void fifo_write(u32 cmd, u32 val)
+{
+	k3.fifo.k_base[k3.fifo.head].command = cmd;
+	k3.fifo.k_base[k3.fifo.head].value = val;
+	k3.fifo.head++;
+	if (k3.fifo.head >= FIFO_ENTRIES) {
+		k3.fifo.head = 0;
+	}
+	k3.fifo.queued++;
+}
 
-		spin_unlock_irqrestore(&k3.lock, flags);
-		return;
-	} else if (cnt == DMA_BUFNUM - 1) {
-		// This entry filled up the Queue.
-		// We wait here till a buffer is drained.
-		k3.dma_snoozing = true;
-		spin_unlock_irqrestore(&k3.lock, flags);
-		wait_event_interruptible(dma_snooze, !k3.dma_snoozing);
-		return;
+/*
+ * Copy a user array of fifo entries into the ring and kick the hardware once.
+ */
+long fifo_write_batch(struct fifo_batch __user *argp)
+{
+	struct fifo_batch batch;
+	struct fifo_entry *entries;
+	unsigned long flags;
+	u32 i;
+	int ret;
+
+	if (copy_from_user(&batch, argp, sizeof(struct fifo_batch)))
+		return -EFAULT;
+	if (batch.count == 0) {
+		return 0;
+	}
+	// A batch larger than the ring could never be reserved in one go.
+	if (batch.count > FIFO_ENTRIES - 1) {
+		return -EINVAL;
 	}
 
-	// If the queue was only partially filled, there is nothing else to do.
+	entries = memdup_user((void __user *)(unsigned long)batch.entries,
+			      batch.count * sizeof(struct fifo_entry));
+	if (IS_ERR(entries)) {
+		return PTR_ERR(entries);
+	}
+
+	spin_lock_irqsave(&k3.lock, flags);
+	ret = fifo_wait_room(batch.count, &flags);
+	if (!ret) {
+		for (i = 0; i < batch.count; i++) {
+			fifo_write(entries[i].command, entries[i].value);
+		}
+		fifo_kick();
+	}
 	spin_unlock_irqrestore(&k3.lock, flags);
-	return;
+
+	kfree(entries);
+	return ret;
 }
 
-void dma_free_bufs(void)
+/*
+ * Hand the card the buffer at ctx->drain. The card raises an interrupt for
+ * every buffer and has no way to report that it can do otherwise, so
+ * buffers go out one per interrupt. Fails if the FIFO is full, in which case
+ * the buffer stays queued, k3.active is untouched and the dispatch is
+ * retried from dispatch_work.
+ * Must be called with k3.lock held.
+ */
+static bool dma_dispatch(struct k3_ctx *ctx)
 {
-	int i = 0;
-	for (i = 0; i < DMA_BUFNUM; i++) {
-		vm_munmap(dma[i].u_base, DMA_BUFSIZE);
-		pci_free_consistent(k3.pdev, DMA_BUFSIZE, dma[i].k_base,
-				    dma[i].handle);
+	struct k3_dma_buf *buf = &ctx->dma[ctx->drain];
+
+	if (!fifo_reserve(2)) {
+		dma_defer();
+		return false;
 	}
+	k3.active = ctx;
+	fifo_write(BUFA_ADDR, buf->handle);
+	fifo_write(BUFA_CONF, buf->size);
+	fifo_kick();
+	k3.stats.dispatches++;
+	k3_event(K3_EV_DISPATCH, ctx, buf->fence, buf->size, k3.fifo.queued);
+	return true;
+}
+
+/*
+ * Hand the card the oldest job: for a list its FIFO entries, then the DMA of
+ * its packets; for a buffer object the DMA of the part submitted. Fails like
+ * dma_dispatch() if the FIFO is full.
+ * Must be called with k3.lock held.
+ */
+static bool job_dispatch(void)
+{
+	struct k3_job *job = list_first_entry(&k3.jobs, struct k3_job, node);
+	struct k3_list *l = NULL;
+	dma_addr_t addr = 0;
+	u32 n = 0, size = 0, i;
+
+	switch (job->tag) {
+	case K3_JOB_LIST:
+		l = job->list;
+		n = l->count;
+		addr = l->handle;
+		size = l->size;
+		break;
+	case K3_JOB_BO:
+		addr = job->bo->handle + job->offset;
+		size = job->count;
+		break;
+	}
+	if (!fifo_reserve(n + 2)) {
+		dma_defer();
+		return false;
+	}
+	list_del(&job->node);
+	k3.job = job;
+	k3.jobs_dispatched++;
+	for (i = 0; i < n; i++) {
+		fifo_write(l->entries[i].command, l->entries[i].value);
+	}
+	fifo_write(BUFA_ADDR, addr);
+	fifo_write(BUFA_CONF, size);
+	fifo_kick();
+	k3.stats.dispatches++;
+	wake_up_interruptible(&job_snooze);
+	return true;
+}
+
+/*
+ * Drop of the last reference to a buffer object. Nothing can be queued on it
+ * any more, but this may run under k3.lock, so the memory is given back
+ * from bo_free_work.
+ */
+static void bo_release(struct kref *ref)
+{
+	struct k3_bo *bo = container_of(ref, struct k3_bo, ref);
+	unsigned long flags;
+
+	spin_lock_irqsave(&k3.bo_free_lock, flags);
+	list_add_tail(&bo->free_node, &k3.bo_free);
+	spin_unlock_irqrestore(&k3.bo_free_lock, flags);
+	schedule_delayed_work(&k3.bo_free_work, 0);
+}
+
+/*
+ * The card has run the job in k3.job; let its waiters know.
+ * Must be called with k3.lock held.
+ */
+static void job_retire(void)
+{
+	struct k3_job *job = k3.job;
+
+	switch (job->tag) {
+	case K3_JOB_LIST:
+		WRITE_ONCE(job->list->done, job->list->done + 1);
+		break;
+	case K3_JOB_BO:
+		WRITE_ONCE(job->bo->done, job->bo->done + 1);
+		kref_put(&job->bo->ref, bo_release);
+		break;
+	}
+	k3.job = NULL;
+	kfree(job);
+	wake_up_interruptible(&job_snooze);
+}
+
+/*
+ * True while the flip owner's next flip is due but not in the FIFO yet. Its
+ * next buffer belongs to the following frame and must not go ahead of it.
+ * Must be called with k3.lock held.
+ */
+static bool flip_holds(struct k3_ctx *ctx)
+{
+	struct k3_flip *f = &k3.flip;
+
+	return ctx == f->owner && f->queued != f->seq &&
+	       ctx->fence_done >= f->fence[(f->queued + 1) % K3_FLIP_MAX];
+}
+
+/*
+ * Write the next flip to the FIFO: finish the frame, have the encoder take
+ * up its surface, then draw into the one after it. The card applies the
+ * writes in order, so scanout only moves once the frame is drawn, and
+ * drawing only moves onto a surface once it has left the screen.
+ * Must be called with k3.lock held and room for 4 entries reserved.
+ */
+static void flip_write(void)
+{
+	struct k3_flip *f = &k3.flip;
+	u64 seq = f->queued + 1;
+	u32 surf = f->surf[seq % K3_FLIP_MAX];
+
+	fifo_write(RASTER_FLUSH, 0);
+	fifo_write(FRAME_STARTADDRESS, surf * f->size);
+	fifo_write(ENC_FRAME, 0);
+	fifo_write(FRAME_STARTADDRESS, (surf + 1) % f->nbufs * f->size);
+	f->pos[seq % K3_FLIP_MAX] = k3.fifo.queued;
+	f->queued = seq;
+}
+
+/*
+ * Write every flip whose frame the card has run, and retire the ones it has
+ * got past. Called on every dispatch opportunity, the DMA interrupt
+ * included, so flips keep moving without the owner's help.
+ * Must be called with k3.lock held.
+ */
+static void flip_update(void)
+{
+	struct k3_flip *f = &k3.flip;
+
+	if (!f->owner) {
+		return;
+	}
+	while (flip_holds(f->owner)) {
+		if (!fifo_reserve(4)) {
+			dma_defer();
+			break;
+		}
+		flip_write();
+		fifo_kick();
+	}
+	if (f->queued != f->done) {
+		fifo_read_tail();
+		while (f->done != f->queued &&
+		       k3.fifo.retired >= f->pos[(f->done + 1) % K3_FLIP_MAX]) {
+			f->done++;
+		}
+	}
+}
+
+/*
+ * Pick the next context with queued buffers. The chosen context is moved to
+ * the back of the list so that busy clients take turns.
+ * Must be called with k3.lock held.
+ */
+static struct k3_ctx *dma_next_ctx(void)
+{
+	struct k3_ctx *ctx;
+
+	list_for_each_entry(ctx, &k3.ctxs, node) {
+		if (dmaq_cnt(ctx) != 0 && !flip_holds(ctx)) {
+			list_move_tail(&ctx->node, &k3.ctxs);
+			return ctx;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * If the hardware is idle, dispatch the next queued buffer or job, if any.
+ * Must be called with k3.lock held.
+ */
+static void dma_kick_idle(void)
+{
+	struct k3_ctx *ctx;
+
+	flip_update();
+	if (k3.active || k3.job || k3.wedged) {
+		return;
+	}
+	// Jobs and contexts take turns while both have something queued.
+	ctx = NULL;
+	if (k3.job_ran || list_empty(&k3.jobs)) {
+		ctx = dma_next_ctx();
+	}
+	if (ctx) {
+		k3.job_ran = false;
+		dma_dispatch(ctx);
+	} else if (!list_empty(&k3.jobs)) {
+		k3.job_ran = job_dispatch();
+	}
+}
+
+/*
+ * Queue the entries userspace has published on the context's submission
+ * ring, stopping at the first bad one. Returns the number queued.
+ * Must be called with k3.lock held.
+ */
+static u32 ring_consume(struct k3_ctx *ctx)
+{
+	struct kyouko3_ring *r = ctx->ring;
+	u32 head = r->sq_head;
+	u32 tail = smp_load_acquire(&r->sq_tail);
+	u32 n = 0;
+	u32 buf, count;
+
+	if (READ_ONCE(r->flags) & K3_RING_ERROR) {
+		return 0;
+	}
+	if (tail - head > K3_RING_SQ_ENTRIES) {
+		WRITE_ONCE(r->flags, r->flags | K3_RING_ERROR);
+		return 0;
+	}
+	while (head != tail && dmaq_cnt(ctx) < ctx->nbufs) {
+		buf = READ_ONCE(r->sq[head % K3_RING_SQ_ENTRIES].buf);
+		count = READ_ONCE(r->sq[head % K3_RING_SQ_ENTRIES].count);
+		if (buf != ctx->fill || count == 0 || count > ctx->bufsize) {
+			WRITE_ONCE(r->flags, r->flags | K3_RING_ERROR);
+			break;
+		}
+		ctx->dma[ctx->fill].size = count;
+		ctx->dma[ctx->fill].fence = ++ctx->fence_submitted;
+		dma_note_submit(ctx, &ctx->dma[ctx->fill]);
+		dmaq_inc_idx(ctx, &ctx->fill);
+		head++;
+		n++;
+	}
+	ctx->ticket_next = ctx->fence_submitted;
+	smp_store_release(&r->sq_head, head);
+	return n;
+}
+
+/*
+ * Pick up new submissions, and if the context is left with nothing queued,
+ * ask userspace for a RING_ENTER with its next one. The flag is set before
+ * the last look at sq_tail and userspace stores sq_tail before it looks at
+ * the flag, each with a full barrier in between, so an entry is never
+ * stranded. Must be called with k3.lock held.
+ */
+static void ring_refill(struct k3_ctx *ctx)
+{
+	struct kyouko3_ring *r = ctx->ring;
+
+	ring_consume(ctx);
+	if (dmaq_cnt(ctx) != 0) {
+		return;
+	}
+	WRITE_ONCE(r->flags, r->flags | K3_RING_NEED_WAKEUP);
+	smp_mb();
+	if (ring_consume(ctx)) {
+		WRITE_ONCE(r->flags, r->flags & ~K3_RING_NEED_WAKEUP);
+	}
+}
+
+/*
+ * Publish a retired fence on the completion ring. Must be called with
+ * k3.lock held.
+ */
+static void ring_complete(struct k3_ctx *ctx, u64 fence)
+{
+	struct kyouko3_ring *r = ctx->ring;
+	u32 tail = r->cq_tail;
+
+	smp_store_release(&r->fence_done, fence);
+	if (tail - READ_ONCE(r->cq_head) >= K3_RING_CQ_ENTRIES) {
+		WRITE_ONCE(r->cq_overflow, r->cq_overflow + 1);
+		return;
+	}
+	r->cq[tail % K3_RING_CQ_ENTRIES] = fence;
+	smp_store_release(&r->cq_tail, tail + 1);
+}
+
+/*
+ * The card has run the context's buffer at drain: retire it and let
+ * everyone waiting on it know.
+ * Must be called with k3.lock held.
+ */
+static void dma_retire(struct k3_ctx *ctx)
+{
+	ctx->fence_done = ctx->dma[ctx->drain].fence;
+	dmaq_inc_idx(ctx, &ctx->drain);
+	if (ctx->ring) {
+		ring_complete(ctx, ctx->fence_done);
+		ring_refill(ctx);
+	}
+	pr_debug("dma_retire: cnt %d\n", dmaq_cnt(ctx));
+
+	wake_up_interruptible(&ctx->dma_snooze);
+	wake_up_interruptible(&ctx->fence_snooze);
+	// Queue is empty. If user was ready to unbind, wake him up.
+	if (dmaq_cnt(ctx) == 0) {
+		wake_up_interruptible(&ctx->unbind_snooze);
+	}
+}
+
+/*
+ * DMA interrupt handler, top half. It only acknowledges the card; retiring
+ * and dispatching buffers is left to dma_irq_thread(), so the time spent
+ * with interrupts off stays short.
+ */
+irqreturn_t dma_isr(int irq, void *dev_id, struct pt_regs *regs)
+{
+	u32 iflags = K_READ_REG(INFO_STATUS);
+
+	K_WRITE_REG(INFO_STATUS, 0xf);
+
+	// spurious interrupt
+	if ((iflags & 0x02) == 0) {
+		return IRQ_NONE;
+	}
+	WRITE_ONCE(k3.irq_stamp, k3_now_ns());
+	return IRQ_WAKE_THREAD;
+}
+
+/*
+ * DMA interrupt handler, threaded half. The line stays masked until it
+ * returns, so the buffer in k3.active is the one that raised the interrupt.
+ */
+static irqreturn_t dma_irq_thread(int irq, void *dev_id)
+{
+	u64 irq_ns = k3_now_ns() - READ_ONCE(k3.irq_stamp);
+	struct k3_ctx *ctx;
+
+	spin_lock_irq(&k3.lock);
+	k3.stats.interrupts++;
+	stats_time(&k3.stats.irq_ns, &k3.stats.irq_max_ns, irq_ns);
+	ctx = k3.active;
+	if (ctx) {
+		dma_retire(ctx);
+		k3_event(K3_EV_COMPLETE, ctx, ctx->fence_done, irq_ns, 0);
+	} else if (k3.job) {
+		job_retire();
+	}
+
+	// dispatch the next buffer from whichever client is next in line. With
+	// nothing active this was the buffer of a context that gave up on it.
+	k3.active = NULL;
+	k3.wedged = false;
+	dma_kick_idle();
+	spin_unlock_irq(&k3.lock);
+
+	// The FIFO has moved on, let any flusher re-check the tail.
+	wake_up_interruptible(&fifo_snooze);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Queue the context's fill buffer for DMA, snoozing first if its ring is
+ * full, or failing with -EAGAIN if the file is non-blocking. The buffer's
+ * fence is returned through `fence`.
+ */
+int initiate_transfer(struct k3_ctx *ctx, unsigned long size, bool nonblock,
+		      u64 *fence)
+{
+	int ret;
+	unsigned long flags;
+	u64 snooze = 0;
+	pr_debug("initiate_transfer\n");
+
+	spin_lock_irqsave(&k3.lock, flags);
+
+	// The fill buffer belongs to the oldest ticket while any are held, or
+	// to the submission ring.
+	if (ctx->ticket_next != ctx->fence_submitted || ctx->ring) {
+		spin_unlock_irqrestore(&k3.lock, flags);
+		return -EBUSY;
+	}
+
+	// This is the number of items currently in the DMA queue.
+	// It will lie between 0 and nbufs-1 (Almost full).
+	// If it is almost full, the buffer we are about to queue is the only
+	// free one, so we wait here till a buffer is drained.
+	while (dmaq_full(ctx)) {
+		spin_unlock_irqrestore(&k3.lock, flags);
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		if (!snooze) {
+			snooze = k3_now_ns();
+		}
+		ret = wait_event_interruptible(ctx->dma_snooze,
+					       !dmaq_full(ctx));
+		if (ret) {
+			return ret;
+		}
+		spin_lock_irqsave(&k3.lock, flags);
+	}
+	if (snooze) {
+		k3.stats.snoozes++;
+		stats_time(&k3.stats.snooze_ns, &k3.stats.snooze_max_ns,
+			   k3_now_ns() - snooze);
+	}
+
+	ctx->dma[ctx->fill].size = size;
+	ctx->dma[ctx->fill].fence = ++ctx->fence_submitted;
+	dma_note_submit(ctx, &ctx->dma[ctx->fill]);
+	ctx->ticket_next = ctx->fence_submitted;
+	*fence = ctx->fence_submitted;
+
+	// Increment the fill pointer for the next producer
+	dmaq_inc_idx(ctx, &ctx->fill);
+
+	// If the hardware is idle, dispatch right away. Otherwise the ISR will
+	// get to this buffer.
+	dma_kick_idle();
+
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return 0;
+}
+
+/*
+ * Hand out the next ticket and its buffer for recording, snoozing until the
+ * card has retired the buffer's previous contents.
+ */
+long dma_acquire(struct k3_ctx *ctx, bool nonblock,
+		 struct kyouko3_dma_ticket *t)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	if (ctx->ring) {
+		spin_unlock_irqrestore(&k3.lock, flags);
+		return -EBUSY;
+	}
+	while (!dmaq_ticket_free(ctx)) {
+		spin_unlock_irqrestore(&k3.lock, flags);
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible(ctx->dma_snooze,
+					       dmaq_ticket_free(ctx));
+		if (ret) {
+			return ret;
+		}
+		spin_lock_irqsave(&k3.lock, flags);
+	}
+	t->u_base = dma_u_base(ctx, dmaq_ticket_idx(ctx, ctx->ticket_next));
+	t->ticket = ctx->ticket_next++;
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return 0;
+}
+
+/*
+ * Take back a ticket's buffer and mark it ready. A count of 0 gives the
+ * ticket up: an empty packet is queued in its place so that its fence still
+ * signals. Must be called with k3.lock held.
+ */
+static int dma_mark_ready(struct k3_ctx *ctx, struct kyouko3_dma_submit *sub)
+{
+	struct kyouko3_dma_hdr empty = {
+	    .stride = 5, .rgb = 1, .b12 = 1, .opcode = 0x14};
+	struct k3_dma_buf *buf;
+
+	if (sub->count > ctx->bufsize || sub->ticket < ctx->fence_submitted ||
+	    sub->ticket >= ctx->ticket_next) {
+		return -EINVAL;
+	}
+	buf = &ctx->dma[dmaq_ticket_idx(ctx, sub->ticket)];
+	if (buf->ready) {
+		return -EINVAL;
+	}
+	if (sub->count == 0) {
+		memcpy(buf->k_base, &empty, sizeof(empty));
+		sub->count = sizeof(empty);
+	}
+	buf->size = sub->count;
+	buf->ready = true;
+	sub->fence = sub->ticket + 1;
+	return 0;
+}
+
+/*
+ * Queue every ready buffer from the fill index onwards, so the card sees
+ * them in ticket order whatever order the threads submit in, and start the
+ * first if the hardware is idle. Must be called with k3.lock held.
+ */
+static void dma_queue_ready(struct k3_ctx *ctx)
+{
+	struct k3_dma_buf *buf;
+
+	while (ctx->fence_submitted != ctx->ticket_next &&
+	       ctx->dma[ctx->fill].ready) {
+		buf = &ctx->dma[ctx->fill];
+		buf->ready = false;
+		buf->fence = ++ctx->fence_submitted;
+		dma_note_submit(ctx, buf);
+		dmaq_inc_idx(ctx, &ctx->fill);
+	}
+	dma_kick_idle();
+}
+
+long dma_submit(struct k3_ctx *ctx, struct kyouko3_dma_submit *sub)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	ret = dma_mark_ready(ctx, sub);
+	if (!ret) {
+		dma_queue_ready(ctx);
+	}
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return ret;
+}
+
+/*
+ * SUBMIT_DMA for several tickets under one acquisition of k3.lock. Either
+ * every ticket is taken back or, if one is invalid, none is.
+ */
+long dma_submit_batch(struct k3_ctx *ctx,
+		      struct kyouko3_dma_submit_batch __user *argp)
+{
+	struct kyouko3_dma_submit_batch batch;
+	struct kyouko3_dma_submit *subs;
+	void __user *usubs;
+	unsigned long flags;
+	u32 i;
+	int ret = 0;
+
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+	if (batch.count == 0) {
+		return 0;
+	}
+	// No more tickets than buffers can be outstanding.
+	if (batch.count > ctx->nbufs) {
+		return -EINVAL;
+	}
+	usubs = (void __user *)(unsigned long)batch.subs;
+	subs = memdup_user(usubs, batch.count * sizeof(*subs));
+	if (IS_ERR(subs)) {
+		return PTR_ERR(subs);
+	}
+
+	spin_lock_irqsave(&k3.lock, flags);
+	for (i = 0; i < batch.count; i++) {
+		ret = dma_mark_ready(ctx, &subs[i]);
+		if (ret) {
+			break;
+		}
+	}
+	if (ret) {
+		while (i--) {
+			ctx->dma[dmaq_ticket_idx(ctx, subs[i].ticket)].ready =
+			    false;
+		}
+	} else {
+		dma_queue_ready(ctx);
+	}
+	spin_unlock_irqrestore(&k3.lock, flags);
+
+	if (!ret && copy_to_user(usubs, subs, batch.count * sizeof(*subs))) {
+		ret = -EFAULT;
+	}
+	kfree(subs);
+	return ret;
+}
+
+/*
+ * Take a buffer of size bytes from the pool, or allocate one if the pool
+ * has none. Must be called with k3.open_lock held.
+ */
+static unsigned int *dma_pool_get(u32 size, dma_addr_t *handle)
+{
+	struct k3_pool *p = &k3.pool;
+	unsigned int *k_base;
+	int i;
+
+	for (i = p->n - 1; i >= 0; i--) {
+		if (p->bufs[i].size == size) {
+			k_base = p->bufs[i].k_base;
+			*handle = p->bufs[i].handle;
+			p->bytes -= size;
+			p->bufs[i] = p->bufs[--p->n];
+			return k_base;
+		}
+	}
+	return pci_alloc_consistent(k3.pdev, size, handle);
+}
+
+/*
+ * Give a buffer back to the pool, or free it if the pool is full.
+ * Must be called with k3.open_lock held.
+ */
+static void dma_pool_put(unsigned int *k_base, dma_addr_t handle, u32 size)
+{
+	struct k3_pool *p = &k3.pool;
+
+	if (p->n == DMA_POOL_MAX || p->bytes + size > DMA_POOL_MAXSIZE) {
+		pci_free_consistent(k3.pdev, size, k_base, handle);
+		return;
+	}
+	p->bufs[p->n++] = (struct k3_pool_buf){k_base, handle, size};
+	p->bytes += size;
+}
+
+// Free every pooled buffer.
+static void dma_pool_drain(void)
+{
+	struct k3_pool *p = &k3.pool;
+
+	mutex_lock(&k3.open_lock);
+	while (p->n) {
+		p->n--;
+		pci_free_consistent(k3.pdev, p->bufs[p->n].size,
+				    p->bufs[p->n].k_base, p->bufs[p->n].handle);
+	}
+	p->bytes = 0;
+	mutex_unlock(&k3.open_lock);
+}
+
+// Free the ring page. Nothing may map it any more.
+static void ring_free(struct k3_ctx *ctx)
+{
+	if (ctx->ring_page) {
+		free_page((unsigned long)ctx->ring_page);
+		ctx->ring_page = NULL;
+	}
+}
+
+/*
+ * Unmap the context's DMA buffers and give them back to the pool. Fails
+ * with -EBUSY, keeping them, while the client still maps them itself.
+ */
+int dma_free_bufs(struct k3_ctx *ctx, bool unmap)
+{
+	int i = 0;
+
+	if (!ctx->dma) {
+		return 0;
+	}
+	if (unmap && !umap_unmap(&ctx->dma_map)) {
+		return -EBUSY;
+	}
+	mutex_lock(&k3.open_lock);
+	for (i = 0; i < ctx->nbufs; i++) {
+		if (ctx->dma[i].k_base) {
+			dma_pool_put(ctx->dma[i].k_base, ctx->dma[i].handle,
+				     ctx->bufsize);
+		}
+	}
+	mutex_unlock(&k3.open_lock);
+	kfree(ctx->dma);
+	ctx->dma = NULL;
+	ring_free(ctx);
+	return 0;
+}
+
+/*
+ * Clamp a requested ring geometry to what the device and driver support.
+ * Zero picks the default.
+ */
+static void dma_fix_geom(u32 *nbufs, u32 *bufsize)
+{
+	if (*nbufs == 0) {
+		*nbufs = DMA_BUFNUM;
+	}
+	if (*bufsize == 0) {
+		*bufsize = DMA_BUFSIZE;
+	}
+	*nbufs = clamp_t(u32, *nbufs, DMA_BUFNUM_MIN, DMA_BUFNUM_MAX);
+	*bufsize = clamp_t(u32, *bufsize, DMA_BUFSIZE_MIN, DMA_BUFSIZE_MAX);
+	*bufsize = PAGE_ALIGN(*bufsize);
+	// Keep the ring within the per-client budget by giving up depth
+	// rather than buffer size.
+	if ((u64)*nbufs * *bufsize > DMA_RING_MAXSIZE) {
+		*nbufs = max_t(u32, DMA_RING_MAXSIZE / *bufsize,
+			       DMA_BUFNUM_MIN);
+	}
+}
+
+/*
+ * Map a page for the submission and completion rings and switch the
+ * context over to them. The bound ring's buffers keep their slots; ring
+ * entry 0 is the current fill buffer.
+ */
+long ring_setup(struct file *fp, u64 __user *argp)
+{
+	struct k3_ctx *ctx = fp->private_data;
+	struct kyouko3_ring *r;
+	unsigned long addr, flags;
+	u32 i;
+
+	BUILD_BUG_ON(sizeof(struct kyouko3_ring) > PAGE_SIZE);
+	if (ctx->ring_page) {
+		return -EBUSY;
+	}
+	r = (struct kyouko3_ring *)get_zeroed_page(GFP_KERNEL);
+	if (!r) {
+		return -ENOMEM;
+	}
+	r->nbufs = ctx->nbufs;
+	r->bufsize = ctx->bufsize;
+	for (i = 0; i < ctx->nbufs; i++) {
+		r->bufs[i] = dma_u_base(ctx, i);
+	}
+	r->flags = K3_RING_NEED_WAKEUP;
+
+	ctx->ring_page = r;
+	addr = umap_map(fp, &ctx->ring_map, PAGE_SIZE, PROT_READ | PROT_WRITE,
+			VM_PGOFF_RING);
+	if (IS_ERR_VALUE(addr)) {
+		ring_free(ctx);
+		return addr;
+	}
+
+	spin_lock_irqsave(&k3.lock, flags);
+	if (ctx->ticket_next != ctx->fence_submitted) {
+		spin_unlock_irqrestore(&k3.lock, flags);
+		// If the client mapped the page meanwhile, it goes at UNBIND.
+		if (umap_unmap(&ctx->ring_map)) {
+			ring_free(ctx);
+		}
+		return -EBUSY;
+	}
+	r->first = ctx->fill;
+	r->fence_base = ctx->fence_submitted;
+	r->fence_done = ctx->fence_done;
+	ctx->ring = r;
+	spin_unlock_irqrestore(&k3.lock, flags);
+
+	if (put_user((u64)addr, argp))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Pick up ring entries on behalf of a client that found
+ * K3_RING_NEED_WAKEUP set, and start the card if it is idle.
+ */
+long ring_enter(struct k3_ctx *ctx)
+{
+	struct kyouko3_ring *r;
+	unsigned long flags;
+	long ret = 0;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	r = ctx->ring;
+	if (!r) {
+		spin_unlock_irqrestore(&k3.lock, flags);
+		return -EINVAL;
+	}
+	WRITE_ONCE(r->flags, r->flags & ~K3_RING_NEED_WAKEUP);
+	ring_refill(ctx);
+	dma_kick_idle();
+	if (READ_ONCE(r->flags) & K3_RING_ERROR) {
+		ret = -EIO;
+	}
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return ret;
+}
+
+static inline bool fence_signaled(struct k3_ctx *ctx, u64 fence)
+{
+	return READ_ONCE(ctx->fence_done) >= fence;
+}
+
+/*
+ * Wait until the card has consumed the buffer carrying `fence`.
+ */
+long fence_wait(struct k3_ctx *ctx, struct kyouko3_fence_wait __user *argp)
+{
+	struct kyouko3_fence_wait fw;
+	long ret;
+
+	if (copy_from_user(&fw, argp, sizeof(struct kyouko3_fence_wait)))
+		return -EFAULT;
+	// The fence may belong to a ring entry nobody has picked up yet.
+	if (ctx->ring) {
+		ring_enter(ctx);
+	}
+	// Tickets submitted out of order have fences that are not queued yet.
+	if (fw.fence > ctx->ticket_next) {
+		return -EINVAL;
+	}
+	if (fence_signaled(ctx, fw.fence)) {
+		return 0;
+	}
+	if (fw.timeout_ms == 0) {
+		return -ETIMEDOUT;
+	}
+
+	ret = wait_event_interruptible_timeout(ctx->fence_snooze,
+					       fence_signaled(ctx, fw.fence),
+					       msecs_to_jiffies(fw.timeout_ms));
+	if (ret < 0) {
+		return ret;
+	}
+	return ret ? 0 : -ETIMEDOUT;
+}
+
+/* Set up pci interrupts. Shared by every context that has DMA bound. */
+int dma_irq_get(void)
+{
+	int ret;
+
+	if (k3.dma_users++ > 0) {
+		return 0;
+	}
+
+	ret = pci_enable_msi(k3.pdev);
+	if (ret) {
+		pr_warn("pci_enable_msi failed\n");
+		goto err;
+	}
+
+	ret = request_threaded_irq(k3.pdev->irq, (irq_handler_t)dma_isr,
+				   dma_irq_thread, IRQF_SHARED | IRQF_ONESHOT,
+				   "kyouku3 dma isr", &k3);
+	if (ret) {
+		pr_warn("request_threaded_irq failed\n");
+		pci_disable_msi(k3.pdev);
+		goto err;
+	}
+
+	// No interrupt can be outstanding from before the line was freed. A
+	// job left running then belonged to a list or buffer object that was
+	// leaked.
+	k3.active = NULL;
+	k3.wedged = false;
+	kfree(k3.job);
+	k3.job = NULL;
+	K_WRITE_REG(CONF_INTERRUPT, 0x02);
+	return 0;
+err:
+	k3.dma_users--;
+	return ret;
+}
+
+void dma_irq_put(void)
+{
+	if (--k3.dma_users > 0) {
+		return;
+	}
+	K_WRITE_REG(CONF_INTERRUPT, 0);
+	free_irq(k3.pdev->irq, &k3);
+	pci_disable_msi(k3.pdev);
+}
+
+/*
+ * Give the context a ring of nbufs buffers of bufsize bytes, mapped back to
+ * back in one mapping whose pages are filled in on first touch by
+ * dma_vm_fault(), and attach it to the dispatcher. Buffers left from an
+ * earlier bind of the same geometry are used as they are, and so is their
+ * mapping while it is still whole; otherwise they come from k3.pool where
+ * possible. Other geometries fail with -EBUSY while the client still maps
+ * the old buffers itself. nbufs and bufsize must already have been through
+ * dma_fix_geom().
+ */
+int dma_init(struct file *fp, u32 nbufs, u32 bufsize)
+{
+	int i;
+	int ret = 0;
+	unsigned long addr;
+	unsigned long flags;
+	struct k3_ctx *ctx = fp->private_data;
+
+	// If dma was already on, skip the initialization.
+	// re-running the buffer allocation loop will cause us to lose the old
+	// dma handles and they would never be freed.
+	if (ctx->dma_on) {
+		return 0;
+	}
+	if (ctx->dma && (ctx->nbufs != nbufs || ctx->bufsize != bufsize)) {
+		ret = dma_free_bufs(ctx, true);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	if (!ctx->dma) {
+		ctx->dma = kcalloc(nbufs, sizeof(struct k3_dma_buf),
+				   GFP_KERNEL);
+		if (!ctx->dma) {
+			return -ENOMEM;
+		}
+		ctx->nbufs = nbufs;
+		ctx->bufsize = bufsize;
+
+		mutex_lock(&k3.open_lock);
+		for (i = 0; i < nbufs; i++) {
+			ctx->dma[i].k_base =
+			    dma_pool_get(bufsize, &ctx->dma[i].handle);
+			if (!ctx->dma[i].k_base) {
+				mutex_unlock(&k3.open_lock);
+				ret = -ENOMEM;
+				goto err;
+			}
+		}
+		mutex_unlock(&k3.open_lock);
+	}
+	// The mapping from the last bind is only reused if the client left it
+	// alone.
+	if (!umap_addr(&ctx->dma_map)) {
+		addr = umap_map(fp, &ctx->dma_map, nbufs * bufsize,
+				PROT_READ | PROT_WRITE, VM_PGOFF_DMA);
+		if (IS_ERR_VALUE(addr)) {
+			pr_warn("vm_mmap failed\n");
+			ret = addr;
+			goto err;
+		}
+	}
+	// We don't need locking here because the context is not on the
+	// dispatch list yet.
+	ctx->fill = 0;
+	ctx->drain = 0;
+	for (i = 0; i < nbufs; i++) {
+		ctx->dma[i].ready = false;
+	}
+
+	mutex_lock(&k3.open_lock);
+	ret = dma_irq_get();
+	mutex_unlock(&k3.open_lock);
+	if (ret) {
+		goto err;
+	}
+
+	spin_lock_irqsave(&k3.lock, flags);
+	list_add_tail(&ctx->node, &k3.ctxs);
+	ctx->dma_on = true;
+	spin_unlock_irqrestore(&k3.lock, flags);
+
+	return 0;
+err:
+	dma_free_bufs(ctx, true);
+	return ret;
+}
+
+/* Detach the context from the dispatcher. Its queue must be empty. */
+void dma_stop(struct k3_ctx *ctx)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	list_del(&ctx->node);
+	// Only possible if release gave up waiting for the hardware. The card
+	// may still be reading the buffer, so hold off the next one until its
+	// interrupt says it is done.
+	if (k3.active == ctx) {
+		k3.active = NULL;
+		k3.wedged = true;
+	}
+	// Tickets still held, and buffers waiting behind them, are dropped,
+	// as are ring entries not picked up yet.
+	ctx->ticket_next = ctx->fence_submitted;
+	ctx->ring = NULL;
+	spin_unlock_irqrestore(&k3.lock, flags);
+
+	mutex_lock(&k3.open_lock);
+	dma_irq_put();
+	mutex_unlock(&k3.open_lock);
+	ctx->dma_on = false;
+}
+
+static inline u32 vram_total(void)
+{
+	return K_READ_REG(Device_RAM) << 20;
+}
+
+/*
+ * Put a block in slot i of the sorted array and give it a handle.
+ * Must be called with k3.vram.lock held and a slot free.
+ */
+static u32 vram_insert(int i, u32 off, u32 len, struct k3_ctx *owner)
+{
+	struct k3_vram *v = &k3.vram;
+	struct k3_vram_ext *e = &v->ext[i];
+
+	memmove(e + 1, e, (v->n - i) * sizeof(*e));
+	e->off = off;
+	e->len = len;
+	e->owner = owner;
+	// Handle 0 means none.
+	if (++v->next_handle == 0) {
+		v->next_handle = 1;
+	}
+	e->handle = v->next_handle;
+	v->n++;
+	v->used += len;
+	v->peak = max(v->peak, v->used);
+	return e->handle;
+}
+
+// Must be called with k3.vram.lock held.
+static void vram_remove(int i)
+{
+	struct k3_vram *v = &k3.vram;
+
+	v->used -= v->ext[i].len;
+	memmove(&v->ext[i], &v->ext[i + 1], (v->n - i - 1) * sizeof(v->ext[0]));
+	v->n--;
+}
+
+// Must be called with k3.vram.lock held.
+static int vram_find(u32 handle)
+{
+	int i;
+
+	for (i = 0; handle && i < k3.vram.n; i++) {
+		if (k3.vram.ext[i].handle == handle) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Reserve [off, off + len) for the driver. Returns the handle, or 0 if any
+ * of it is taken.
+ * Must be called with k3.vram.lock held.
+ */
+static u32 vram_reserve_locked(u32 off, u32 len)
+{
+	struct k3_vram *v = &k3.vram;
+	int i;
+
+	if (v->n == K3_VRAM_MAX || (u64)off + len > vram_total()) {
+		return 0;
+	}
+	for (i = 0; i < v->n && v->ext[i].off < off; i++) {
+	}
+	if (i > 0 && v->ext[i - 1].off + v->ext[i - 1].len > off) {
+		return 0;
+	}
+	if (i < v->n && v->ext[i].off < off + len) {
+		return 0;
+	}
+	return vram_insert(i, off, len, NULL);
+}
+
+// Drop one of the driver's reservations, if it has one.
+static void vram_release(u32 handle)
+{
+	int i;
+
+	mutex_lock(&k3.vram.lock);
+	i = vram_find(handle);
+	if (i >= 0) {
+		vram_remove(i);
+	}
+	mutex_unlock(&k3.vram.lock);
+}
+
+/*
+ * Find len bytes at a multiple of align for ctx, trying the highest gap
+ * first.
+ */
+long vram_alloc(struct k3_ctx *ctx, struct kyouko3_vram_alloc *va)
+{
+	struct k3_vram *v = &k3.vram;
+	u32 align = va->align ? va->align : K3_VRAM_ALIGN;
+	u32 total = vram_total();
+	u32 len, lo, hi, off;
+	int i;
+
+	if (va->size == 0 || va->size > total || align & (align - 1)) {
+		return -EINVAL;
+	}
+	len = ALIGN(va->size, K3_VRAM_ALIGN);
+	align = max_t(u32, align, K3_VRAM_ALIGN);
+
+	mutex_lock(&v->lock);
+	for (i = v->n; v->n < K3_VRAM_MAX && i >= 0; i--) {
+		lo = i > 0 ? v->ext[i - 1].off + v->ext[i - 1].len : 0;
+		hi = i < v->n ? v->ext[i].off : total;
+		if (hi - lo < len) {
+			continue;
+		}
+		off = (hi - len) & ~(align - 1);
+		if (off >= lo) {
+			va->handle = vram_insert(i, off, len, ctx);
+			va->offset = off;
+			mutex_unlock(&v->lock);
+			return 0;
+		}
+	}
+	mutex_unlock(&v->lock);
+	return -ENOSPC;
+}
+
+long vram_free(struct k3_ctx *ctx, u32 handle)
+{
+	int i;
+
+	mutex_lock(&k3.vram.lock);
+	i = vram_find(handle);
+	if (i < 0 || k3.vram.ext[i].owner != ctx) {
+		mutex_unlock(&k3.vram.lock);
+		return -EINVAL;
+	}
+	vram_remove(i);
+	mutex_unlock(&k3.vram.lock);
+	return 0;
+}
+
+// Free every block ctx still holds.
+void vram_free_ctx(struct k3_ctx *ctx)
+{
+	int i;
+
+	mutex_lock(&k3.vram.lock);
+	for (i = k3.vram.n - 1; i >= 0; i--) {
+		if (k3.vram.ext[i].owner == ctx) {
+			vram_remove(i);
+		}
+	}
+	mutex_unlock(&k3.vram.lock);
+}
+
+void vram_stats(struct kyouko3_vram_stats *st)
+{
+	struct k3_vram *v = &k3.vram;
+	u32 lo = 0, hi;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	st->total = vram_total();
+	mutex_lock(&v->lock);
+	for (i = 0; i <= v->n; i++) {
+		hi = i < v->n ? v->ext[i].off : st->total;
+		st->largest_free = max(st->largest_free, hi - lo);
+		if (i < v->n) {
+			lo = v->ext[i].off + v->ext[i].len;
+		}
+	}
+	st->used = v->used;
+	st->peak = v->peak;
+	st->allocs = v->n;
+	mutex_unlock(&v->lock);
+}
+
+/*
+ * Check a BLIT rectangle against device RAM and the framebuffer mapping,
+ * filling in the default pitches.
+ */
+static int blit_check(struct kyouko3_blit *b)
+{
+	u64 end;
+
+	if (b->pitch == 0) {
+		b->pitch = K_READ_REG(FRAME_ROWPITCH);
+	}
+	if (b->data_pitch == 0) {
+		b->data_pitch = b->width * 4;
+	}
+	if (b->op < K3_BLIT_UPLOAD || b->op > K3_BLIT_FILL ||
+	    b->pitch % 4 ||
+	    (u64)b->x + b->width > b->pitch / 4 ||
+	    b->data_pitch < b->width * 4) {
+		return -EINVAL;
+	}
+	if (b->width == 0 || b->height == 0) {
+		return 0;
+	}
+	end = b->offset + ((u64)b->y + b->height - 1) * b->pitch +
+	      ((u64)b->x + b->width) * 4;
+	if (end > (u64)K_READ_REG(Device_RAM) << 20 || end > k3.fb.len) {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Upload, read back or fill a rectangle of device RAM. The card must be done
+ * with the rectangle first, so the FIFO is flushed; then the CPU moves the
+ * pixels through the framebuffer mapping a row at a time. This serializes
+ * the caller against every client, and is kept as a convenience; CAPTURE
+ * is the asynchronous way to read pixels back.
+ */
+long blit_run(struct k3_ctx *ctx, struct kyouko3_blit *b)
+{
+	unsigned long flags;
+	u8 __user *data = (u8 __user *)(unsigned long)b->data;
+	u8 *vram;
+	u32 row_bytes, x, y;
+	u32 *row;
+	long ret;
+
+	ret = blit_check(b);
+	if (ret || b->width == 0 || b->height == 0) {
+		return ret;
+	}
+	// A read must see what the caller has drawn with DMA.
+	if (b->op == K3_BLIT_READ && ctx->dma_on) {
+		if (ctx->ring) {
+			ring_enter(ctx);
+		}
+		ret = wait_event_interruptible_timeout(
+		    ctx->fence_snooze,
+		    fence_signaled(ctx, READ_ONCE(ctx->fence_submitted)),
+		    msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS));
+		if (ret <= 0) {
+			return ret ? ret : -ETIMEDOUT;
+		}
+	}
+	// Get the rasterizer's pixels out to device RAM, and anything queued
+	// that draws into the rectangle done with.
+	spin_lock_irqsave(&k3.lock, flags);
+	ret = fifo_wait_room(1, &flags);
+	if (!ret) {
+		fifo_write(RASTER_FLUSH, 0);
+	}
+	spin_unlock_irqrestore(&k3.lock, flags);
+	if (!ret) {
+		ret = fifo_flush(ctx);
+	}
+	if (ret) {
+		return ret;
+	}
+
+	row_bytes = b->width * 4;
+	row = kmalloc(row_bytes, GFP_KERNEL);
+	if (!row) {
+		return -ENOMEM;
+	}
+	if (b->op == K3_BLIT_FILL) {
+		for (x = 0; x < b->width; x++) {
+			row[x] = b->color;
+		}
+	}
+	vram = (u8 *)k3.fb.k_base + b->offset + b->y * b->pitch + b->x * 4;
+	for (y = 0; y < b->height; y++) {
+		if (b->op == K3_BLIT_READ) {
+			memcpy_fromio(row, vram, row_bytes);
+			if (copy_to_user(data, row, row_bytes)) {
+				ret = -EFAULT;
+				break;
+			}
+		} else {
+			if (b->op == K3_BLIT_UPLOAD &&
+			    copy_from_user(row, data, row_bytes)) {
+				ret = -EFAULT;
+				break;
+			}
+			memcpy_toio(vram, row, row_bytes);
+		}
+		data += b->data_pitch;
+		vram += b->pitch;
+	}
+	kfree(row);
+	return ret;
+}
+
+// True once the card has consumed the FIFO up to position pos.
+static bool fifo_passed(u64 pos)
+{
+	unsigned long flags;
+	bool passed;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	fifo_read_tail();
+	passed = k3.fifo.retired >= pos;
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return passed;
+}
+
+/*
+ * Wait for the card to get past FIFO position pos, polling the tail on the
+ * same backed-off intervals as fifo_flush(). Gives up once FIFO_TAIL has not
+ * moved for FIFO_FLUSH_TIMEOUT_MS.
+ */
+static int capture_wait_fifo(u64 pos)
+{
+	unsigned long deadline;
+	unsigned long poll_us = FIFO_POLL_MIN_US;
+	u32 tail = K_READ_REG(FIFO_TAIL);
+
+	deadline = jiffies + msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS);
+	while (fifo_poll(fifo_passed(pos), poll_us)) {
+		if (K_READ_REG(FIFO_TAIL) != tail) {
+			tail = K_READ_REG(FIFO_TAIL);
+			deadline = jiffies +
+				   msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS);
+		} else if (time_after(jiffies, deadline)) {
+			pr_warn("capture gave up on a stalled fifo\n");
+			return -ETIMEDOUT;
+		}
+		poll_us = min(poll_us * 2, FIFO_POLL_MAX_US);
+	}
+	return 0;
+}
+
+/*
+ * Land the context's queued captures in order. Each waits for the card to
+ * get past the RASTER_FLUSH queued with it, then is copied row by row from
+ * the framebuffer mapping into the capture buffer with memcpy_fromio().
+ * Once the FIFO stalls, the rest of the captures queued so far fail with it.
+ */
+static void capture_work(struct work_struct *work)
+{
+	struct k3_ctx *ctx =
+		container_of(to_delayed_work(work), struct k3_ctx, cap_work);
+	struct kyouko3_capture *c;
+	struct kyouko3_blit *b;
+	unsigned long flags;
+	const u8 __iomem *vram;
+	u8 *buf;
+	u64 seq, pos;
+	u32 y;
+	int err = 0;
+
+	for (;;) {
+		spin_lock_irqsave(&k3.lock, flags);
+		seq = ctx->cap_done + 1;
+		if (seq > ctx->cap_seq) {
+			spin_unlock_irqrestore(&k3.lock, flags);
+			return;
+		}
+		// CAPTURE leaves the slot alone until the capture has landed.
+		c = &ctx->cap_req[seq % K3_CAPTURE_DEPTH];
+		pos = ctx->cap_pos[seq % K3_CAPTURE_DEPTH];
+		spin_unlock_irqrestore(&k3.lock, flags);
+
+		if (!err) {
+			err = capture_wait_fifo(pos);
+		}
+		if (!err) {
+			b = &c->rect;
+			vram = (u8 __iomem *)k3.fb.k_base + b->offset +
+			       b->y * b->pitch + b->x * 4;
+			buf = (u8 *)ctx->cap_base + c->buf_offset;
+			for (y = 0; y < b->height; y++) {
+				memcpy_fromio(buf, vram, b->width * 4);
+				buf += b->data_pitch;
+				vram += b->pitch;
+			}
+		}
+
+		spin_lock_irqsave(&k3.lock, flags);
+		ctx->cap_err[seq % K3_CAPTURE_DEPTH] = err;
+		ctx->cap_done = seq;
+		spin_unlock_irqrestore(&k3.lock, flags);
+		wake_up_interruptible(&capture_snooze);
+	}
+}
+
+static bool capture_done(struct k3_ctx *ctx, u64 seq)
+{
+	unsigned long flags;
+	bool done;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	done = ctx->cap_done >= seq;
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return done;
+}
+
+/*
+ * Wait for capture seq to land and return how it went. Outcomes are only
+ * kept for the last K3_CAPTURE_DEPTH captures; older ones report -ESTALE.
+ */
+long capture_wait(struct k3_ctx *ctx, u64 seq, unsigned int timeout_ms)
+{
+	unsigned long flags;
+	long ret;
+
+	if (!capture_done(ctx, seq)) {
+		if (timeout_ms == 0) {
+			return -ETIMEDOUT;
+		}
+		ret = wait_event_interruptible_timeout(
+		    capture_snooze, capture_done(ctx, seq),
+		    msecs_to_jiffies(timeout_ms));
+		if (ret < 0) {
+			return ret;
+		}
+		if (ret == 0) {
+			return -ETIMEDOUT;
+		}
+	}
+	if (seq == 0) {
+		return 0;
+	}
+	ret = -ESTALE;
+	spin_lock_irqsave(&k3.lock, flags);
+	if (ctx->cap_done - seq < K3_CAPTURE_DEPTH) {
+		ret = ctx->cap_err[seq % K3_CAPTURE_DEPTH];
+	}
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return ret;
+}
+
+/*
+ * Drop the capture buffer, once capture_work() is done with it. Fails with
+ * -EBUSY, keeping it, while the client still maps it itself.
+ */
+int capture_free(struct k3_ctx *ctx, bool unmap)
+{
+	flush_delayed_work(&ctx->cap_work);
+	if (unmap && !umap_unmap(&ctx->cap_map)) {
+		return -EBUSY;
+	}
+	pci_free_consistent(k3.pdev, ctx->cap_size, ctx->cap_base,
+			    ctx->cap_handle);
+	ctx->cap_base = NULL;
+	return 0;
+}
+
+/*
+ * Replace the context's capture buffer with one of cs->size bytes, or just
+ * free it for a size of 0. Captures still queued land in the old buffer
+ * first.
+ */
+long capture_setup(struct file *fp, struct kyouko3_capture_setup *cs)
+{
+	struct k3_ctx *ctx = fp->private_data;
+	u32 size = PAGE_ALIGN(cs->size);
+	unsigned long addr;
+	int ret;
+
+	if (cs->size > K3_CAPTURE_MAXSIZE) {
+		return -EINVAL;
+	}
+	if (ctx->cap_base) {
+		ret = capture_free(ctx, true);
+		if (ret) {
+			return ret;
+		}
+	}
+	cs->u_base = 0;
+	if (size == 0) {
+		return 0;
+	}
+
+	ctx->cap_base = pci_alloc_consistent(k3.pdev, size, &ctx->cap_handle);
+	if (!ctx->cap_base) {
+		return -ENOMEM;
+	}
+	ctx->cap_size = size;
+	addr = umap_map(fp, &ctx->cap_map, size, PROT_READ, VM_PGOFF_CAPTURE);
+	if (IS_ERR_VALUE(addr)) {
+		pr_warn("vm_mmap failed\n");
+		capture_free(ctx, false);
+		return addr;
+	}
+	cs->u_base = addr;
+	return 0;
+}
+
+/*
+ * Queue a capture of c->rect into the capture buffer, snoozing first while
+ * K3_CAPTURE_DEPTH captures are in flight. A RASTER_FLUSH goes into the FIFO
+ * so that the rectangle holds everything drawn before it, and capture_work()
+ * copies the pixels out once the card is past it.
+ */
+long capture_request(struct k3_ctx *ctx, bool nonblock,
+		     struct kyouko3_capture *c)
+{
+	struct kyouko3_blit *b = &c->rect;
+	unsigned long flags;
+	u64 seq;
+	long ret;
+
+	b->op = K3_BLIT_READ;
+	ret = blit_check(b);
+	if (ret) {
+		return ret;
+	}
+	if (!ctx->cap_base || b->width == 0 || b->height == 0 ||
+	    c->buf_offset + ((u64)b->height - 1) * b->data_pitch +
+		    b->width * 4 > ctx->cap_size) {
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&k3.lock, flags);
+	for (;;) {
+		ret = fifo_wait_room(1, &flags);
+		if (ret) {
+			spin_unlock_irqrestore(&k3.lock, flags);
+			return ret;
+		}
+		if (ctx->cap_seq - ctx->cap_done < K3_CAPTURE_DEPTH) {
+			break;
+		}
+		seq = ctx->cap_done + 1;
+		spin_unlock_irqrestore(&k3.lock, flags);
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		ret = wait_event_interruptible_timeout(
+		    capture_snooze, capture_done(ctx, seq),
+		    msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS));
+		if (ret <= 0) {
+			return ret ? ret : -ETIMEDOUT;
+		}
+		spin_lock_irqsave(&k3.lock, flags);
+	}
+	fifo_write(RASTER_FLUSH, 0);
+	seq = ++ctx->cap_seq;
+	c->seq = seq;
+	ctx->cap_req[seq % K3_CAPTURE_DEPTH] = *c;
+	ctx->cap_pos[seq % K3_CAPTURE_DEPTH] = k3.fifo.queued;
+	fifo_kick();
+	spin_unlock_irqrestore(&k3.lock, flags);
+	schedule_delayed_work(&ctx->cap_work, 0);
+	return 0;
+}
+
+/*
+ * Forget page flipping and give the back buffers' device RAM back. Flips
+ * already in the FIFO still run; the caller puts drawing and scanout back on
+ * surface 0 behind them.
+ * Must be called with k3.vram.lock held.
+ */
+static void flip_reset(void)
+{
+	struct k3_flip *f = &k3.flip;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	f->owner = NULL;
+	f->seq = f->queued = f->done;
+	spin_unlock_irqrestore(&k3.lock, flags);
+	i = vram_find(f->vram);
+	if (i >= 0) {
+		vram_remove(i);
+	}
+	f->vram = 0;
+}
+
+// Stop flipping if ctx owns it. Flips not written to the FIFO yet are dropped.
+void flip_stop(struct k3_ctx *ctx)
+{
+	unsigned long flags;
+
+	mutex_lock(&k3.vram.lock);
+	if (k3.flip.owner == ctx) {
+		flip_reset();
+		spin_lock_irqsave(&k3.lock, flags);
+		if (!fifo_wait_room(2, &flags)) {
+			fifo_write(FRAME_STARTADDRESS, 0);
+			fifo_write(ENC_FRAME, 0);
+			fifo_kick();
+		}
+		spin_unlock_irqrestore(&k3.lock, flags);
+	}
+	mutex_unlock(&k3.vram.lock);
+}
+
+/*
+ * Reserve nbufs - 1 surfaces of the current mode above the screen and start
+ * drawing into surface 1 while surface 0 stays on screen.
+ */
+long flip_setup(struct k3_ctx *ctx, struct kyouko3_flip_setup *fs)
+{
+	struct k3_flip *f = &k3.flip;
+	unsigned long flags;
+	u32 size, handle;
+	int ret;
+
+	if (fs->nbufs == 0) {
+		flip_stop(ctx);
+		fs->size = 0;
+		return 0;
+	}
+	if (!k3.graphics_on || fs->nbufs < 2 || fs->nbufs > K3_FLIP_MAX) {
+		return -EINVAL;
+	}
+	size = K_READ_REG(FRAME_ROWPITCH) * K_READ_REG(FRAME_ROWS);
+
+	mutex_lock(&k3.vram.lock);
+	if (f->owner) {
+		mutex_unlock(&k3.vram.lock);
+		return -EBUSY;
+	}
+	handle = vram_reserve_locked(size, (fs->nbufs - 1) * size);
+	if (!handle) {
+		mutex_unlock(&k3.vram.lock);
+		return -ENOSPC;
+	}
+	spin_lock_irqsave(&k3.lock, flags);
+	ret = fifo_wait_room(3, &flags);
+	if (!ret) {
+		f->owner = ctx;
+		f->nbufs = fs->nbufs;
+		f->size = size;
+		f->vram = handle;
+		f->back = 1;
+		f->seq = f->queued = f->done = 0;
+		fifo_write(FRAME_STARTADDRESS, 0);
+		fifo_write(ENC_FRAME, 0);
+		fifo_write(FRAME_STARTADDRESS, size);
+		fifo_kick();
+	}
+	spin_unlock_irqrestore(&k3.lock, flags);
+	if (ret) {
+		vram_remove(vram_find(handle));
+	}
+	mutex_unlock(&k3.vram.lock);
+	fs->size = size;
+	return ret;
+}
+
+static bool flip_done(u64 seq)
+{
+	unsigned long flags;
+	bool done;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	flip_update();
+	done = k3.flip.done >= seq || !k3.flip.owner;
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return done;
+}
+
+/*
+ * Wait for flip seq to run, polling the tail like fifo_flush(): flips are
+ * written from the DMA interrupt, but one behind a frame drawn through the
+ * FIFO alone raises none.
+ */
+long flip_wait(u64 seq, unsigned int timeout_ms)
+{
+	unsigned long deadline = jiffies + msecs_to_jiffies(timeout_ms);
+	unsigned long poll_us = FIFO_POLL_MIN_US;
+	int ret;
+
+	while (!flip_done(seq)) {
+		if (time_after_eq(jiffies, deadline)) {
+			return -ETIMEDOUT;
+		}
+		ret = fifo_poll(flip_done(seq), poll_us);
+		if (ret == -ERESTARTSYS) {
+			return ret;
+		}
+		poll_us = min(poll_us * 2, FIFO_POLL_MAX_US);
+	}
+	return 0;
+}
+
+/*
+ * Queue a flip to the back buffer behind the owner's DMA buffers submitted so
+ * far. With nbufs surfaces, up to nbufs - 1 flips can be outstanding before
+ * this waits for the oldest.
+ */
+long flip_request(struct k3_ctx *ctx, bool nonblock, struct kyouko3_flip *fl)
+{
+	struct k3_flip *f = &k3.flip;
+	unsigned long flags;
+	u64 seq;
+	long ret;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	for (;;) {
+		if (f->owner != ctx) {
+			spin_unlock_irqrestore(&k3.lock, flags);
+			return -EINVAL;
+		}
+		flip_update();
+		if (f->seq - f->done < f->nbufs - 1) {
+			break;
+		}
+		seq = f->seq - (f->nbufs - 2);
+		spin_unlock_irqrestore(&k3.lock, flags);
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		ret = flip_wait(seq, FIFO_FLUSH_TIMEOUT_MS);
+		if (ret) {
+			return ret;
+		}
+		spin_lock_irqsave(&k3.lock, flags);
+	}
+	seq = ++f->seq;
+	f->surf[seq % K3_FLIP_MAX] = f->back;
+	f->fence[seq % K3_FLIP_MAX] = ctx->fence_submitted;
+	f->back = (f->back + 1) % f->nbufs;
+	fl->seq = seq;
+	fl->back = f->back;
+	flip_update();
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return 0;
+}
+
+/*
+ * Wait until no more than depth of the list's replays are left for the card
+ * to finish, on the same timeout as a FIFO flush.
+ */
+static int list_wait(struct k3_list *l, u64 depth)
+{
+	long ret;
+
+	ret = wait_event_interruptible_timeout(
+	    job_snooze, l->queued - READ_ONCE(l->done) <= depth,
+	    msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS));
+	if (ret == 0) {
+		pr_warn("display list stalled\n");
+		return -ETIMEDOUT;
+	}
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Free a display list once the card is done with it. If it never gets done
+ * the list is leaked, as the card may still read its packets. A list with
+ * packets holds the DMA interrupt that retires its replays.
+ */
+static int list_free(struct k3_list *l)
+{
+	if (l->size) {
+		if (!wait_event_timeout(job_snooze,
+					READ_ONCE(l->done) == l->queued,
+					msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS))) {
+			// Same as for DMA buffers in kyouko3_release().
+			pr_warn("display list still queued, leaking it\n");
+			mutex_lock(&k3.open_lock);
+			dma_irq_put();
+			mutex_unlock(&k3.open_lock);
+			return -ETIMEDOUT;
+		}
+		mutex_lock(&k3.open_lock);
+		dma_irq_put();
+		mutex_unlock(&k3.open_lock);
+		pci_free_consistent(k3.pdev, l->size, l->k_base, l->handle);
+	}
+	kfree(l->entries);
+	kfree(l);
+	return 0;
+}
+
+long list_create(struct k3_ctx *ctx, struct kyouko3_list *kl)
+{
+	struct k3_list *l;
+	void __user *data = (void __user *)(unsigned long)kl->data;
+	u32 i;
+	int slot;
+	long ret;
+
+	if (kl->count > K3_LIST_MAXCOUNT || kl->size > K3_LIST_MAXSIZE ||
+	    kl->size % 4 || (kl->count == 0 && kl->size == 0)) {
+		return -EINVAL;
+	}
+	l = kzalloc(sizeof(*l), GFP_KERNEL);
+	if (!l) {
+		return -ENOMEM;
+	}
+	if (kl->count) {
+		l->entries =
+		    memdup_user((void __user *)(unsigned long)kl->entries,
+				kl->count * sizeof(struct fifo_entry));
+		if (IS_ERR(l->entries)) {
+			ret = PTR_ERR(l->entries);
+			kfree(l);
+			return ret;
+		}
+		l->count = kl->count;
+	}
+	// DMA is started by the driver alone; see dma_dispatch().
+	for (i = 0; i < l->count; i++) {
+		if (l->entries[i].command == BUFA_ADDR ||
+		    l->entries[i].command == BUFA_CONF) {
+			list_free(l);
+			return -EINVAL;
+		}
+	}
+	if (kl->size) {
+		l->k_base = pci_alloc_consistent(k3.pdev, kl->size, &l->handle);
+		if (!l->k_base) {
+			list_free(l);
+			return -ENOMEM;
+		}
+		// Replays are retired by the DMA interrupt.
+		mutex_lock(&k3.open_lock);
+		ret = dma_irq_get();
+		mutex_unlock(&k3.open_lock);
+		if (ret) {
+			pci_free_consistent(k3.pdev, kl->size, l->k_base,
+					    l->handle);
+			list_free(l);
+			return ret;
+		}
+		l->size = kl->size;
+		if (copy_from_user(l->k_base, data, kl->size)) {
+			list_free(l);
+			return -EFAULT;
+		}
+	}
+
+	mutex_lock(&ctx->list_lock);
+	for (slot = 0; slot < K3_LIST_MAX && ctx->lists[slot]; slot++) {
+	}
+	if (slot == K3_LIST_MAX) {
+		mutex_unlock(&ctx->list_lock);
+		list_free(l);
+		return -ENOSPC;
+	}
+	ctx->lists[slot] = l;
+	mutex_unlock(&ctx->list_lock);
+	kl->handle = slot + 1;
+	return 0;
+}
+
+/*
+ * Apply the patches, then queue a job that writes the list's entries and
+ * DMAs its packets once the dispatcher gets to it. A list without packets
+ * has nothing for the dispatcher, and its entries go into the FIFO at once.
+ */
+long list_replay(struct k3_ctx *ctx, struct kyouko3_list_replay *r)
+{
+	struct kyouko3_list_patch *patches = NULL;
+	struct k3_list *l;
+	struct k3_job *job = NULL;
+	unsigned long flags;
+	u32 i;
+	long ret = 0;
+
+	if (r->handle == 0 || r->handle > K3_LIST_MAX ||
+	    r->npatches > K3_LIST_MAXPATCHES) {
+		return -EINVAL;
+	}
+	if (r->npatches) {
+		patches = memdup_user((void __user *)(unsigned long)r->patches,
+				      r->npatches * sizeof(*patches));
+		if (IS_ERR(patches)) {
+			return PTR_ERR(patches);
+		}
+	}
+
+	mutex_lock(&ctx->list_lock);
+	l = ctx->lists[r->handle - 1];
+	if (!l) {
+		ret = -EINVAL;
+		goto out;
+	}
+	for (i = 0; i < r->npatches; i++) {
+		if (patches[i].offset % 4 || patches[i].offset >= l->size) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+	if (!l->size) {
+		spin_lock_irqsave(&k3.lock, flags);
+		ret = fifo_wait_room(l->count, &flags);
+		if (!ret) {
+			for (i = 0; i < l->count; i++) {
+				fifo_write(l->entries[i].command,
+					   l->entries[i].value);
+			}
+			fifo_kick();
+		}
+		spin_unlock_irqrestore(&k3.lock, flags);
+		goto out;
+	}
+	// The card may still be reading the previous replay, which patches
+	// must not change under it.
+	ret = list_wait(l, r->npatches ? 0 : JOB_DEPTH - 1);
+	if (ret) {
+		goto out;
+	}
+	for (i = 0; i < r->npatches; i++) {
+		*(u32 *)(l->k_base + patches[i].offset) = patches[i].value;
+	}
+	wmb();
+	job = kmalloc(sizeof(*job), GFP_KERNEL);
+	if (!job) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	job->tag = K3_JOB_LIST;
+	job->list = l;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	l->queued++;
+	list_add_tail(&job->node, &k3.jobs);
+	ctx->last_job = ++k3.jobs_queued;
+	dma_kick_idle();
+	spin_unlock_irqrestore(&k3.lock, flags);
+out:
+	mutex_unlock(&ctx->list_lock);
+	kfree(patches);
+	return ret;
+}
+
+long list_destroy(struct k3_ctx *ctx, u32 handle)
+{
+	struct k3_list *l;
+
+	if (handle == 0 || handle > K3_LIST_MAX) {
+		return -EINVAL;
+	}
+	mutex_lock(&ctx->list_lock);
+	l = ctx->lists[handle - 1];
+	ctx->lists[handle - 1] = NULL;
+	mutex_unlock(&ctx->list_lock);
+	if (!l) {
+		return -EINVAL;
+	}
+	list_free(l);
+	return 0;
+}
+
+/*
+ * Give released buffer objects' memory back. Every buffer object holds the
+ * DMA interrupt that retires its submissions.
+ */
+static void bo_free_work(struct work_struct *work)
+{
+	struct k3_bo *bo, *tmp;
+	unsigned long flags;
+	LIST_HEAD(gone);
+
+	spin_lock_irqsave(&k3.bo_free_lock, flags);
+	list_splice_init(&k3.bo_free, &gone);
+	spin_unlock_irqrestore(&k3.bo_free_lock, flags);
+
+	list_for_each_entry_safe(bo, tmp, &gone, free_node) {
+		mutex_lock(&k3.open_lock);
+		dma_irq_put();
+		dma_pool_put(bo->k_base, bo->handle, bo->size);
+		mutex_unlock(&k3.open_lock);
+		kfree(bo);
+	}
+}
+
+static void bo_vm_open(struct vm_area_struct *vma)
+{
+	struct k3_bo *bo = vma->vm_private_data;
+
+	kref_get(&bo->ref);
+}
+
+static void bo_vm_close(struct vm_area_struct *vma)
+{
+	struct k3_bo *bo = vma->vm_private_data;
+
+	kref_put(&bo->ref, bo_release);
+}
+
+static const struct vm_operations_struct bo_vm_ops = {.open = bo_vm_open,
+						      .close = bo_vm_close};
+
+long bo_create(struct k3_ctx *ctx, struct kyouko3_bo *kb)
+{
+	struct k3_bo *bo;
+	u32 size = PAGE_ALIGN(kb->size);
+	int slot;
+	int ret;
+
+	if (kb->size == 0 || kb->size > K3_BO_MAXSIZE) {
+		return -EINVAL;
+	}
+	bo = kzalloc(sizeof(*bo), GFP_KERNEL);
+	if (!bo) {
+		return -ENOMEM;
+	}
+	kref_init(&bo->ref);
+	bo->size = size;
+	mutex_lock(&k3.open_lock);
+	bo->k_base = dma_pool_get(size, &bo->handle);
+	if (!bo->k_base) {
+		mutex_unlock(&k3.open_lock);
+		kfree(bo);
+		return -ENOMEM;
+	}
+	ret = dma_irq_get();
+	if (ret) {
+		dma_pool_put(bo->k_base, bo->handle, size);
+		mutex_unlock(&k3.open_lock);
+		kfree(bo);
+		return ret;
+	}
+	mutex_unlock(&k3.open_lock);
+
+	mutex_lock(&ctx->bo_lock);
+	for (slot = 0; slot < K3_BO_MAX && ctx->bos[slot]; slot++) {
+	}
+	if (slot == K3_BO_MAX) {
+		mutex_unlock(&ctx->bo_lock);
+		kref_put(&bo->ref, bo_release);
+		return -ENOSPC;
+	}
+	ctx->bos[slot] = bo;
+	mutex_unlock(&ctx->bo_lock);
+	kb->size = size;
+	kb->handle = slot + 1;
+	kb->offset = VM_PGOFF_BO + (u64)slot * K3_BO_MAXSIZE;
+	return 0;
+}
+
+long bo_destroy(struct k3_ctx *ctx, u32 handle)
+{
+	struct k3_bo *bo;
+
+	if (handle == 0 || handle > K3_BO_MAX) {
+		return -EINVAL;
+	}
+	mutex_lock(&ctx->bo_lock);
+	bo = ctx->bos[handle - 1];
+	ctx->bos[handle - 1] = NULL;
+	mutex_unlock(&ctx->bo_lock);
+	if (!bo) {
+		return -EINVAL;
+	}
+	kref_put(&bo->ref, bo_release);
+	return 0;
+}
+
+// Map a buffer object for kyouko3_mmap(). off is its VM_PGOFF_BO offset.
+static int bo_mmap(struct k3_ctx *ctx, struct vm_area_struct *vma,
+		   unsigned long off)
+{
+	u32 slot = (off - VM_PGOFF_BO) / K3_BO_MAXSIZE;
+	struct k3_bo *bo;
+	int ret;
+
+	if ((off - VM_PGOFF_BO) % K3_BO_MAXSIZE) {
+		return -EINVAL;
+	}
+	mutex_lock(&ctx->bo_lock);
+	bo = ctx->bos[slot];
+	if (!bo) {
+		mutex_unlock(&ctx->bo_lock);
+		return -EINVAL;
+	}
+	ret = vm_iomap_memory(vma, bo->handle, bo->size);
+	if (!ret) {
+		vma->vm_flags |= VM_DONTCOPY;
+		vma->vm_private_data = bo;
+		vma->vm_ops = &bo_vm_ops;
+		kref_get(&bo->ref);
+	}
+	mutex_unlock(&ctx->bo_lock);
+	return ret;
+}
+
+/*
+ * Queue a job that points the card at part of a buffer object once the
+ * dispatcher gets to it.
+ */
+long bo_submit(struct k3_ctx *ctx, struct kyouko3_bo_submit *sub)
+{
+	struct k3_bo *bo;
+	struct k3_job *job;
+	unsigned long flags;
+	long ret;
+
+	if (sub->handle == 0 || sub->handle > K3_BO_MAX || sub->count == 0 ||
+	    sub->offset % 4 || sub->count % 4) {
+		return -EINVAL;
+	}
+	mutex_lock(&ctx->bo_lock);
+	bo = ctx->bos[sub->handle - 1];
+	if (!bo || (u64)sub->offset + sub->count > bo->size) {
+		mutex_unlock(&ctx->bo_lock);
+		return -EINVAL;
+	}
+	ret = wait_event_interruptible_timeout(
+	    job_snooze, bo->queued - READ_ONCE(bo->done) < JOB_DEPTH,
+	    msecs_to_jiffies(FIFO_FLUSH_TIMEOUT_MS));
+	if (ret <= 0) {
+		mutex_unlock(&ctx->bo_lock);
+		return ret ? ret : -ETIMEDOUT;
+	}
+	job = kmalloc(sizeof(*job), GFP_KERNEL);
+	if (!job) {
+		mutex_unlock(&ctx->bo_lock);
+		return -ENOMEM;
+	}
+	job->tag = K3_JOB_BO;
+	job->bo = bo;
+	job->offset = sub->offset;
+	job->count = sub->count;
+	// Dropped by job_retire().
+	kref_get(&bo->ref);
+
+	spin_lock_irqsave(&k3.lock, flags);
+	bo->queued++;
+	list_add_tail(&job->node, &k3.jobs);
+	ctx->last_job = ++k3.jobs_queued;
+	dma_kick_idle();
+	spin_unlock_irqrestore(&k3.lock, flags);
+	mutex_unlock(&ctx->bo_lock);
+	return 0;
+}
+
+long bo_wait(struct k3_ctx *ctx, struct kyouko3_bo_wait *bw)
+{
+	struct k3_bo *bo;
+	u64 queued;
+	long ret;
+
+	if (bw->handle == 0 || bw->handle > K3_BO_MAX) {
+		return -EINVAL;
+	}
+	mutex_lock(&ctx->bo_lock);
+	bo = ctx->bos[bw->handle - 1];
+	if (!bo) {
+		mutex_unlock(&ctx->bo_lock);
+		return -EINVAL;
+	}
+	// A BO_DESTROY meanwhile must not free it under us.
+	kref_get(&bo->ref);
+	queued = bo->queued;
+	mutex_unlock(&ctx->bo_lock);
+
+	ret = wait_event_interruptible_timeout(
+	    job_snooze, READ_ONCE(bo->done) >= queued,
+	    msecs_to_jiffies(bw->timeout_ms));
+	kref_put(&bo->ref, bo_release);
+	if (ret < 0) {
+		return ret;
+	}
+	return ret ? 0 : -ETIMEDOUT;
+}
+
+/*
+ * Pin the bound ring for a submission path, so that UNBIND_DMA waits for it
+ * to leave before anything is freed. Fails with -EINVAL without a ring.
+ */
+static int dma_pin(struct k3_ctx *ctx)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	if (ctx->dma_on) {
+		ctx->dma_pins++;
+	} else {
+		ret = -EINVAL;
+	}
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return ret;
 }
 
-/* Set up pci interrupts and dma buffers */
-int dma_init(struct file *fp)
+static void dma_unpin(struct k3_ctx *ctx)
 {
-	int i;
-	int ret = 0;
-	unsigned long addr;
-
-	if (k3.dma_bufs_dirty) {
-		dma_free_bufs();
-	}
+	unsigned long flags;
 
-	// If dma was already on, skip the initialization.
-	// re-running the buffer allocation loop will cause us to lose the old
-	// dma handles and they would never be freed.
-	if (k3.dma_on) {
-		return 0;
+	spin_lock_irqsave(&k3.lock, flags);
+	if (--ctx->dma_pins == 0) {
+		wake_up_interruptible(&ctx->unbind_snooze);
 	}
+	spin_unlock_irqrestore(&k3.lock, flags);
+}
 
-	ret = pci_enable_msi(k3.pdev);
-	if (ret) {
-		pr_warn("pci_enable_msi failed\n");
-		return ret;
-	}
+/*
+ * True once the ring has drained and nothing pins it, in which case it is
+ * also closed to new pins.
+ */
+static bool dma_quiesce(struct k3_ctx *ctx)
+{
+	unsigned long flags;
+	bool idle;
 
-	ret = request_irq(k3.pdev->irq, (irq_handler_t)dma_isr, IRQF_SHARED,
-			  "kyouku3 dma isr", &k3);
-	if (ret) {
-		pr_warn("pci_enable_msi failed\n");
-		return ret;
+	spin_lock_irqsave(&k3.lock, flags);
+	idle = dmaq_cnt(ctx) == 0 && ctx->dma_pins == 0;
+	if (idle) {
+		ctx->dma_on = false;
 	}
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return idle;
+}
 
+// The ioctls that use the bound ring, which the caller has pinned.
+static long dma_ioctl(struct file *fp, unsigned int cmd, void __user *argp)
+{
+	struct k3_ctx *ctx = fp->private_data;
+	long ret = 0;
+	int count;
+	struct kyouko3_dma_start start;
+	struct kyouko3_dma_ticket ticket;
+	struct kyouko3_dma_submit sub;
+	u64 fence;
+	unsigned long u_base;
 
-	for (i = 0; i < DMA_BUFNUM; i++) {
-		k3.fill = i;
-		dma[i].k_base =
-		    pci_alloc_consistent(k3.pdev, DMA_BUFSIZE, &dma[i].handle);
-
-		addr = vm_mmap(fp, 0, DMA_BUFSIZE, PROT_READ | PROT_WRITE,
-			       MAP_SHARED, VM_PGOFF_DMA);
-		if (IS_ERR_VALUE(addr)) {
-			pr_warn("vm_mmap failed\n");
-			return addr;
+	switch (cmd) {
+	case START_DMA:
+		if (copy_from_user(&count, argp, sizeof(unsigned int)))
+			return -EFAULT;
+		if (count < 0 || count > ctx->bufsize) {
+			return -EINVAL;
+		}
+		if (count != 0) {
+			ret = initiate_transfer(ctx, count,
+						fp->f_flags & O_NONBLOCK, &fence);
+			if (ret) {
+				return ret;
+			}
+		}
+		u_base = dma_u_base(ctx, ctx->fill);
+		if (copy_to_user(argp, &u_base, sizeof(unsigned long)))
+			return -EFAULT;
+		break;
+	case START_DMA_FENCE:
+		if (copy_from_user(&start, argp,
+				   sizeof(struct kyouko3_dma_start)))
+			return -EFAULT;
+		if (start.count > ctx->bufsize) {
+			return -EINVAL;
+		}
+		start.fence = ctx->fence_submitted;
+		if (start.count != 0) {
+			ret = initiate_transfer(ctx, start.count,
+						fp->f_flags & O_NONBLOCK,
+						&start.fence);
+			if (ret) {
+				return ret;
+			}
 		}
-		dma[i].u_base = addr;
+		start.next_buf = dma_u_base(ctx, ctx->fill);
+		if (copy_to_user(argp, &start, sizeof(struct kyouko3_dma_start)))
+			return -EFAULT;
+		break;
+	case ACQUIRE_DMA:
+		ret = dma_acquire(ctx, fp->f_flags & O_NONBLOCK, &ticket);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user(argp, &ticket,
+				 sizeof(struct kyouko3_dma_ticket)))
+			return -EFAULT;
+		break;
+	case SUBMIT_DMA:
+		if (copy_from_user(&sub, argp,
+				   sizeof(struct kyouko3_dma_submit)))
+			return -EFAULT;
+		ret = dma_submit(ctx, &sub);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user(argp, &sub, sizeof(struct kyouko3_dma_submit)))
+			return -EFAULT;
+		break;
+	case SUBMIT_DMA_BATCH:
+		return dma_submit_batch(ctx, argp);
+	case SETUP_RING:
+		return ring_setup(fp, argp);
 	}
-	// We don't need locking here because we have not enabled interrupts on
-	// the device yet.
-	k3.fill = 0;
-	k3.drain = 0;
-	spin_lock_init(&k3.lock);
-	k3.dma_on = true;
-	K_WRITE_REG(CONF_INTERRUPT, 0x02);
-
 	return ret;
 }
 
-void dma_stop(void)
-{
-	K_WRITE_REG(CONF_INTERRUPT, 0);
-	free_irq(k3.pdev->irq, &k3);
-	pci_disable_msi(k3.pdev);
-}
-
-
 long kyouko3_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 {
 	struct fifo_entry entry;
+	struct k3_ctx *ctx = fp->private_data;
 	void __user *argp = (void __user *)arg;
 	long ret = 0;
-	int count;
 	unsigned long flags;
+	struct kyouko3_dma_bind bind;
+	struct kyouko3_blit bl;
+	struct kyouko3_capture_setup cs;
+	struct kyouko3_capture cap;
+	struct kyouko3_capture_wait cw;
+	struct kyouko3_flip_setup fs;
+	struct kyouko3_flip fl;
+	struct kyouko3_flip_wait fw;
+	struct kyouko3_vram_alloc va;
+	struct kyouko3_vram_stats vs;
+	struct kyouko3_list kl;
+	struct kyouko3_list_replay lr;
+	struct kyouko3_bo bo;
+	struct kyouko3_bo_submit bs;
+	struct kyouko3_bo_wait bw;
+	unsigned long u_base;
 
 	switch (cmd) {
 	case VMODE:
 		if (arg == GRAPHICS_ON) {
 
+			// The scanout surface, at the bottom of device RAM.
+			mutex_lock(&k3.vram.lock);
+			if (!k3.vram.screen) {
+				k3.vram.screen =
+				    vram_reserve_locked(0, 1024 * 768 * 4);
+			}
+			if (!k3.vram.screen) {
+				mutex_unlock(&k3.vram.lock);
+				return -ENOSPC;
+			}
+			// A mode set ends page flipping.
+			flip_reset();
+
 			K_WRITE_REG(FRAME_COLUMNS, 1024);
 			K_WRITE_REG(FRAME_ROWS, 768);
 			K_WRITE_REG(FRAME_ROWPITCH, 1024 * 4);
@@ -318,6 +3259,16 @@ long kyouko3_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 
 			msleep(10);
 
+			spin_lock_irqsave(&k3.lock, flags);
+			ret = fifo_wait_room(9, &flags);
+			if (ret) {
+				spin_unlock_irqrestore(&k3.lock, flags);
+				mutex_unlock(&k3.vram.lock);
+				return ret;
+			}
+			// Flips still in the FIFO move drawing off the screen.
+			fifo_write(FRAME_STARTADDRESS, 0);
+			fifo_write(ENC_FRAME, 0);
 			fifo_write(CLEAR_COLOR, 0);
 			fifo_write(CLEAR_COLOR + 0x0004, 0);
 			fifo_write(CLEAR_COLOR + 0x0008, 0);
@@ -325,114 +3276,438 @@ long kyouko3_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
 
 			fifo_write(RASTER_CLEAR, 3);
 			fifo_write(RASTER_FLUSH, 0);
-			fifo_flush();
+			spin_unlock_irqrestore(&k3.lock, flags);
+			mutex_unlock(&k3.vram.lock);
+			ret = fifo_flush(ctx);
 
 			k3.graphics_on = 1;
 		}
 		// disable graphics mode.
 		else if (arg == GRAPHICS_OFF) {
-			if (!k3.dma_on) {
-				fifo_flush();
+			if (!k3.dma_users) {
+				ret = fifo_flush(NULL);
 			}
 			K_WRITE_REG(CONF_ACCELERATION, 0x80000000);
 			K_WRITE_REG(CONF_MODESET, 0);
 			k3.graphics_on = 0;
+			mutex_lock(&k3.vram.lock);
+			flip_reset();
+			mutex_unlock(&k3.vram.lock);
+			vram_release(k3.vram.screen);
+			k3.vram.screen = 0;
 		}
 		break;
 	case FIFO_QUEUE:
 		if (copy_from_user(&entry, argp, sizeof(struct fifo_entry)))
 			return -EFAULT;
-		fifo_write(entry.command, entry.value);
+		spin_lock_irqsave(&k3.lock, flags);
+		ret = fifo_wait_room(1, &flags);
+		if (!ret) {
+			fifo_write(entry.command, entry.value);
+		}
+		spin_unlock_irqrestore(&k3.lock, flags);
 		break;
+	case FIFO_QUEUE_BATCH:
+		return fifo_write_batch(argp);
 	case FIFO_FLUSH:
-		fifo_flush();
-		break;
+		return fifo_flush(ctx);
 	case BIND_DMA:
 		pr_debug("BIND_DMA\n");
-		ret = dma_init(fp);
+		mutex_lock(&ctx->bind_lock);
+		ret = dma_init(fp, DMA_BUFNUM, DMA_BUFSIZE);
+		if (!ret) {
+			u_base = dma_u_base(ctx, 0);
+		}
+		mutex_unlock(&ctx->bind_lock);
 		if (ret) {
 			pr_warn("BIND_DMA failed\n");
 			return ret;
 		}
-		if (copy_to_user(argp, &dma[0].u_base, sizeof(unsigned long))) {
+		if (copy_to_user(argp, &u_base, sizeof(unsigned long))) {
 			return -EFAULT;
 		}
 		pr_debug("done\n");
 		return 0;
+	case BIND_DMA_GEOM:
+		if (copy_from_user(&bind, argp,
+				   sizeof(struct kyouko3_dma_bind)))
+			return -EFAULT;
+		dma_fix_geom(&bind.nbufs, &bind.bufsize);
+		pr_debug("BIND_DMA_GEOM %u x %u\n", bind.nbufs, bind.bufsize);
+		mutex_lock(&ctx->bind_lock);
+		if (ctx->dma_on) {
+			mutex_unlock(&ctx->bind_lock);
+			return -EBUSY;
+		}
+		ret = dma_init(fp, bind.nbufs, bind.bufsize);
+		if (!ret) {
+			bind.u_base = dma_u_base(ctx, 0);
+		}
+		mutex_unlock(&ctx->bind_lock);
+		if (ret) {
+			pr_warn("BIND_DMA_GEOM failed\n");
+			return ret;
+		}
+		if (copy_to_user(argp, &bind, sizeof(struct kyouko3_dma_bind)))
+			return -EFAULT;
+		return 0;
 	case UNBIND_DMA:
+		mutex_lock(&ctx->bind_lock);
+		if (!ctx->dma_on) {
+			mutex_unlock(&ctx->bind_lock);
+			return -EINVAL;
+		}
 		pr_debug("unbinding dma\n");
-		spin_lock_irqsave(&k3.lock, flags);
-		if (dmaq_cnt() != 0) {
-			pr_debug("unbind_snoozing\n");
-			k3.unbind_snoozing = true;
-			spin_unlock_irqrestore(&k3.lock, flags);
-			wait_event_interruptible(unbind_snooze,
-						 !k3.unbind_snoozing);
-			pr_debug("unbind_snoozing done\n");
-
-		} else {
-			spin_unlock_irqrestore(&k3.lock, flags);
+		pr_debug("unbind_snoozing\n");
+		ret = wait_event_interruptible(ctx->unbind_snooze,
+					       dma_quiesce(ctx));
+		if (ret) {
+			mutex_unlock(&ctx->bind_lock);
+			return ret;
 		}
 		pr_debug("real unbind dma\n");
 
-		dma_free_bufs();
-		dma_stop();
-		k3.dma_on = 0;
+		// The buffers stay mapped for the next bind. The ring page
+		// does not, and cannot be freed while the client maps it.
+		if (ctx->ring_page && !umap_unmap(&ctx->ring_map)) {
+			spin_lock_irqsave(&k3.lock, flags);
+			ctx->dma_on = true;
+			spin_unlock_irqrestore(&k3.lock, flags);
+			mutex_unlock(&ctx->bind_lock);
+			return -EBUSY;
+		}
+		dma_stop(ctx);
+		ring_free(ctx);
+		mutex_unlock(&ctx->bind_lock);
 		pr_debug("done\n");
 		break;
 	case START_DMA:
-		if (copy_from_user(&count, argp, sizeof(unsigned int)))
+	case START_DMA_FENCE:
+	case ACQUIRE_DMA:
+	case SUBMIT_DMA:
+	case SUBMIT_DMA_BATCH:
+	case SETUP_RING:
+		ret = dma_pin(ctx);
+		if (ret) {
+			return ret;
+		}
+		ret = dma_ioctl(fp, cmd, argp);
+		dma_unpin(ctx);
+		return ret;
+	case RING_ENTER:
+		return ring_enter(ctx);
+	case BLIT:
+		if (copy_from_user(&bl, argp, sizeof(struct kyouko3_blit)))
 			return -EFAULT;
-		if (count != 0) {
-			initiate_transfer(count);
+		return blit_run(ctx, &bl);
+	case SETUP_CAPTURE:
+		if (copy_from_user(&cs, argp,
+				   sizeof(struct kyouko3_capture_setup)))
+			return -EFAULT;
+		ret = capture_setup(fp, &cs);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user(argp, &cs,
+				 sizeof(struct kyouko3_capture_setup)))
+			return -EFAULT;
+		break;
+	case CAPTURE:
+		if (copy_from_user(&cap, argp, sizeof(struct kyouko3_capture)))
+			return -EFAULT;
+		ret = capture_request(ctx, fp->f_flags & O_NONBLOCK, &cap);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user(argp, &cap, sizeof(struct kyouko3_capture)))
+			return -EFAULT;
+		break;
+	case CAPTURE_WAIT:
+		if (copy_from_user(&cw, argp,
+				   sizeof(struct kyouko3_capture_wait)))
+			return -EFAULT;
+		if (cw.seq > ctx->cap_seq) {
+			return -EINVAL;
+		}
+		return capture_wait(ctx, cw.seq, cw.timeout_ms);
+	case SETUP_FLIP:
+		if (copy_from_user(&fs, argp,
+				   sizeof(struct kyouko3_flip_setup)))
+			return -EFAULT;
+		ret = flip_setup(ctx, &fs);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user(argp, &fs, sizeof(struct kyouko3_flip_setup)))
+			return -EFAULT;
+		break;
+	case FLIP:
+		ret = flip_request(ctx, fp->f_flags & O_NONBLOCK, &fl);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user(argp, &fl, sizeof(struct kyouko3_flip)))
+			return -EFAULT;
+		break;
+	case FLIP_WAIT:
+		if (copy_from_user(&fw, argp, sizeof(struct kyouko3_flip_wait)))
+			return -EFAULT;
+		if (fw.seq > READ_ONCE(k3.flip.seq)) {
+			return -EINVAL;
+		}
+		return flip_wait(fw.seq, fw.timeout_ms);
+	case VRAM_ALLOC:
+		if (copy_from_user(&va, argp,
+				   sizeof(struct kyouko3_vram_alloc)))
+			return -EFAULT;
+		ret = vram_alloc(ctx, &va);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user(argp, &va, sizeof(struct kyouko3_vram_alloc))) {
+			vram_free(ctx, va.handle);
+			return -EFAULT;
+		}
+		break;
+	case VRAM_FREE:
+		return vram_free(ctx, (u32)arg);
+	case VRAM_STATS:
+		vram_stats(&vs);
+		if (copy_to_user(argp, &vs, sizeof(struct kyouko3_vram_stats)))
+			return -EFAULT;
+		break;
+	case LIST_CREATE:
+		if (copy_from_user(&kl, argp, sizeof(struct kyouko3_list)))
+			return -EFAULT;
+		ret = list_create(ctx, &kl);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user(argp, &kl, sizeof(struct kyouko3_list))) {
+			list_destroy(ctx, kl.handle);
+			return -EFAULT;
+		}
+		break;
+	case LIST_REPLAY:
+		if (copy_from_user(&lr, argp,
+				   sizeof(struct kyouko3_list_replay)))
+			return -EFAULT;
+		return list_replay(ctx, &lr);
+	case LIST_DESTROY:
+		return list_destroy(ctx, (u32)arg);
+	case BO_CREATE:
+		if (copy_from_user(&bo, argp, sizeof(struct kyouko3_bo)))
+			return -EFAULT;
+		ret = bo_create(ctx, &bo);
+		if (ret) {
+			return ret;
 		}
-		if (copy_to_user(argp, &dma[k3.fill].u_base,
-				 sizeof(unsigned long)))
+		if (copy_to_user(argp, &bo, sizeof(struct kyouko3_bo))) {
+			bo_destroy(ctx, bo.handle);
 			return -EFAULT;
+		}
 		break;
+	case BO_DESTROY:
+		return bo_destroy(ctx, (u32)arg);
+	case BO_SUBMIT:
+		if (copy_from_user(&bs, argp, sizeof(struct kyouko3_bo_submit)))
+			return -EFAULT;
+		return bo_submit(ctx, &bs);
+	case BO_WAIT:
+		if (copy_from_user(&bw, argp, sizeof(struct kyouko3_bo_wait)))
+			return -EFAULT;
+		return bo_wait(ctx, &bw);
+	case WAIT_FENCE:
+		return fence_wait(ctx, argp);
 	}
 	return ret;
 }
 
 int kyouko3_open(struct inode *inode, struct file *fp)
 {
-	// ioremap_wc is faster than ioremap on some hardware
-	k3.control.k_base = ioremap_wc(k3.control.p_base, k3.control.len);
-	k3.fb.k_base = ioremap_wc(k3.fb.p_base, k3.fb.len);
-	fifo_init();
+	struct k3_ctx *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx) {
+		return -ENOMEM;
+	}
+	init_waitqueue_head(&ctx->dma_snooze);
+	init_waitqueue_head(&ctx->unbind_snooze);
+	init_waitqueue_head(&ctx->fence_snooze);
+	mutex_init(&ctx->list_lock);
+	mutex_init(&ctx->bo_lock);
+	mutex_init(&ctx->bind_lock);
+	umap_init(&ctx->dma_map);
+	umap_init(&ctx->ring_map);
+	umap_init(&ctx->cap_map);
+	INIT_DELAYED_WORK(&ctx->cap_work, capture_work);
+	INIT_LIST_HEAD(&ctx->node);
+	fp->private_data = ctx;
+
+	// The control region and the FIFO are shared by every client, so only
+	// the first open sets them up.
+	mutex_lock(&k3.open_lock);
+	if (k3.users++ == 0) {
+		// ioremap_wc is faster than ioremap on some hardware
+		k3.control.k_base =
+		    ioremap_wc(k3.control.p_base, k3.control.len);
+		k3.fb.k_base = ioremap_wc(k3.fb.p_base, k3.fb.len);
+		fifo_init();
+	}
+	mutex_unlock(&k3.open_lock);
 	return 0;
 }
 
 int kyouko3_release(struct inode *inode, struct file *fp)
 {
+	struct k3_ctx *ctx = fp->private_data;
+	int i;
+
 	pr_debug("release\n");
-	// User bailed. Since we can't use vm_munmap inside release because of
-	// deadlocks, we stop the dma but don't fully clean up.
-	if (k3.dma_on) {
-		dma_stop();
-		k3.dma_on = false;
-		k3.dma_bufs_dirty = true;
-		k3.dma_on = 0;
-	}
-
-	kyouko3_ioctl(fp, VMODE, GRAPHICS_OFF);
-	fifo_flush();
-	iounmap(k3.control.k_base);
-	iounmap(k3.fb.k_base);
-	pci_free_consistent(k3.pdev, 8192, k3.fifo.k_base, k3.fifo.p_base);
+	flip_stop(ctx);
+	vram_free_ctx(ctx);
+	for (i = 0; i < K3_LIST_MAX; i++) {
+		if (ctx->lists[i]) {
+			list_free(ctx->lists[i]);
+		}
+	}
+	// Mappings hold the file open, so these are the last references.
+	for (i = 0; i < K3_BO_MAX; i++) {
+		bo_destroy(ctx, i + 1);
+	}
+	if (ctx->cap_base) {
+		capture_free(ctx, false);
+	}
+	// User bailed. Every mapping of the DMA buffers holds a reference on
+	// the file, so by the time we get here they are all gone and the
+	// buffers only need to drain before they can be freed.
+	if (ctx->dma_on) {
+		if (!wait_event_timeout(ctx->unbind_snooze, dmaq_cnt(ctx) == 0,
+					HZ)) {
+			// The hardware may still own one of our buffers.
+			// Leaking them beats letting the card DMA from freed
+			// memory.
+			pr_warn("DMA did not drain, leaking buffers\n");
+			dma_stop(ctx);
+			ctx->dma = NULL;
+		} else {
+			dma_stop(ctx);
+		}
+	}
+	// Buffers of a finished or unbound ring go back to the pool.
+	dma_free_bufs(ctx, false);
+
+	mutex_lock(&k3.open_lock);
+	if (--k3.users == 0) {
+		kyouko3_ioctl(fp, VMODE, GRAPHICS_OFF);
+		fifo_flush(NULL);
+		cancel_delayed_work_sync(&k3.dispatch_work);
+		k3.dispatch_pending = false;
+		iounmap(k3.control.k_base);
+		iounmap(k3.fb.k_base);
+		pci_free_consistent(k3.pdev, 8 * FIFO_ENTRIES, k3.fifo.k_base,
+				    k3.fifo.p_base);
+	}
+	mutex_unlock(&k3.open_lock);
+	kfree(ctx);
 	return 0;
 }
 
+/*
+ * read() returns the latest completed fence as a u64, blocking until one
+ * completes that has not been read yet.
+ */
+ssize_t kyouko3_read(struct file *fp, char __user *buf, size_t len,
+		     loff_t *off)
+{
+	struct k3_ctx *ctx = fp->private_data;
+	u64 fence;
+	int ret;
+
+	if (len < sizeof(u64)) {
+		return -EINVAL;
+	}
+	if (fp->f_flags & O_NONBLOCK) {
+		if (READ_ONCE(ctx->fence_done) == ctx->fence_read) {
+			return -EAGAIN;
+		}
+	} else {
+		ret = wait_event_interruptible(
+		    ctx->fence_snooze,
+		    READ_ONCE(ctx->fence_done) != ctx->fence_read);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	fence = READ_ONCE(ctx->fence_done);
+	if (copy_to_user(buf, &fence, sizeof(u64))) {
+		return -EFAULT;
+	}
+	ctx->fence_read = fence;
+	return sizeof(u64);
+}
+
+/*
+ * Readable once a fence has completed that read() has not returned yet.
+ * Writable while START_DMA would queue a buffer without snoozing, or, with
+ * tickets held, while ACQUIRE_DMA would hand one out without snoozing.
+ */
+unsigned int kyouko3_poll(struct file *fp, poll_table *wait)
+{
+	struct k3_ctx *ctx = fp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(fp, &ctx->fence_snooze, wait);
+	poll_wait(fp, &ctx->dma_snooze, wait);
+	if (READ_ONCE(ctx->fence_done) != ctx->fence_read) {
+		mask |= POLLIN | POLLRDNORM;
+	}
+	if (ctx->dma_on && (ctx->ticket_next == ctx->fence_submitted
+				? !dmaq_full(ctx)
+				: dmaq_ticket_free(ctx))) {
+		mask |= POLLOUT | POLLWRNORM;
+	}
+	return mask;
+}
+
+/*
+ * Map the page of the ring's buffers that the client touched. dma_free_bufs()
+ * leaves the buffers alone while any vma maps them.
+ */
+static vm_fault_t dma_vm_fault(struct vm_fault *vmf)
+{
+	struct k3_ctx *ctx = container_of(vmf->vma->vm_private_data,
+					  struct k3_ctx, dma_map);
+	unsigned long off = vmf->pgoff << PAGE_SHIFT;
+	struct k3_dma_buf *buf;
+
+	if (!ctx->dma || off >= (unsigned long)ctx->nbufs * ctx->bufsize) {
+		return VM_FAULT_SIGBUS;
+	}
+	buf = &ctx->dma[off / ctx->bufsize];
+	return vmf_insert_pfn(vmf->vma, vmf->address,
+			      (buf->handle + off % ctx->bufsize) >> PAGE_SHIFT);
+}
+
+static const struct vm_operations_struct dma_vm_ops = {.open = umap_vm_open,
+						      .close = umap_vm_close,
+						      .fault = dma_vm_fault};
+
 int kyouko3_mmap(struct file *fp, struct vm_area_struct *vma)
 {
 	int ret = 0;
 	unsigned long off;
+	struct k3_ctx *ctx = fp->private_data;
 
 	// vm_iomap_memory provides a simpler API than io_remap_pfn_range and
 	// reduces possibilities for bugs
 	// Offset is just used to choose regions, it isn't a real offset.
 	off = vma->vm_pgoff << PAGE_SHIFT;
 	vma->vm_pgoff = 0;
+	if (off >= VM_PGOFF_BO && off < VM_PGOFF_CAPTURE) {
+		return bo_mmap(ctx, vma, off);
+	}
 	switch (off) {
 	case VM_PGOFF_CONTROL:
 		ret = vm_iomap_memory(vma, k3.control.p_base, k3.control.len);
@@ -441,7 +3716,38 @@ int kyouko3_mmap(struct file *fp, struct vm_area_struct *vma)
 		ret = vm_iomap_memory(vma, k3.fb.p_base, k3.fb.len);
 		break;
 	case VM_PGOFF_DMA:
-		ret = vm_iomap_memory(vma, dma[k3.fill].handle, DMA_BUFSIZE);
+		if (!ctx->dma || vma->vm_end - vma->vm_start !=
+				     (unsigned long)ctx->nbufs * ctx->bufsize) {
+			return -EINVAL;
+		}
+		// Nothing is mapped until the client touches it.
+		vma->vm_flags |= VM_IO | VM_PFNMAP | VM_DONTEXPAND |
+				 VM_DONTDUMP | VM_DONTCOPY;
+		vma->vm_ops = &dma_vm_ops;
+		umap_attach(&ctx->dma_map, vma);
+		break;
+	case VM_PGOFF_CAPTURE:
+		if (!ctx->cap_base) {
+			return -EINVAL;
+		}
+		ret = vm_iomap_memory(vma, ctx->cap_handle, ctx->cap_size);
+		if (!ret) {
+			vma->vm_ops = &umap_vm_ops;
+			umap_attach(&ctx->cap_map, vma);
+		}
+		break;
+	case VM_PGOFF_RING:
+		if (!ctx->ring_page ||
+		    vma->vm_end - vma->vm_start != PAGE_SIZE) {
+			return -EINVAL;
+		}
+		ret = remap_pfn_range(vma, vma->vm_start,
+				      virt_to_phys(ctx->ring_page) >> PAGE_SHIFT,
+				      PAGE_SIZE, vma->vm_page_prot);
+		if (!ret) {
+			vma->vm_ops = &umap_vm_ops;
+			umap_attach(&ctx->ring_map, vma);
+		}
 		break;
 	}
 	return ret;
@@ -450,9 +3756,142 @@ int kyouko3_mmap(struct file *fp, struct vm_area_struct *vma)
 struct file_operations kyouko3_fops = {.open = kyouko3_open,
 				       .release = kyouko3_release,
 				       .mmap = kyouko3_mmap,
+				       .read = kyouko3_read,
+				       .poll = kyouko3_poll,
 				       .unlocked_ioctl = kyouko3_ioctl,
 				       .owner = THIS_MODULE};
 
+/*
+ * /proc/driver/kyouko3/stats shows the counters in k3.stats, one per line,
+ * and writing anything to it starts them over. debugfs is EXPORT_SYMBOL_GPL,
+ * procfs is not.
+ */
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct k3_stats st;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	st = k3.stats;
+	spin_unlock_irqrestore(&k3.lock, flags);
+
+	seq_printf(m, "submitted %llu\n", st.submitted);
+	seq_printf(m, "bytes %llu\n", st.bytes);
+	seq_puts(m, "occupancy");
+	for (i = 0; i < STATS_OCC_BUCKETS; i++) {
+		u32 lo = i ? (1U << (i - 1)) + 1 : 1;
+
+		if (lo == 1U << i) {
+			seq_printf(m, " %u:%llu", lo, st.occupancy[i]);
+		} else {
+			seq_printf(m, " %u-%u:%llu", lo, 1U << i,
+				   st.occupancy[i]);
+		}
+	}
+	seq_putc(m, '\n');
+	seq_printf(m, "dispatches %llu\n", st.dispatches);
+	seq_printf(m, "interrupts %llu\n", st.interrupts);
+	seq_printf(m, "irq_ns %llu\n", st.irq_ns);
+	seq_printf(m, "irq_max_ns %llu\n", st.irq_max_ns);
+	seq_printf(m, "snoozes %llu\n", st.snoozes);
+	seq_printf(m, "snooze_ns %llu\n", st.snooze_ns);
+	seq_printf(m, "snooze_max_ns %llu\n", st.snooze_max_ns);
+	seq_printf(m, "flushes %llu\n", st.flushes);
+	seq_printf(m, "flush_ns %llu\n", st.flush_ns);
+	seq_printf(m, "flush_max_ns %llu\n", st.flush_max_ns);
+	seq_printf(m, "flush_timeouts %llu\n", st.flush_timeouts);
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_show, NULL);
+}
+
+static ssize_t stats_write(struct file *file, const char __user *buf,
+			   size_t len, loff_t *ppos)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&k3.lock, flags);
+	memset(&k3.stats, 0, sizeof(k3.stats));
+	spin_unlock_irqrestore(&k3.lock, flags);
+	return len;
+}
+
+static const struct proc_ops stats_proc_ops = {.proc_open = stats_open,
+						.proc_read = seq_read,
+						.proc_write = stats_write,
+						.proc_lseek = seq_lseek,
+						.proc_release = single_release};
+
+static const char *const event_names[] = {
+    [K3_EV_SUBMIT] = "submit",
+    [K3_EV_DISPATCH] = "dispatch",
+    [K3_EV_COMPLETE] = "complete",
+    [K3_EV_FLUSH] = "flush",
+};
+
+/*
+ * /proc/driver/kyouko3/events lists the last K3_EVENTS pipeline events,
+ * oldest first, each with its time on the raw monotonic clock. The gaps
+ * between a buffer's submit, dispatch and complete show where its time
+ * went. Tracepoints would do this better, but the trace event machinery is
+ * EXPORT_SYMBOL_GPL.
+ */
+static int events_show(struct seq_file *m, void *v)
+{
+	struct k3_event *ev;
+	unsigned long flags;
+	u64 next, first, i;
+
+	ev = kmalloc(sizeof(k3.events), GFP_KERNEL);
+	if (!ev) {
+		return -ENOMEM;
+	}
+	spin_lock_irqsave(&k3.lock, flags);
+	memcpy(ev, k3.events, sizeof(k3.events));
+	next = k3.events_next;
+	spin_unlock_irqrestore(&k3.lock, flags);
+
+	first = next > K3_EVENTS ? next - K3_EVENTS : 0;
+	for (i = first; i < next; i++) {
+		struct k3_event *e = &ev[i % K3_EVENTS];
+
+		seq_printf(m, "%llu.%06llu %s ctx=%p fence=%llu",
+			   e->ns / NSEC_PER_SEC,
+			   e->ns % NSEC_PER_SEC / NSEC_PER_USEC,
+			   event_names[e->type], e->ctx, e->fence);
+		switch (e->type) {
+		case K3_EV_SUBMIT:
+			seq_printf(m, " size=%llu queued=%lld\n", e->a, e->b);
+			break;
+		case K3_EV_DISPATCH:
+			seq_printf(m, " bytes=%llu pos=%lld\n", e->a, e->b);
+			break;
+		case K3_EV_COMPLETE:
+			seq_printf(m, " irq_ns=%llu\n", e->a);
+			break;
+		case K3_EV_FLUSH:
+			seq_printf(m, " wait_ns=%llu ret=%lld\n", e->a, e->b);
+			break;
+		}
+	}
+	kfree(ev);
+	return 0;
+}
+
+static int events_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, events_show, NULL);
+}
+
+static const struct proc_ops events_proc_ops = {.proc_open = events_open,
+						 .proc_read = seq_read,
+						 .proc_lseek = seq_lseek,
+						 .proc_release = single_release};
+
 struct cdev kyouko3_dev;
 
 int kyouko3_probe(struct pci_dev *pdev, const struct pci_device_id *pci_id)
@@ -471,6 +3910,8 @@ int kyouko3_probe(struct pci_dev *pdev, const struct pci_device_id *pci_id)
 
 void kyouko3_remove(struct pci_dev *pdev)
 {
+	flush_delayed_work(&k3.bo_free_work);
+	dma_pool_drain();
 	pci_disable_device(pdev);
 }
 
@@ -484,6 +3925,18 @@ struct pci_driver kyouko3_pci_drv = {.name = "kyouko3_pci_drv",
 
 int kyouko3_init(void)
 {
+	spin_lock_init(&k3.lock);
+	mutex_init(&k3.open_lock);
+	mutex_init(&k3.vram.lock);
+	INIT_LIST_HEAD(&k3.ctxs);
+	INIT_LIST_HEAD(&k3.jobs);
+	INIT_DELAYED_WORK(&k3.dispatch_work, dma_dispatch_work);
+	spin_lock_init(&k3.bo_free_lock);
+	INIT_LIST_HEAD(&k3.bo_free);
+	INIT_DELAYED_WORK(&k3.bo_free_work, bo_free_work);
+	k3.proc = proc_mkdir("driver/kyouko3", NULL);
+	proc_create("stats", 0600, k3.proc, &stats_proc_ops);
+	proc_create("events", 0400, k3.proc, &events_proc_ops);
 	cdev_init(&kyouko3_dev, &kyouko3_fops);
 	cdev_add(&kyouko3_dev, MKDEV(500, 127), 1);
 	return pci_register_driver(&kyouko3_pci_drv);
@@ -493,6 +3946,7 @@ void kyouko3_exit(void)
 {
 	cdev_del(&kyouko3_dev);
 	pci_unregister_driver(&kyouko3_pci_drv);
+	proc_remove(k3.proc);
 }
 
 module_init(kyouko3_init);
@@ -1,3 +1,6 @@
+#ifndef KYOUKO3_H
+#define KYOUKO3_H
+
 #include <linux/ioctl.h>
 #include <linux/types.h>
 
@@ -7,6 +10,291 @@ struct fifo_entry
     __u32 value;
 };
 
+// Argument to FIFO_QUEUE_BATCH. entries is a user pointer to an array of
+// count fifo_entry records.
+struct fifo_batch
+{
+    __u64 entries;
+    __u32 count;
+    __u32 pad;
+};
+
+// Argument to START_DMA_FENCE. count is the number of bytes filled in the
+// current buffer (0 to just query). The driver fills in the address of the
+// next buffer to fill and the fence that signals when this one has been
+// consumed by the card.
+struct kyouko3_dma_start
+{
+    __u32 count;
+    __u32 pad;
+    __u64 next_buf;
+    __u64 fence;
+};
+
+// Argument to WAIT_FENCE. A timeout of 0 just polls.
+struct kyouko3_fence_wait
+{
+    __u64 fence;
+    __u32 timeout_ms;
+    __u32 pad;
+};
+
+// Argument to BIND_DMA_GEOM. nbufs and bufsize request a ring geometry (0
+// picks the default); the driver clamps them to the limits above and writes
+// back what it chose, along with the address of the first buffer.
+//
+// UNBIND_DMA waits for the ring to drain and for calls using it on other
+// threads, such as an ACQUIRE_DMA snoozing for a buffer, to return. It
+// leaves the buffers mapped. Binding again with the same geometry
+// hands back the same buffers, at the same address unless the client has
+// unmapped or split that mapping in the meantime, in which case they are
+// mapped again. Other geometries replace them, and fail with EBUSY while the
+// client still maps the old buffers through a mapping of its own.
+struct kyouko3_dma_bind
+{
+    __u32 nbufs;
+    __u32 bufsize;
+    __u64 u_base;
+};
+
+// Argument to ACQUIRE_DMA. The driver hands out a free buffer of the ring
+// along with a ticket; tickets are issued in increasing order and buffers are
+// queued to the card in ticket order, however SUBMIT_DMA calls interleave.
+struct kyouko3_dma_ticket
+{
+    __u64 ticket;
+    __u64 u_base;
+};
+
+// Argument to SUBMIT_DMA. count is the number of bytes recorded in the
+// ticket's buffer; 0 gives the ticket up without holding later ones back.
+// The driver fills in the buffer's fence.
+struct kyouko3_dma_submit
+{
+    __u64 ticket;
+    __u32 count;
+    __u32 pad;
+    __u64 fence;
+};
+
+// Argument to SUBMIT_DMA_BATCH. subs is a user pointer to an array of count
+// kyouko3_dma_submit records, each filled in as SUBMIT_DMA would.
+struct kyouko3_dma_submit_batch
+{
+    __u64 subs;
+    __u32 count;
+    __u32 pad;
+};
+
+// Argument to SETUP_FLIP. nbufs asks for that many surfaces of the current
+// mode (2 to K3_FLIP_MAX, or 0 to stop flipping); the driver fills in the
+// byte size of each. Surface i starts at device RAM offset i * size, surface
+// 0 being the screen VMODE sets up. Surface 0 stays on screen while drawing
+// moves to surface 1. The others are reserved like VRAM_ALLOC blocks, so this
+// fails with ENOSPC if blocks have grown down into them, and with EBUSY while
+// flipping is set up already, by this client or another. Flipping ends with
+// nbufs 0, close or VMODE, which put drawing and scanout back on surface 0.
+struct kyouko3_flip_setup
+{
+    __u32 nbufs;
+    __u32 size;
+};
+
+// Argument to FLIP. Queues a flip behind the caller's DMA buffers submitted
+// so far: once the card has run them, it shows the surface they drew into
+// and draws into the next one, and the caller's later buffers wait for that.
+// Up to nbufs - 1 flips can be outstanding before FLIP waits for the oldest,
+// or fails with EAGAIN under O_NONBLOCK. The driver fills in the flip's
+// sequence number and the surface drawing goes to after it. Only DMA buffers
+// are held back; FIFO_QUEUE, LIST_REPLAY and BO_SUBMIT go ahead of a flip
+// still waiting for them, so wait for the flip first where it matters.
+struct kyouko3_flip
+{
+    __u64 seq;
+    __u32 back;
+    __u32 pad;
+};
+
+// Argument to FLIP_WAIT. Waits for the card to run flip seq. A timeout of 0
+// just polls.
+struct kyouko3_flip_wait
+{
+    __u64 seq;
+    __u32 timeout_ms;
+    __u32 pad;
+};
+
+// Argument to BLIT. Works on the width x height pixel rectangle at (x, y)
+// of the surface at device RAM byte offset `offset`, whose rows are `pitch`
+// bytes apart (0 for the current mode's). K3_BLIT_UPLOAD copies it from the
+// user buffer `data`, K3_BLIT_READ copies it into `data`, and K3_BLIT_FILL
+// sets it to `color`. Rows of data are data_pitch bytes apart (0 for
+// width * 4).
+//
+// BLIT is a synchronous convenience path, not a fast one. Every op first
+// waits for the card to get through everything in the FIFO, every client's
+// entries included, then the driver moves the pixels with the CPU through the
+// framebuffer mapping, and returns once they are all there. DMA buffers the
+// driver has not dispatched yet are not ordered against uploads and fills;
+// wait on their fence first where it matters. A read also waits for the
+// caller's DMA buffers. To read pixels back without stalling, use CAPTURE.
+struct kyouko3_blit
+{
+    __u64 data;
+    __u32 op;
+    __u32 offset;
+    __u32 pitch;
+    __u32 data_pitch;
+    __u32 x;
+    __u32 y;
+    __u32 width;
+    __u32 height;
+    __u32 color;
+    __u32 pad;
+};
+
+#define K3_BLIT_UPLOAD 1
+#define K3_BLIT_READ 2
+#define K3_BLIT_FILL 3
+
+// Argument to SETUP_CAPTURE. size asks for a capture buffer of that many
+// bytes, rounded up to whole pages (0 frees it). The driver maps it read-only
+// into the caller and fills in its address. The old buffer cannot go, and
+// EBUSY is returned, while the client maps it through a mapping of its own.
+struct kyouko3_capture_setup
+{
+    __u32 size;
+    __u32 pad;
+    __u64 u_base;
+};
+
+// Argument to CAPTURE. Copies the rectangle, described as for BLIT with data
+// and op ignored, into the capture buffer at byte offset buf_offset, rows
+// data_pitch bytes apart. The call returns at once with the capture's
+// sequence number. The driver copies the pixels out through the framebuffer
+// mapping once the card has got through everything queued in the FIFO before
+// the capture; CAPTURE_WAIT tells when they are there, and fails with
+// ETIMEDOUT if the FIFO stalled first. Like a BLIT upload, a capture is not
+// ordered against DMA buffers the driver has not dispatched yet.
+struct kyouko3_capture
+{
+    struct kyouko3_blit rect;
+    __u32 buf_offset;
+    __u32 pad;
+    __u64 seq;
+};
+
+// Argument to CAPTURE_WAIT. A timeout of 0 just polls. Only the outcomes of
+// the last K3_CAPTURE_DEPTH captures are kept; waiting on an older one fails
+// with ESTALE.
+struct kyouko3_capture_wait
+{
+    __u64 seq;
+    __u32 timeout_ms;
+    __u32 pad;
+};
+
+// Argument to VRAM_ALLOC. Asks for size bytes of device RAM at a multiple of
+// align (a power of two, 0 for K3_VRAM_ALIGN). The driver fills in a handle
+// for VRAM_FREE and the block's offset, which is what BLIT, CAPTURE and
+// the framebuffer mapping take. Blocks belong to the file
+// that allocated them and are freed with it; the card must be done with a
+// block before it is freed.
+//
+// The scanout surface sits at the bottom of device RAM and blocks are handed
+// out from the top down. VMODE fails with ENOSPC if blocks have grown down
+// into the room it needs.
+struct kyouko3_vram_alloc
+{
+    __u32 size;
+    __u32 align;
+    __u32 handle;
+    __u32 offset;
+};
+
+// Filled in by VRAM_STATS, in bytes. allocs also counts the driver's own
+// surfaces.
+struct kyouko3_vram_stats
+{
+    __u32 total;
+    __u32 used;
+    __u32 peak;
+    __u32 largest_free;
+    __u32 allocs;
+    __u32 pad;
+};
+
+// Argument to LIST_CREATE. Records a display list the driver keeps until
+// LIST_DESTROY or close: count FIFO entries from the user array `entries`,
+// then size bytes of kyouko3_dma_hdr packets from `data`, either of which
+// may be empty. The entries must not write BUFA_ registers. The driver fills
+// in the handle LIST_REPLAY and LIST_DESTROY take.
+struct kyouko3_list
+{
+    __u64 entries;
+    __u64 data;
+    __u32 count;
+    __u32 size;
+    __u32 handle;
+    __u32 pad;
+};
+
+// Overwrites the 32-bit word at byte offset `offset` of a list's packets.
+struct kyouko3_list_patch
+{
+    __u32 offset;
+    __u32 value;
+};
+
+// Argument to LIST_REPLAY. Queues the list's entries, then its packets, for
+// the card to run in turn with the clients' DMA buffers, without waiting for
+// it. A list without packets has its entries go into the FIFO at once.
+// Packets run straight from the driver's copy; nothing is copied per replay.
+// FIFO_FLUSH waits for the caller's queued replays to reach the FIFO.
+//
+// The npatches patches at `patches` are applied first and stay applied for
+// later replays. A replay with patches waits for the card to finish the
+// list's previous replay before touching it.
+struct kyouko3_list_replay
+{
+    __u64 patches;
+    __u32 handle;
+    __u32 npatches;
+};
+
+// Argument to BO_CREATE. Creates a buffer object of at least size bytes of
+// DMA memory, owned by the file. The driver fills in its handle and the
+// offset to mmap() it at. Its memory lives until it has been destroyed and
+// the last mapping of it is gone.
+struct kyouko3_bo
+{
+    __u32 size;
+    __u32 handle;
+    __u64 offset;
+};
+
+// Argument to BO_SUBMIT. Queues count bytes of kyouko3_dma_hdr packets at
+// byte offset `offset` of buffer object `handle`, for the card to run in turn
+// with the clients' DMA buffers and display lists. Nothing is copied; the
+// card reads the buffer object itself, so it must not be written again until
+// BO_WAIT says the card is done with it. FIFO_FLUSH waits for the caller's
+// queued submissions to reach the FIFO.
+struct kyouko3_bo_submit
+{
+    __u32 handle;
+    __u32 offset;
+    __u32 count;
+    __u32 pad;
+};
+
+// Argument to BO_WAIT. Waits for the card to finish every submission of the
+// buffer object so far. A timeout of 0 just polls.
+struct kyouko3_bo_wait
+{
+    __u32 handle;
+    __u32 timeout_ms;
+};
+
 struct kyouko3_dma_hdr
 {
     __u32 stride:5;
@@ -29,14 +317,105 @@ struct kyouko3_dma_hdr
 
 #define FIFO_ENTRIES 1024
 
+// Default DMA ring geometry, used by BIND_DMA.
 #define DMA_BUFNUM 8
 #define DMA_BUFSIZE (124*1024)
 
+// Limits for BIND_DMA_GEOM. Buffer sizes are rounded up to whole pages.
+// Every buffer is physically contiguous, so large ones come from CMA where
+// the kernel has it.
+#define DMA_BUFNUM_MIN 2
+#define DMA_BUFNUM_MAX 64
+#define DMA_BUFSIZE_MIN 4096
+#define DMA_BUFSIZE_MAX (4*1024*1024)
+// Upper bound on the coherent memory a single client's ring may pin.
+#define DMA_RING_MAXSIZE (16*1024*1024)
+
+// Granularity of device RAM blocks, and the most blocks at once.
+#define K3_VRAM_ALIGN 256
+#define K3_VRAM_MAX 256
+
+// Display lists per client, and the most entries, packet bytes and patches
+// one may have.
+#define K3_LIST_MAX 32
+#define K3_LIST_MAXCOUNT (FIFO_ENTRIES - 3)
+#define K3_LIST_MAXSIZE (1024*1024)
+#define K3_LIST_MAXPATCHES 256
+
+// Buffer objects per client, and the largest one.
+#define K3_BO_MAX 32
+#define K3_BO_MAXSIZE (4*1024*1024)
+
+// Captures in flight per client before CAPTURE waits (or fails with EAGAIN
+// under O_NONBLOCK), and the largest capture buffer.
+#define K3_CAPTURE_DEPTH 8
+#define K3_CAPTURE_MAXSIZE (8*1024*1024)
+
+// Most surfaces SETUP_FLIP hands out.
+#define K3_FLIP_MAX 3
+
+// Shared submission and completion rings, see struct kyouko3_ring.
+#define K3_RING_SQ_ENTRIES 64
+#define K3_RING_CQ_ENTRIES 128
+// The driver has gone idle and only notices new entries after RING_ENTER.
+#define K3_RING_NEED_WAKEUP 0x1
+// The driver stopped at a bad entry; the ring is unusable until unbound.
+#define K3_RING_ERROR 0x2
+
+// A filled DMA buffer: its ring slot and the number of bytes in it.
+struct kyouko3_sqe
+{
+    __u32 buf;
+    __u32 count;
+};
+
+/*
+ * One page shared with the driver after SETUP_RING, replacing START_DMA and
+ * friends on that ring. Entry n of the submission queue is buffer slot
+ * (first + n) % nbufs and gets fence fence_base + n + 1; the slot may be
+ * filled once fence_done has reached the fence of its previous use.
+ * Userspace writes the entry, then publishes it by storing sq_tail with
+ * release semantics. The interrupt handler picks entries up as buffers
+ * retire and posts each retired fence to cq. Once the ring runs dry it sets
+ * K3_RING_NEED_WAKEUP, and the next submission must be followed by a
+ * RING_ENTER ioctl. Indices run freely and are masked by the entry counts.
+ * UNBIND_DMA unmaps the page, and fails with EBUSY while the client still
+ * maps it through a mapping of its own.
+ */
+struct kyouko3_ring
+{
+    // Written by the driver.
+    __u32 sq_head;
+    __u32 cq_tail;
+    __u32 flags;
+    // Completions dropped because cq was full; fence_done is still current.
+    __u32 cq_overflow;
+    __u64 fence_done;
+    __u64 pad0[5];
+    // Written by userspace, on a cache line of its own.
+    __u32 sq_tail;
+    __u32 cq_head;
+    __u64 pad1[7];
+    // Fixed at SETUP_RING.
+    __u32 nbufs;
+    __u32 bufsize;
+    __u32 first;
+    __u32 pad2;
+    __u64 fence_base;
+    __u64 bufs[DMA_BUFNUM_MAX];
+    struct kyouko3_sqe sq[K3_RING_SQ_ENTRIES];
+    __u64 cq[K3_RING_CQ_ENTRIES];
+};
+
 
 // Page offsets for mmap
 #define VM_PGOFF_CONTROL 0
 #define VM_PGOFF_FB 0x80000000
 #define VM_PGOFF_DMA 0x40000000
+#define VM_PGOFF_RING 0x20000000
+#define VM_PGOFF_CAPTURE 0x10000000
+// Buffer object n (from 0) is at VM_PGOFF_BO + n * K3_BO_MAXSIZE.
+#define VM_PGOFF_BO 0x08000000
 
 // IOCTL
 #define VMODE _IOW(0xcc,0,unsigned long)
@@ -45,6 +424,34 @@ struct kyouko3_dma_hdr
 #define BIND_DMA _IOW(0xcc, 1, unsigned long)
 #define UNBIND_DMA _IOW(0xcc, 5, unsigned long)
 #define START_DMA _IOWR(0xcc, 2, unsigned long)
+#define FIFO_QUEUE_BATCH _IOW(0xcc, 6, struct fifo_batch)
+#define START_DMA_FENCE _IOWR(0xcc, 7, struct kyouko3_dma_start)
+#define WAIT_FENCE _IOW(0xcc, 8, struct kyouko3_fence_wait)
+// 9 was SET_EVENTFD. The eventfd API is EXPORT_SYMBOL_GPL; put the device
+// fd itself in the poll or epoll set, it is readable once a fence completes.
+#define BIND_DMA_GEOM _IOWR(0xcc, 10, struct kyouko3_dma_bind)
+#define ACQUIRE_DMA _IOR(0xcc, 11, struct kyouko3_dma_ticket)
+#define SUBMIT_DMA _IOWR(0xcc, 12, struct kyouko3_dma_submit)
+#define SUBMIT_DMA_BATCH _IOW(0xcc, 13, struct kyouko3_dma_submit_batch)
+#define SETUP_RING _IOR(0xcc, 14, __u64)
+#define RING_ENTER _IO(0xcc, 15)
+#define SETUP_FLIP _IOWR(0xcc, 16, struct kyouko3_flip_setup)
+#define FLIP _IOR(0xcc, 17, struct kyouko3_flip)
+#define FLIP_WAIT _IOW(0xcc, 18, struct kyouko3_flip_wait)
+#define BLIT _IOW(0xcc, 19, struct kyouko3_blit)
+#define SETUP_CAPTURE _IOWR(0xcc, 20, struct kyouko3_capture_setup)
+#define CAPTURE _IOWR(0xcc, 21, struct kyouko3_capture)
+#define CAPTURE_WAIT _IOW(0xcc, 22, struct kyouko3_capture_wait)
+#define VRAM_ALLOC _IOWR(0xcc, 23, struct kyouko3_vram_alloc)
+#define VRAM_FREE _IOW(0xcc, 24, __u32)
+#define VRAM_STATS _IOR(0xcc, 25, struct kyouko3_vram_stats)
+#define LIST_CREATE _IOWR(0xcc, 26, struct kyouko3_list)
+#define LIST_REPLAY _IOW(0xcc, 27, struct kyouko3_list_replay)
+#define LIST_DESTROY _IOW(0xcc, 28, __u32)
+#define BO_CREATE _IOWR(0xcc, 29, struct kyouko3_bo)
+#define BO_DESTROY _IOW(0xcc, 30, __u32)
+#define BO_SUBMIT _IOW(0xcc, 31, struct kyouko3_bo_submit)
+#define BO_WAIT _IOW(0xcc, 32, struct kyouko3_bo_wait)
 
 #define GRAPHICS_OFF 0
 #define GRAPHICS_ON 1
@@ -86,3 +493,5 @@ struct kyouko3_dma_hdr
 
 #define BUFA_ADDR 0x2000
 #define BUFA_CONF 0x2008
+
+#endif
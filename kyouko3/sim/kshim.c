@@ -0,0 +1,1262 @@
+/*
+ * The kernel side of the simulator: the out-of-line half of kshim/kshim.h,
+ * and the bits of VFS and mm that stand between a client and kyouko3.c.
+ *
+ * The driver is loaded on the first open() of the device: the model is
+ * created, module_init runs and probes it as a PCI device, and every open
+ * after that gets a struct file on the driver's file operations. Mappings
+ * are backed by the model's memfd, so a driver mmap of a BAR or of DMA
+ * memory aliases the memory the card sees, as it would on hardware. As in
+ * the kernel, each mapping holds a reference on its file, so release only
+ * runs once the last one is gone; mappings left at exit are torn down by a
+ * destructor, followed by module_exit.
+ */
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kshim/kshim.h"
+#include "ksim.h"
+#include "ksim_drv.h"
+
+// Device fds, so that the libc interposers can tell them apart quickly.
+#define KDRV_MAX_FD 1024
+#define KSHIM_IRQ 11
+#define KSHIM_MAX_PROC_ENTRIES 8
+
+static struct ksim *card;
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool load_failed;
+
+// printk, time and parameters.
+
+void kshim_printk(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fputs("kyouko3: ", stderr);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+u64 kshim_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void ktime_get_raw_ts64(struct timespec64 *ts)
+{
+	struct timespec raw;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &raw);
+	ts->tv_sec = raw.tv_sec;
+	ts->tv_nsec = raw.tv_nsec;
+}
+
+unsigned long kshim_jiffies(void)
+{
+	return kshim_ns() / NSEC_PER_MSEC;
+}
+
+void udelay(unsigned long us)
+{
+	u64 end = kshim_ns() + us * NSEC_PER_USEC;
+
+	while (kshim_ns() < end) {
+		cpu_relax();
+	}
+}
+
+void msleep(unsigned int ms)
+{
+	usleep(ms * 1000);
+}
+
+void usleep_range(unsigned long min, unsigned long max)
+{
+	usleep(min);
+}
+
+// Wait queues: one event counter for all of them.
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long seq;
+} wq = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+__attribute__((constructor)) static void kshim_wait_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wq.cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+unsigned long kshim_wait_begin(void)
+{
+	return __atomic_load_n(&wq.seq, __ATOMIC_ACQUIRE);
+}
+
+void kshim_wait_sleep(unsigned long seq, u64 deadline_ns)
+{
+	struct timespec ts = {.tv_sec = deadline_ns / NSEC_PER_SEC,
+			      .tv_nsec = deadline_ns % NSEC_PER_SEC};
+
+	pthread_mutex_lock(&wq.lock);
+	while (wq.seq == seq) {
+		if (!deadline_ns) {
+			pthread_cond_wait(&wq.cond, &wq.lock);
+		} else if (pthread_cond_timedwait(&wq.cond, &wq.lock, &ts)) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&wq.lock);
+}
+
+void kshim_wake_up(void)
+{
+	pthread_mutex_lock(&wq.lock);
+	__atomic_add_fetch(&wq.seq, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&wq.cond);
+	pthread_mutex_unlock(&wq.lock);
+}
+
+// Memory. DMA memory and pages come out of the model's DMA window.
+
+void *memdup_user(const void __user *src, size_t len)
+{
+	void *p = malloc(len ? len : 1);
+
+	if (!p) {
+		return ERR_PTR(-ENOMEM);
+	}
+	memcpy(p, src, len);
+	return p;
+}
+
+unsigned long get_zeroed_page(gfp_t flags)
+{
+	u32 bus;
+
+	return (unsigned long)ksim_dma_alloc(card, PAGE_SIZE, &bus);
+}
+
+void free_page(unsigned long addr)
+{
+	if (addr) {
+		ksim_dma_free(card, (void *)addr);
+	}
+}
+
+phys_addr_t virt_to_phys(const volatile void *addr)
+{
+	return ksim_virt_to_phys(card, (const void *)addr);
+}
+
+void *pci_alloc_consistent(struct pci_dev *dev, size_t size,
+			   dma_addr_t *handle)
+{
+	u32 bus;
+	void *p = ksim_dma_alloc(card, size, &bus);
+
+	*handle = bus;
+	return p;
+}
+
+void pci_free_consistent(struct pci_dev *dev, size_t size, void *vaddr,
+			 dma_addr_t handle)
+{
+	if (vaddr) {
+		ksim_dma_free(card, vaddr);
+	}
+}
+
+// I/O memory.
+
+void __iomem *ioremap(phys_addr_t phys, size_t size)
+{
+	return ksim_phys_to_virt(card, phys, size);
+}
+
+void __iomem *ioremap_wc(phys_addr_t phys, size_t size)
+{
+	return ioremap(phys, size);
+}
+
+void iounmap(volatile void __iomem *addr)
+{
+}
+
+// Offset of addr into the register file, or -1 if it is anywhere else.
+static long reg_offset(const volatile void *addr)
+{
+	phys_addr_t phys = ksim_virt_to_phys(card, (const void *)addr);
+
+	if (phys >= KSIM_CONTROL_PHYS &&
+	    phys < KSIM_CONTROL_PHYS + KYOUKO_CONTROL_SIZE) {
+		return phys - KSIM_CONTROL_PHYS;
+	}
+	return -1;
+}
+
+unsigned int ioread32(const volatile void __iomem *addr)
+{
+	long reg = reg_offset(addr);
+
+	return reg < 0 ? *(const volatile u32 *)addr
+		       : ksim_read_reg(card, reg);
+}
+
+void iowrite32(u32 value, volatile void __iomem *addr)
+{
+	long reg = reg_offset(addr);
+
+	if (reg < 0) {
+		*(volatile u32 *)addr = value;
+	} else {
+		ksim_write_reg(card, reg, value);
+	}
+}
+
+/*
+ * Interrupts. The card thread only flags the line; the handlers run on the
+ * interrupt thread, top half then threaded half, and the line is not looked
+ * at again until both have returned. irq.run is held while they do, so
+ * free_irq() can wait them out.
+ */
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_mutex_t run;
+	pthread_t thread;
+	bool pending;
+	bool stop;
+	irq_handler_t handler;
+	irq_handler_t thread_fn;
+	void *dev;
+} irq = {.lock = PTHREAD_MUTEX_INITIALIZER,
+	 .cond = PTHREAD_COND_INITIALIZER,
+	 .run = PTHREAD_MUTEX_INITIALIZER};
+
+static void irq_raise(void *arg)
+{
+	pthread_mutex_lock(&irq.lock);
+	irq.pending = true;
+	pthread_cond_signal(&irq.cond);
+	pthread_mutex_unlock(&irq.lock);
+}
+
+static void *irq_thread(void *arg)
+{
+	pthread_mutex_lock(&irq.lock);
+	for (;;) {
+		while (!irq.pending && !irq.stop) {
+			pthread_cond_wait(&irq.cond, &irq.lock);
+		}
+		if (irq.stop) {
+			break;
+		}
+		irq.pending = false;
+		pthread_mutex_unlock(&irq.lock);
+
+		pthread_mutex_lock(&irq.run);
+		if (irq.handler &&
+		    irq.handler(KSHIM_IRQ, irq.dev) == IRQ_WAKE_THREAD &&
+		    irq.thread_fn) {
+			irq.thread_fn(KSHIM_IRQ, irq.dev);
+		}
+		pthread_mutex_unlock(&irq.run);
+		pthread_mutex_lock(&irq.lock);
+	}
+	pthread_mutex_unlock(&irq.lock);
+	return NULL;
+}
+
+int request_threaded_irq(unsigned int nr, irq_handler_t handler,
+			 irq_handler_t thread_fn, unsigned long flags,
+			 const char *name, void *dev)
+{
+	int ret = 0;
+
+	if (nr != KSHIM_IRQ) {
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&irq.run);
+	if (irq.handler) {
+		ret = -EBUSY;
+	} else {
+		irq.thread_fn = thread_fn;
+		irq.dev = dev;
+		irq.handler = handler;
+	}
+	pthread_mutex_unlock(&irq.run);
+	return ret;
+}
+
+void free_irq(unsigned int nr, void *dev_id)
+{
+	pthread_mutex_lock(&irq.run);
+	if (irq.dev == dev_id) {
+		irq.handler = NULL;
+		irq.thread_fn = NULL;
+		irq.dev = NULL;
+	}
+	pthread_mutex_unlock(&irq.run);
+}
+
+// Workqueue.
+
+static struct {
+	pthread_mutex_t lock;
+	// Signalled when work is queued and whenever an item finishes.
+	pthread_cond_t cond;
+	struct work_struct *queue;
+	struct delayed_work *timers;
+	struct work_struct *running;
+	pthread_t thread;
+	bool started;
+	bool stop;
+} wkq = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void wkq_cond_init(void)
+{
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wkq.cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+// Must be called with wkq.lock held.
+static void wkq_append(struct work_struct *work)
+{
+	struct work_struct **pp = &wkq.queue;
+
+	while (*pp) {
+		pp = &(*pp)->kshim_next;
+	}
+	work->kshim_next = NULL;
+	*pp = work;
+}
+
+// Move due delayed work onto the queue. Returns the next due time, or 0.
+// Must be called with wkq.lock held.
+static u64 wkq_timers(void)
+{
+	struct delayed_work **pp = &wkq.timers, *dw;
+	u64 now = kshim_ns(), next = 0;
+
+	while ((dw = *pp)) {
+		if (dw->kshim_due_ns <= now) {
+			*pp = dw->kshim_next;
+			wkq_append(&dw->work);
+		} else {
+			if (!next || dw->kshim_due_ns < next) {
+				next = dw->kshim_due_ns;
+			}
+			pp = &dw->kshim_next;
+		}
+	}
+	return next;
+}
+
+static void *wkq_thread(void *arg)
+{
+	pthread_mutex_lock(&wkq.lock);
+	while (!wkq.stop) {
+		u64 next = wkq_timers();
+		struct work_struct *work = wkq.queue;
+
+		if (!work) {
+			struct timespec ts = {.tv_sec = next / NSEC_PER_SEC,
+					      .tv_nsec = next % NSEC_PER_SEC};
+
+			if (next) {
+				pthread_cond_timedwait(&wkq.cond, &wkq.lock,
+						       &ts);
+			} else {
+				pthread_cond_wait(&wkq.cond, &wkq.lock);
+			}
+			continue;
+		}
+		wkq.queue = work->kshim_next;
+		work->pending = false;
+		wkq.running = work;
+		pthread_mutex_unlock(&wkq.lock);
+		work->func(work);
+		pthread_mutex_lock(&wkq.lock);
+		wkq.running = NULL;
+		pthread_cond_broadcast(&wkq.cond);
+	}
+	pthread_mutex_unlock(&wkq.lock);
+	return NULL;
+}
+
+// Must be called with wkq.lock held.
+static void wkq_start(void)
+{
+	if (!wkq.started) {
+		wkq.started = true;
+		wkq_cond_init();
+		pthread_create(&wkq.thread, NULL, wkq_thread, NULL);
+	}
+}
+
+bool schedule_work(struct work_struct *work)
+{
+	bool queued = false;
+
+	pthread_mutex_lock(&wkq.lock);
+	wkq_start();
+	if (!work->pending) {
+		work->pending = queued = true;
+		wkq_append(work);
+		pthread_cond_broadcast(&wkq.cond);
+	}
+	pthread_mutex_unlock(&wkq.lock);
+	return queued;
+}
+
+bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay)
+{
+	bool queued = false;
+
+	pthread_mutex_lock(&wkq.lock);
+	wkq_start();
+	if (!dwork->work.pending) {
+		dwork->work.pending = queued = true;
+		dwork->kshim_due_ns = kshim_ns() + delay * NSEC_PER_MSEC;
+		dwork->kshim_next = wkq.timers;
+		wkq.timers = dwork;
+		pthread_cond_broadcast(&wkq.cond);
+	}
+	pthread_mutex_unlock(&wkq.lock);
+	return queued;
+}
+
+// Must be called with wkq.lock held.
+static void wkq_wait_idle(struct work_struct *work)
+{
+	while (wkq.running == work) {
+		pthread_cond_wait(&wkq.cond, &wkq.lock);
+	}
+}
+
+// Must be called with wkq.lock held.
+static bool wkq_flush(struct work_struct *work)
+{
+	bool waited;
+
+	waited = work->pending || wkq.running == work;
+	while (work->pending) {
+		pthread_cond_wait(&wkq.cond, &wkq.lock);
+	}
+	wkq_wait_idle(work);
+	return waited;
+}
+
+// Queues the work at once if it is still waiting for its delay, as the
+// kernel's does, then waits for it.
+bool flush_delayed_work(struct delayed_work *dwork)
+{
+	struct delayed_work **pp;
+	bool waited;
+
+	pthread_mutex_lock(&wkq.lock);
+	for (pp = &wkq.timers; *pp; pp = &(*pp)->kshim_next) {
+		if (*pp == dwork) {
+			*pp = dwork->kshim_next;
+			wkq_append(&dwork->work);
+			pthread_cond_broadcast(&wkq.cond);
+			break;
+		}
+	}
+	waited = wkq_flush(&dwork->work);
+	pthread_mutex_unlock(&wkq.lock);
+	return waited;
+}
+
+// Must be called with wkq.lock held.
+static bool wkq_dequeue(struct work_struct *work)
+{
+	struct work_struct **pp;
+
+	for (pp = &wkq.queue; *pp; pp = &(*pp)->kshim_next) {
+		if (*pp == work) {
+			*pp = work->kshim_next;
+			work->pending = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool cancel_delayed_work_sync(struct delayed_work *dwork)
+{
+	struct delayed_work **pp;
+	bool pending;
+
+	pthread_mutex_lock(&wkq.lock);
+	pending = wkq_dequeue(&dwork->work);
+	for (pp = &wkq.timers; *pp; pp = &(*pp)->kshim_next) {
+		if (*pp == dwork) {
+			*pp = dwork->kshim_next;
+			dwork->work.pending = false;
+			pending = true;
+			break;
+		}
+	}
+	wkq_wait_idle(&dwork->work);
+	pthread_mutex_unlock(&wkq.lock);
+	return pending;
+}
+
+// seq_file, single_open() flavour only.
+
+void seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(m->buf + m->count, m->size - m->count, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			return;
+		}
+		if (m->count + n < m->size) {
+			m->count += n;
+			return;
+		}
+		m->size = 2 * (m->count + n + 1);
+		m->buf = realloc(m->buf, m->size);
+	}
+}
+
+void seq_puts(struct seq_file *m, const char *s)
+{
+	seq_printf(m, "%s", s);
+}
+
+void seq_putc(struct seq_file *m, char c)
+{
+	seq_printf(m, "%c", c);
+}
+
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data)
+{
+	struct seq_file *m = calloc(1, sizeof(*m));
+
+	if (!m) {
+		return -ENOMEM;
+	}
+	m->show = show;
+	m->private = data;
+	file->private_data = m;
+	return 0;
+}
+
+int single_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+
+	free(m->buf);
+	free(m);
+	return 0;
+}
+
+ssize_t seq_read(struct file *file, char __user *buf, size_t size,
+		 loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	size_t n;
+	int ret;
+
+	if (*ppos == 0) {
+		m->count = 0;
+		ret = m->show(m, NULL);
+		if (ret) {
+			return ret;
+		}
+	}
+	if ((size_t)*ppos >= m->count) {
+		return 0;
+	}
+	n = min(size, m->count - (size_t)*ppos);
+	memcpy(buf, m->buf + *ppos, n);
+	*ppos += n;
+	return n;
+}
+
+loff_t seq_lseek(struct file *file, loff_t offset, int whence)
+{
+	if (whence != SEEK_SET || offset < 0) {
+		return -EINVAL;
+	}
+	file->f_pos = offset;
+	return offset;
+}
+
+// procfs: a flat table, only read back at the last release.
+
+struct proc_dir_entry {
+	const char *name;
+	struct proc_dir_entry *parent;
+	const struct proc_ops *ops;
+};
+
+static struct proc_dir_entry proc_entries[KSHIM_MAX_PROC_ENTRIES];
+
+static struct proc_dir_entry *proc_entry_new(const char *name,
+					     struct proc_dir_entry *parent,
+					     const struct proc_ops *ops)
+{
+	int i;
+
+	for (i = 0; i < KSHIM_MAX_PROC_ENTRIES; i++) {
+		if (!proc_entries[i].name) {
+			proc_entries[i] =
+			    (struct proc_dir_entry){name, parent, ops};
+			return &proc_entries[i];
+		}
+	}
+	return NULL;
+}
+
+struct proc_dir_entry *proc_mkdir(const char *name,
+				  struct proc_dir_entry *parent)
+{
+	return proc_entry_new(name, parent, NULL);
+}
+
+struct proc_dir_entry *proc_create(const char *name, unsigned short mode,
+				   struct proc_dir_entry *parent,
+				   const struct proc_ops *proc_ops)
+{
+	return proc_entry_new(name, parent, proc_ops);
+}
+
+void proc_remove(struct proc_dir_entry *de)
+{
+	int i;
+
+	if (!de) {
+		return;
+	}
+	for (i = 0; i < KSHIM_MAX_PROC_ENTRIES; i++) {
+		if (proc_entries[i].parent == de) {
+			proc_remove(&proc_entries[i]);
+		}
+	}
+	memset(de, 0, sizeof(*de));
+}
+
+// Print every procfs file, the way cat would show it.
+static void proc_print(FILE *f)
+{
+	char buf[4096];
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < KSHIM_MAX_PROC_ENTRIES; i++) {
+		struct proc_dir_entry *e = &proc_entries[i];
+		struct file file = {0};
+		struct inode inode = {0};
+		loff_t pos = 0;
+
+		if (!e->ops || e->ops->proc_open(&inode, &file)) {
+			continue;
+		}
+		fprintf(f, "kyouko3: /proc/%s/%s\n",
+			e->parent ? e->parent->name : "", e->name);
+		while ((n = e->ops->proc_read(&file, buf, sizeof(buf), &pos)) >
+		       0) {
+			fwrite(buf, 1, n, f);
+		}
+		e->ops->proc_release(&inode, &file);
+	}
+}
+
+// Character device and PCI bus.
+
+static const struct file_operations *chrdev_fops;
+
+void cdev_init(struct cdev *cdev, const struct file_operations *fops)
+{
+	cdev->ops = fops;
+}
+
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count)
+{
+	cdev->dev = dev;
+	chrdev_fops = cdev->ops;
+	return 0;
+}
+
+void cdev_del(struct cdev *cdev)
+{
+	chrdev_fops = NULL;
+}
+
+static struct pci_dev pdev;
+static struct pci_driver *pci_drv;
+
+int pci_register_driver(struct pci_driver *drv)
+{
+	const struct pci_device_id *id;
+	int ret;
+
+	for (id = drv->id_table; id->vendor; id++) {
+		if (id->vendor == pdev.vendor && id->device == pdev.device) {
+			ret = drv->probe(&pdev, id);
+			if (ret) {
+				return ret;
+			}
+			pci_drv = drv;
+			break;
+		}
+	}
+	return 0;
+}
+
+void pci_unregister_driver(struct pci_driver *drv)
+{
+	if (pci_drv == drv) {
+		drv->remove(&pdev);
+		pci_drv = NULL;
+	}
+}
+
+/*
+ * Files and mappings. A vma is a PROT_NONE reservation whose pages are then
+ * replaced, segment by segment, with views of the model's memfd.
+ */
+
+struct kshim_seg {
+	unsigned long addr;
+	unsigned long len;
+	off_t off;
+	int prot;
+	struct kshim_seg *next;
+};
+
+static struct file *files[KDRV_MAX_FD];
+static int nfiles;
+static struct mm_struct kshim_mm;
+struct task_struct kshim_current = {.mm = &kshim_mm};
+static struct vm_area_struct *vmas;
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inode chrdev_inode;
+
+// A run of pages vmf_insert_pfn() was given while faulting in a vma.
+static __thread struct {
+	struct vm_area_struct *vma;
+	unsigned long addr;
+	unsigned long len;
+	phys_addr_t phys;
+} fault_run;
+
+// The libc wrappers would lead back into ksim_preload.c.
+static void *sys_mmap(unsigned long addr, size_t len, int prot, int flags,
+		      int fd, off_t off)
+{
+	return (void *)syscall(SYS_mmap, addr, len, prot, flags, fd, off);
+}
+
+static int sys_munmap(unsigned long addr, size_t len)
+{
+	return syscall(SYS_munmap, addr, len);
+}
+
+static int map_phys(struct vm_area_struct *vma, unsigned long addr,
+		    phys_addr_t phys, unsigned long len)
+{
+	int64_t off = ksim_phys_offset(card, phys, len);
+	int prot = vma->vm_page_prot.pgprot;
+	struct kshim_seg *seg;
+
+	if (off < 0 || addr < vma->vm_start || addr + len > vma->vm_end ||
+	    (addr | phys | len) & ~PAGE_MASK) {
+		return -EINVAL;
+	}
+	seg = malloc(sizeof(*seg));
+	if (!seg) {
+		return -ENOMEM;
+	}
+	if (sys_mmap(addr, len, prot, MAP_SHARED | MAP_FIXED,
+		     ksim_memfd(card), off) == MAP_FAILED) {
+		free(seg);
+		return -ENOMEM;
+	}
+	*seg = (struct kshim_seg){addr, len, off, prot, vma->kshim_segs};
+	vma->kshim_segs = seg;
+	return 0;
+}
+
+int vm_iomap_memory(struct vm_area_struct *vma, phys_addr_t start,
+		    unsigned long len)
+{
+	unsigned long vm_len = vma->vm_end - vma->vm_start;
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+
+	if (off > len || vm_len > len - off) {
+		return -EINVAL;
+	}
+	return map_phys(vma, vma->vm_start, start + off, vm_len);
+}
+
+int remap_pfn_range(struct vm_area_struct *vma, unsigned long addr,
+		    unsigned long pfn, unsigned long size, pgprot_t prot)
+{
+	return map_phys(vma, addr, (phys_addr_t)pfn << PAGE_SHIFT, size);
+}
+
+static int fault_flush(void)
+{
+	int ret = 0;
+
+	if (fault_run.len) {
+		ret = map_phys(fault_run.vma, fault_run.addr, fault_run.phys,
+			       fault_run.len);
+		fault_run.len = 0;
+	}
+	return ret;
+}
+
+vm_fault_t vmf_insert_pfn(struct vm_area_struct *vma, unsigned long addr,
+			  unsigned long pfn)
+{
+	phys_addr_t phys = (phys_addr_t)pfn << PAGE_SHIFT;
+
+	if (fault_run.len && fault_run.vma == vma &&
+	    fault_run.addr + fault_run.len == addr &&
+	    fault_run.phys + fault_run.len == phys) {
+		fault_run.len += PAGE_SIZE;
+		return VM_FAULT_NOPAGE;
+	}
+	if (fault_flush()) {
+		return VM_FAULT_SIGBUS;
+	}
+	fault_run.vma = vma;
+	fault_run.addr = addr;
+	fault_run.phys = phys;
+	fault_run.len = PAGE_SIZE;
+	return VM_FAULT_NOPAGE;
+}
+
+// Fault in every page of the vma. Pages that fail stay inaccessible.
+static void vma_prefault(struct vm_area_struct *vma)
+{
+	unsigned long addr;
+
+	for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+		struct vm_fault vmf = {
+		    .vma = vma,
+		    .address = addr,
+		    .pgoff = vma->vm_pgoff +
+			     ((addr - vma->vm_start) >> PAGE_SHIFT)};
+
+		vma->vm_ops->fault(&vmf);
+	}
+	fault_flush();
+}
+
+static void vma_free(struct vm_area_struct *vma)
+{
+	struct kshim_seg *seg, *next;
+
+	sys_munmap(vma->vm_start, vma->vm_end - vma->vm_start);
+	for (seg = vma->kshim_segs; seg; seg = next) {
+		next = seg->next;
+		free(seg);
+	}
+	free(vma);
+}
+
+static void fput(struct file *file)
+{
+	if (__atomic_sub_fetch(&file->kshim_refs, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	file->f_op->release(file->f_inode, file);
+	free(file);
+	if (__atomic_sub_fetch(&nfiles, 1, __ATOMIC_ACQ_REL) == 0) {
+		const char *dump = getenv("KSIM_DUMP");
+
+		if (dump) {
+			ksim_dump_ppm(card, dump);
+		}
+		if (!getenv("KSIM_QUIET")) {
+			proc_print(stderr);
+			ksim_print_stats(card, stderr);
+		}
+	}
+}
+
+static unsigned long do_mmap(struct file *file, unsigned long len,
+			     unsigned long prot, unsigned long flags,
+			     unsigned long off)
+{
+	struct vm_area_struct *vma;
+	void *base;
+	int ret;
+
+	len = PAGE_ALIGN(len);
+	if (!len || off & ~PAGE_MASK) {
+		return -EINVAL;
+	}
+	vma = calloc(1, sizeof(*vma));
+	if (!vma) {
+		return -ENOMEM;
+	}
+	base = sys_mmap(0, len, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		free(vma);
+		return -ENOMEM;
+	}
+	vma->vm_mm = current->mm;
+	vma->vm_start = (unsigned long)base;
+	vma->vm_end = vma->vm_start + len;
+	vma->vm_pgoff = off >> PAGE_SHIFT;
+	vma->vm_page_prot.pgprot = prot;
+	vma->vm_file = file;
+
+	ret = file->f_op->mmap(file, vma);
+	if (ret) {
+		vma_free(vma);
+		return ret;
+	}
+	if (vma->vm_ops && vma->vm_ops->fault) {
+		vma_prefault(vma);
+	}
+	__atomic_add_fetch(&file->kshim_refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&mm_lock);
+	vma->kshim_next = vmas;
+	vmas = vma;
+	pthread_mutex_unlock(&mm_lock);
+	return vma->vm_start;
+}
+
+unsigned long vm_mmap(struct file *file, unsigned long addr, unsigned long len,
+		      unsigned long prot, unsigned long flag,
+		      unsigned long offset)
+{
+	return do_mmap(file, len, prot, flag, offset);
+}
+
+// Only whole vmas can be unmapped.
+int vm_munmap(unsigned long start, size_t len)
+{
+	struct vm_area_struct *vma, **pp, *gone = NULL;
+	unsigned long end = start + PAGE_ALIGN(len);
+
+	pthread_mutex_lock(&mm_lock);
+	for (pp = &vmas; (vma = *pp);) {
+		if (vma->vm_start >= start && vma->vm_end <= end) {
+			*pp = vma->kshim_next;
+			vma->kshim_next = gone;
+			gone = vma;
+		} else if (vma->vm_start < end && vma->vm_end > start) {
+			pthread_mutex_unlock(&mm_lock);
+			return -EINVAL;
+		} else {
+			pp = &vma->kshim_next;
+		}
+	}
+	pthread_mutex_unlock(&mm_lock);
+
+	while ((vma = gone)) {
+		struct file *file = vma->vm_file;
+
+		gone = vma->kshim_next;
+		if (vma->vm_ops && vma->vm_ops->close) {
+			vma->vm_ops->close(vma);
+		}
+		vma_free(vma);
+		fput(file);
+	}
+	return 0;
+}
+
+// Loading the driver, process exit and fork().
+
+static void kshim_atfork_prepare(void);
+static void kshim_atfork_parent(void);
+static void kshim_atfork_child(void);
+
+static int kshim_load(void)
+{
+	unsigned int ram_mb = KSIM_RAM_MB;
+	const char *env = getenv("KSIM_RAM_MB");
+	int ret = 0;
+
+	pthread_mutex_lock(&load_lock);
+	if (card || load_failed) {
+		ret = card ? 0 : -ENODEV;
+		goto out;
+	}
+	if (env) {
+		ram_mb = strtoul(env, NULL, 0);
+	}
+	card = ksim_create(ram_mb);
+	if (!card) {
+		load_failed = true;
+		ret = -ENODEV;
+		goto out;
+	}
+	pdev.vendor = PCI_VENDOR_ID_CCORSI;
+	pdev.device = PCI_DEVICE_ID_CCORSI_KYOUKO3;
+	pdev.irq = KSHIM_IRQ;
+	pdev.resource[1].start = KSIM_CONTROL_PHYS;
+	pdev.resource[1].end = KSIM_CONTROL_PHYS + KYOUKO_CONTROL_SIZE - 1;
+	pdev.resource[2].start = KSIM_RAM_PHYS;
+	pdev.resource[2].end = KSIM_RAM_PHYS + ksim_ram_len(card) - 1;
+	pthread_create(&irq.thread, NULL, irq_thread, NULL);
+	ksim_set_isr(card, irq_raise, NULL);
+	pthread_atfork(kshim_atfork_prepare, kshim_atfork_parent,
+		       kshim_atfork_child);
+
+	ret = kshim_module_init();
+	if (ret || !chrdev_fops || !pci_drv) {
+		kshim_printk("module_init failed: %d\n", ret);
+		load_failed = true;
+		ret = -ENODEV;
+	}
+out:
+	pthread_mutex_unlock(&load_lock);
+	return ret;
+}
+
+/*
+ * What the kernel does at exit: mappings go first, then open files, which
+ * releases whatever is left. The module is unloaded after that.
+ */
+__attribute__((destructor)) static void kshim_unload(void)
+{
+	int fd;
+
+	if (!card) {
+		return;
+	}
+	while (vmas) {
+		vm_munmap(vmas->vm_start, vmas->vm_end - vmas->vm_start);
+	}
+	for (fd = 0; fd < KDRV_MAX_FD; fd++) {
+		if (files[fd]) {
+			kdrv_release(fd);
+		}
+	}
+	if (!load_failed) {
+		kshim_module_exit();
+	}
+
+	pthread_mutex_lock(&wkq.lock);
+	wkq.stop = true;
+	pthread_cond_broadcast(&wkq.cond);
+	pthread_mutex_unlock(&wkq.lock);
+	if (wkq.started) {
+		pthread_join(wkq.thread, NULL);
+	}
+
+	pthread_mutex_lock(&irq.lock);
+	irq.stop = true;
+	pthread_cond_signal(&irq.cond);
+	pthread_mutex_unlock(&irq.lock);
+	pthread_join(irq.thread, NULL);
+	ksim_destroy(card);
+	card = NULL;
+}
+
+/*
+ * The child of a fork() gets a copy of the card, the driver and every
+ * mapping of either, as if the whole machine had been forked with it. Locks
+ * the driver itself holds in another thread at the time stay held.
+ */
+static void kshim_atfork_prepare(void)
+{
+	// Handlers take the card's lock, and the card takes irq.lock.
+	pthread_mutex_lock(&irq.run);
+	ksim_fork_prepare(card);
+	pthread_mutex_lock(&irq.lock);
+	pthread_mutex_lock(&wkq.lock);
+	pthread_mutex_lock(&mm_lock);
+	pthread_mutex_lock(&wq.lock);
+}
+
+static void kshim_atfork_parent(void)
+{
+	pthread_mutex_unlock(&wq.lock);
+	pthread_mutex_unlock(&mm_lock);
+	pthread_mutex_unlock(&wkq.lock);
+	pthread_mutex_unlock(&irq.lock);
+	ksim_fork_parent(card);
+	pthread_mutex_unlock(&irq.run);
+}
+
+static void kshim_atfork_child(void)
+{
+	struct vm_area_struct *vma;
+	struct kshim_seg *seg;
+
+	if (ksim_fork_child(card)) {
+		abort();
+	}
+	for (vma = vmas; vma; vma = vma->kshim_next) {
+		for (seg = vma->kshim_segs; seg; seg = seg->next) {
+			if (sys_mmap(seg->addr, seg->len, seg->prot,
+				     MAP_SHARED | MAP_FIXED, ksim_memfd(card),
+				     seg->off) == MAP_FAILED) {
+				abort();
+			}
+		}
+	}
+	kshim_wait_init();
+	pthread_cond_init(&irq.cond, NULL);
+	pthread_mutex_unlock(&wq.lock);
+	pthread_mutex_unlock(&mm_lock);
+	// Work the parent had started is not run again.
+	if (wkq.started) {
+		wkq.running = NULL;
+		wkq_cond_init();
+		pthread_create(&wkq.thread, NULL, wkq_thread, NULL);
+	}
+	pthread_mutex_unlock(&wkq.lock);
+	pthread_mutex_unlock(&irq.lock);
+	pthread_mutex_unlock(&irq.run);
+	pthread_create(&irq.thread, NULL, irq_thread, NULL);
+}
+
+// Entry points for ksim_preload.c.
+
+static struct file *fget(int fd)
+{
+	struct file *file;
+
+	if (fd < 0 || fd >= KDRV_MAX_FD) {
+		return NULL;
+	}
+	file = __atomic_load_n(&files[fd], __ATOMIC_ACQUIRE);
+	if (file) {
+		// fcntl(F_SETFL) on the fd is how O_NONBLOCK gets here.
+		file->f_flags = fcntl(fd, F_GETFL);
+	}
+	return file;
+}
+
+int kdrv_open(int fd)
+{
+	struct file *file;
+	int ret;
+
+	if (fd >= KDRV_MAX_FD) {
+		return -EMFILE;
+	}
+	ret = kshim_load();
+	if (ret) {
+		return ret;
+	}
+	file = calloc(1, sizeof(*file));
+	if (!file) {
+		return -ENOMEM;
+	}
+	file->f_flags = fcntl(fd, F_GETFL);
+	file->f_op = chrdev_fops;
+	file->f_inode = &chrdev_inode;
+	file->kshim_refs = 1;
+	ret = file->f_op->open(file->f_inode, file);
+	if (ret) {
+		free(file);
+		return ret;
+	}
+	__atomic_add_fetch(&nfiles, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&files[fd], file, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int kdrv_is_dev(int fd)
+{
+	return fd >= 0 && fd < KDRV_MAX_FD &&
+	       __atomic_load_n(&files[fd], __ATOMIC_ACQUIRE);
+}
+
+int kdrv_release(int fd)
+{
+	struct file *file = fget(fd);
+
+	if (!file) {
+		return -EBADF;
+	}
+	__atomic_store_n(&files[fd], NULL, __ATOMIC_RELEASE);
+	fput(file);
+	return 0;
+}
+
+long kdrv_ioctl(int fd, unsigned long cmd, void *arg)
+{
+	struct file *file = fget(fd);
+
+	return file->f_op->unlocked_ioctl(file, cmd, (unsigned long)arg);
+}
+
+void *kdrv_mmap(int fd, size_t len, int prot, int flags, off_t off)
+{
+	unsigned long addr = do_mmap(fget(fd), len, prot, flags, off);
+
+	if (IS_ERR_VALUE(addr)) {
+		errno = -(long)addr;
+		return MAP_FAILED;
+	}
+	return (void *)addr;
+}
+
+int kdrv_owns(const void *addr, size_t len)
+{
+	unsigned long start = (unsigned long)addr, end = start + len;
+	struct vm_area_struct *vma;
+	int ret = 0;
+
+	pthread_mutex_lock(&mm_lock);
+	for (vma = vmas; vma && !ret; vma = vma->kshim_next) {
+		ret = vma->vm_start < end && vma->vm_end > start;
+	}
+	pthread_mutex_unlock(&mm_lock);
+	return ret;
+}
+
+int kdrv_munmap(void *addr, size_t len)
+{
+	return vm_munmap((unsigned long)addr, len);
+}
+
+ssize_t kdrv_read(int fd, void *buf, size_t len)
+{
+	struct file *file = fget(fd);
+
+	return file->f_op->read(file, buf, len, &file->f_pos);
+}
+
+short kdrv_poll(int fd, short events)
+{
+	struct file *file = fget(fd);
+
+	return file->f_op->poll(file, NULL) & (events | POLLERR | POLLHUP);
+}
+
+void kdrv_wait(int timeout_ms)
+{
+	kshim_wait_sleep(kshim_wait_begin(),
+			 kshim_ns() + (u64)timeout_ms * NSEC_PER_MSEC);
+}
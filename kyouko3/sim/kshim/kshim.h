@@ -0,0 +1,794 @@
+/*
+ * Just enough of the kernel API for kyouko3.c to build as part of libksim.so,
+ * on top of libc and the device model. Every <linux/...> and <asm/...>
+ * header the driver includes is a stub in this directory that pulls in this
+ * file; kshim.c has the out-of-line parts.
+ *
+ * The stand-ins keep the kernel's semantics where the driver depends on
+ * them (wait_event return values, threaded interrupts with a masked line,
+ * mmap offsets selecting BARs), and are otherwise as simple as possible:
+ * spinlocks are mutexes, every wait queue shares one event counter and
+ * copy_{to,from}_user are memcpy.
+ */
+#ifndef KSHIM_H
+#define KSHIM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+// Types and annotations.
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef long long s64;
+typedef u64 phys_addr_t;
+typedef u64 dma_addr_t;
+typedef unsigned int gfp_t;
+
+#define __user
+#define __iomem
+#define __init
+#define __exit
+#define __must_check __attribute__((warn_unused_result))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define U32_MAX ((u32)~0U)
+#define U64_MAX ((u64)~0ULL)
+
+#define ERESTARTSYS 512
+
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) ((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+
+static inline void *ERR_PTR(long error)
+{
+	return (void *)error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+	return (long)ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+	return IS_ERR_VALUE((unsigned long)ptr);
+}
+
+// Arithmetic helpers.
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define BUILD_BUG_ON(cond) _Static_assert(!(cond), #cond)
+#define container_of(ptr, type, member)                                        \
+	((type *)((char *)(ptr)-offsetof(type, member)))
+
+#define min(a, b)                                                              \
+	({                                                                     \
+		__typeof__(a) _min_a = (a);                                    \
+		__typeof__(b) _min_b = (b);                                    \
+		_min_a < _min_b ? _min_a : _min_b;                             \
+	})
+#define max(a, b)                                                              \
+	({                                                                     \
+		__typeof__(a) _max_a = (a);                                    \
+		__typeof__(b) _max_b = (b);                                    \
+		_max_a > _max_b ? _max_a : _max_b;                             \
+	})
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+#define clamp_t(type, v, lo, hi) min_t(type, max_t(type, v, lo), hi)
+#define DIV_ROUND_UP(n, d) (((n) + (d)-1) / (d))
+#define ALIGN(x, a) (((x) + (a)-1) & ~((__typeof__(x))(a)-1))
+
+// Index of the most significant set bit, counting from 1; 0 for 0.
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+#define PAGE_SHIFT 12
+#undef PAGE_SIZE
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+#define PAGE_ALIGN(x) ALIGN(x, PAGE_SIZE)
+
+// Memory ordering.
+
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_mb() mb()
+#define smp_rmb() rmb()
+#define smp_wmb() wmb()
+#define cpu_relax() barrier()
+
+// Logging. Everything goes to stderr, prefixed with the module name.
+
+void kshim_printk(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#define pr_err(fmt, ...) kshim_printk(fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) kshim_printk(fmt, ##__VA_ARGS__)
+#define pr_warn_ratelimited(fmt, ...) kshim_printk(fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...) kshim_printk(fmt, ##__VA_ARGS__)
+#define pr_debug(fmt, ...)                                                     \
+	do {                                                                   \
+		if (0) {                                                       \
+			kshim_printk(fmt, ##__VA_ARGS__);                      \
+		}                                                              \
+	} while (0)
+
+// Modules.
+
+struct module;
+#define THIS_MODULE ((struct module *)NULL)
+// The driver is proprietary, so insmod resolves only EXPORT_SYMBOL symbols
+// for it. Keep EXPORT_SYMBOL_GPL interfaces out of this file.
+#define MODULE_LICENSE(x)
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+
+extern int (*kshim_module_init)(void);
+extern void (*kshim_module_exit)(void);
+#define module_init(fn) int (*kshim_module_init)(void) = fn
+#define module_exit(fn) void (*kshim_module_exit)(void) = fn
+
+// Time. A jiffy is a millisecond.
+
+#define HZ 1000
+#define NSEC_PER_USEC 1000L
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_SEC 1000000000L
+
+unsigned long kshim_jiffies(void);
+#define jiffies kshim_jiffies()
+#define time_after(a, b) ((long)((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+#define time_after_eq(a, b) ((long)((a) - (b)) >= 0)
+
+static inline unsigned long msecs_to_jiffies(unsigned int ms)
+{
+	return ms;
+}
+
+static inline unsigned long usecs_to_jiffies(unsigned int us)
+{
+	return (us + 999) / 1000;
+}
+
+static inline unsigned int jiffies_to_usecs(unsigned long j)
+{
+	return j * 1000;
+}
+
+// The shim's own clock; the driver uses ktime_get_raw_ts64().
+u64 kshim_ns(void);
+
+struct timespec64 {
+	s64 tv_sec;
+	long tv_nsec;
+};
+
+void ktime_get_raw_ts64(struct timespec64 *ts);
+
+static inline s64 timespec64_to_ns(const struct timespec64 *ts)
+{
+	return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+void udelay(unsigned long us);
+void msleep(unsigned int ms);
+void usleep_range(unsigned long min, unsigned long max);
+
+// Locks.
+
+typedef struct {
+	pthread_mutex_t m;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(x) spinlock_t x = {PTHREAD_MUTEX_INITIALIZER}
+#define spin_lock_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define spin_lock(l) pthread_mutex_lock(&(l)->m)
+#define spin_unlock(l) pthread_mutex_unlock(&(l)->m)
+#define spin_lock_irq(l) spin_lock(l)
+#define spin_unlock_irq(l) spin_unlock(l)
+#define spin_lock_irqsave(l, flags)                                            \
+	do {                                                                   \
+		(flags) = 0;                                                   \
+		spin_lock(l);                                                  \
+	} while (0)
+#define spin_unlock_irqrestore(l, flags)                                       \
+	do {                                                                   \
+		(void)(flags);                                                 \
+		spin_unlock(l);                                                \
+	} while (0)
+
+struct mutex {
+	pthread_mutex_t m;
+};
+
+#define DEFINE_MUTEX(x) struct mutex x = {PTHREAD_MUTEX_INITIALIZER}
+#define mutex_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l) pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l) pthread_mutex_unlock(&(l)->m)
+#define mutex_trylock(l) (pthread_mutex_trylock(&(l)->m) == 0)
+
+struct kref {
+	int refcount;
+};
+
+static inline void kref_init(struct kref *kref)
+{
+	__atomic_store_n(&kref->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline void kref_get(struct kref *kref)
+{
+	__atomic_fetch_add(&kref->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline int kref_put(struct kref *kref,
+			   void (*release)(struct kref *kref))
+{
+	if (__atomic_sub_fetch(&kref->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		release(kref);
+		return 1;
+	}
+	return 0;
+}
+
+// Lists.
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) {&(name), &(name)}
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev,
+			      struct list_head *next)
+{
+	next->prev = new;
+	new->next = next;
+	new->prev = prev;
+	prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head)
+{
+	__list_add(new, head->prev, head);
+}
+
+static inline void __list_del_entry(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+}
+
+// As in the kernel, a deleted entry is poisoned until it is re-added.
+static inline void list_del(struct list_head *entry)
+{
+	__list_del_entry(entry);
+	entry->next = NULL;
+	entry->prev = NULL;
+}
+
+static inline void list_del_init(struct list_head *entry)
+{
+	__list_del_entry(entry);
+	INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move_tail(struct list_head *list,
+				  struct list_head *head)
+{
+	__list_del_entry(list);
+	list_add_tail(list, head);
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return READ_ONCE(head->next) == head;
+}
+
+static inline void list_splice_init(struct list_head *list,
+				    struct list_head *head)
+{
+	if (!list_empty(list)) {
+		list->next->prev = head;
+		list->prev->next = head->next;
+		head->next->prev = list->prev;
+		head->next = list->next;
+		INIT_LIST_HEAD(list);
+	}
+}
+
+static inline int list_is_last(const struct list_head *list,
+			       const struct list_head *head)
+{
+	return list->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member)                                    \
+	list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member)                                     \
+	list_entry((ptr)->prev, type, member)
+#define list_first_entry_or_null(ptr, type, member)                            \
+	(list_empty(ptr) ? NULL : list_first_entry(ptr, type, member))
+#define list_next_entry(pos, member)                                           \
+	list_entry((pos)->member.next, __typeof__(*(pos)), member)
+#define list_for_each_entry(pos, head, member)                                 \
+	for (pos = list_first_entry(head, __typeof__(*pos), member);           \
+	     &pos->member != (head); pos = list_next_entry(pos, member))
+#define list_for_each_entry_safe(pos, n, head, member)                         \
+	for (pos = list_first_entry(head, __typeof__(*pos), member),           \
+	    n = list_next_entry(pos, member);                                  \
+	     &pos->member != (head); pos = n, n = list_next_entry(n, member))
+
+/*
+ * Wait queues. Every queue shares one event counter: wake_up() on any of
+ * them bumps it, and a waiter re-checks its condition whenever it moves.
+ * Waits are never interrupted by signals.
+ */
+
+typedef struct {
+	int unused;
+} wait_queue_head_t;
+
+#define DECLARE_WAIT_QUEUE_HEAD(name) wait_queue_head_t name = {0}
+#define init_waitqueue_head(wq) ((void)(wq))
+
+unsigned long kshim_wait_begin(void);
+// Sleep until an event after seq, or until deadline_ns if it is non-zero.
+void kshim_wait_sleep(unsigned long seq, u64 deadline_ns);
+void kshim_wake_up(void);
+
+#define wake_up(wq) ((void)(wq), kshim_wake_up())
+#define wake_up_all(wq) wake_up(wq)
+#define wake_up_interruptible(wq) wake_up(wq)
+#define wake_up_interruptible_all(wq) wake_up(wq)
+
+// Wait for cond until deadline (0 for none); true if cond became true.
+#define __kshim_wait(cond, deadline)                                           \
+	({                                                                     \
+		u64 __end = (deadline);                                        \
+		bool __ok;                                                     \
+		for (;;) {                                                     \
+			unsigned long __seq = kshim_wait_begin();              \
+			if (cond) {                                            \
+				__ok = true;                                   \
+				break;                                         \
+			}                                                      \
+			if (__end && kshim_ns() >= __end) {                \
+				__ok = false;                                  \
+				break;                                         \
+			}                                                      \
+			kshim_wait_sleep(__seq, __end);                        \
+		}                                                              \
+		__ok;                                                          \
+	})
+
+// Remaining jiffies, at least 1, if cond came true, else 0.
+#define __kshim_wait_jiffies(cond, timeout)                                    \
+	({                                                                     \
+		u64 __to = (u64)(timeout)*NSEC_PER_MSEC;                       \
+		u64 __start = kshim_ns();                                  \
+		long __ret = 0;                                                \
+		if (__kshim_wait(cond, __start + __to)) {                      \
+			u64 __used = kshim_ns() - __start;                 \
+			__ret = __used >= __to                                 \
+				    ? 1                                        \
+				    : (long)DIV_ROUND_UP(__to - __used,        \
+							 NSEC_PER_MSEC);       \
+		}                                                              \
+		__ret;                                                         \
+	})
+
+#define wait_event(wq, cond) ((void)(wq), (void)__kshim_wait(cond, 0))
+#define wait_event_interruptible(wq, cond)                                     \
+	((void)(wq), (void)__kshim_wait(cond, 0), 0)
+#define wait_event_timeout(wq, cond, timeout)                                  \
+	((void)(wq), __kshim_wait_jiffies(cond, timeout))
+#define wait_event_interruptible_timeout(wq, cond, timeout)                    \
+	wait_event_timeout(wq, cond, timeout)
+
+/*
+ * Workqueues: one worker thread runs every work item, in order. Delayed work
+ * joins the queue once its delay has passed.
+ */
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+
+struct work_struct {
+	work_func_t func;
+	// Queued, or waiting for its delay, and not yet started.
+	bool pending;
+	struct work_struct *kshim_next;
+};
+
+struct delayed_work {
+	struct work_struct work;
+	u64 kshim_due_ns;
+	struct delayed_work *kshim_next;
+};
+
+#define INIT_WORK(w, f)                                                        \
+	do {                                                                   \
+		(w)->func = (f);                                               \
+		(w)->pending = false;                                          \
+		(w)->kshim_next = NULL;                                        \
+	} while (0)
+#define INIT_DELAYED_WORK(w, f)                                                \
+	do {                                                                   \
+		INIT_WORK(&(w)->work, f);                                      \
+		(w)->kshim_next = NULL;                                        \
+	} while (0)
+#define to_delayed_work(w) container_of(w, struct delayed_work, work)
+
+bool schedule_work(struct work_struct *work);
+bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay);
+bool flush_delayed_work(struct delayed_work *dwork);
+bool cancel_delayed_work_sync(struct delayed_work *dwork);
+
+// Memory.
+
+#define GFP_KERNEL 0U
+#define GFP_ATOMIC 1U
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, gfp_t flags)
+{
+	return calloc(n, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+// Pages come from the card's DMA window, so they can be mapped to users.
+unsigned long get_zeroed_page(gfp_t flags);
+void free_page(unsigned long addr);
+phys_addr_t virt_to_phys(const volatile void *addr);
+
+// User memory is the caller's own: copies cannot fault.
+
+static inline unsigned long copy_from_user(void *to, const void __user *from,
+					   unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline unsigned long copy_to_user(void __user *to, const void *from,
+					 unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+#define put_user(x, ptr) ({ *(ptr) = (x); 0; })
+#define get_user(x, ptr) ({ (x) = *(ptr); 0; })
+
+void *memdup_user(const void __user *src, size_t len);
+
+// I/O memory. Stores into the control BAR go to the card's register file.
+
+void __iomem *ioremap(phys_addr_t phys, size_t size);
+void __iomem *ioremap_wc(phys_addr_t phys, size_t size);
+void iounmap(volatile void __iomem *addr);
+unsigned int ioread32(const volatile void __iomem *addr);
+void iowrite32(u32 value, volatile void __iomem *addr);
+
+static inline void memcpy_toio(volatile void __iomem *dst, const void *src,
+			       size_t n)
+{
+	memcpy((void *)dst, src, n);
+}
+
+static inline void memcpy_fromio(void *dst, const volatile void __iomem *src,
+				 size_t n)
+{
+	memcpy(dst, (const void *)src, n);
+}
+
+static inline void memset_io(volatile void __iomem *dst, int c, size_t n)
+{
+	memset((void *)dst, c, n);
+}
+
+// Files and mappings.
+
+struct inode {
+	dev_t i_rdev;
+};
+
+struct file;
+struct vm_area_struct;
+struct poll_table_struct;
+typedef struct poll_table_struct poll_table;
+
+struct file_operations {
+	struct module *owner;
+	loff_t (*llseek)(struct file *, loff_t, int);
+	ssize_t (*read)(struct file *, char __user *, size_t, loff_t *);
+	ssize_t (*write)(struct file *, const char __user *, size_t, loff_t *);
+	unsigned int (*poll)(struct file *, poll_table *);
+	long (*unlocked_ioctl)(struct file *, unsigned int, unsigned long);
+	int (*mmap)(struct file *, struct vm_area_struct *);
+	int (*open)(struct inode *, struct file *);
+	int (*release)(struct inode *, struct file *);
+};
+
+struct file {
+	unsigned int f_flags;
+	loff_t f_pos;
+	const struct file_operations *f_op;
+	void *private_data;
+	struct inode *f_inode;
+	// Open file descriptors and mappings.
+	int kshim_refs;
+};
+
+#define poll_wait(fp, wq, pt) ((void)(wq))
+
+typedef unsigned int vm_fault_t;
+#define VM_FAULT_SIGBUS 0x0002
+#define VM_FAULT_NOPAGE 0x0100
+
+#define VM_IO 0x00004000UL
+#define VM_DONTCOPY 0x00020000UL
+#define VM_DONTEXPAND 0x00040000UL
+#define VM_PFNMAP 0x00000400UL
+#define VM_DONTDUMP 0x04000000UL
+
+typedef struct {
+	unsigned long pgprot;
+} pgprot_t;
+
+struct kshim_seg;
+
+// There is one address space, and every thread is the same task in it.
+struct mm_struct {
+	int unused;
+};
+
+struct task_struct {
+	struct mm_struct *mm;
+};
+
+extern struct task_struct kshim_current;
+#define current (&kshim_current)
+
+// Nothing signals the shim's callers; interruptible waits never give up early.
+static inline int signal_pending(struct task_struct *p)
+{
+	return 0;
+}
+
+struct vm_area_struct {
+	struct mm_struct *vm_mm;
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_pgoff;
+	unsigned long vm_flags;
+	pgprot_t vm_page_prot;
+	const struct vm_operations_struct *vm_ops;
+	void *vm_private_data;
+	struct file *vm_file;
+	// What of the vma is mapped where in the card's memfd.
+	struct kshim_seg *kshim_segs;
+	struct vm_area_struct *kshim_next;
+};
+
+struct vm_fault {
+	struct vm_area_struct *vma;
+	unsigned int flags;
+	unsigned long pgoff;
+	unsigned long address;
+};
+
+struct vm_operations_struct {
+	void (*open)(struct vm_area_struct *area);
+	void (*close)(struct vm_area_struct *area);
+	vm_fault_t (*fault)(struct vm_fault *vmf);
+};
+
+/*
+ * There is no page fault to hook, so a vma with a fault handler is faulted
+ * in, a page at a time, when it is mapped.
+ */
+unsigned long vm_mmap(struct file *file, unsigned long addr, unsigned long len,
+		      unsigned long prot, unsigned long flag,
+		      unsigned long offset);
+int vm_munmap(unsigned long start, size_t len);
+int vm_iomap_memory(struct vm_area_struct *vma, phys_addr_t start,
+		    unsigned long len);
+int remap_pfn_range(struct vm_area_struct *vma, unsigned long addr,
+		    unsigned long pfn, unsigned long size, pgprot_t prot);
+vm_fault_t vmf_insert_pfn(struct vm_area_struct *vma, unsigned long addr,
+			  unsigned long pfn);
+
+// Character devices.
+
+struct cdev {
+	const struct file_operations *ops;
+	dev_t dev;
+};
+
+#define MKDEV(ma, mi) (((dev_t)(ma) << 20) | (mi))
+
+void cdev_init(struct cdev *cdev, const struct file_operations *fops);
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count);
+void cdev_del(struct cdev *cdev);
+
+// PCI. The model is the only device on the bus.
+
+struct resource {
+	phys_addr_t start;
+	phys_addr_t end;
+};
+
+struct pci_dev {
+	unsigned short vendor;
+	unsigned short device;
+	unsigned int irq;
+	struct resource resource[6];
+};
+
+#define PCI_ANY_ID (~0U)
+
+struct pci_device_id {
+	u32 vendor, device;
+	u32 subvendor, subdevice;
+	u32 class, class_mask;
+	unsigned long driver_data;
+};
+
+#define PCI_DEVICE(vend, dev)                                                  \
+	.vendor = (vend), .device = (dev), .subvendor = PCI_ANY_ID,            \
+	.subdevice = PCI_ANY_ID
+
+struct pci_driver {
+	const char *name;
+	const struct pci_device_id *id_table;
+	int (*probe)(struct pci_dev *dev, const struct pci_device_id *id);
+	void (*remove)(struct pci_dev *dev);
+};
+
+#define pci_resource_start(dev, bar) ((dev)->resource[(bar)].start)
+#define pci_resource_len(dev, bar)                                             \
+	((dev)->resource[(bar)].end - (dev)->resource[(bar)].start + 1)
+
+int pci_register_driver(struct pci_driver *drv);
+void pci_unregister_driver(struct pci_driver *drv);
+
+static inline int pci_enable_device(struct pci_dev *dev)
+{
+	return 0;
+}
+
+static inline void pci_disable_device(struct pci_dev *dev)
+{
+}
+
+static inline void pci_set_master(struct pci_dev *dev)
+{
+}
+
+static inline int pci_enable_msi(struct pci_dev *dev)
+{
+	return 0;
+}
+
+static inline void pci_disable_msi(struct pci_dev *dev)
+{
+}
+
+void *pci_alloc_consistent(struct pci_dev *dev, size_t size,
+			   dma_addr_t *handle);
+void pci_free_consistent(struct pci_dev *dev, size_t size, void *vaddr,
+			 dma_addr_t handle);
+
+// Interrupts. Handlers run on a thread of their own, never concurrently.
+
+struct pt_regs;
+
+typedef enum irqreturn {
+	IRQ_NONE = 0,
+	IRQ_HANDLED = 1,
+	IRQ_WAKE_THREAD = 2,
+} irqreturn_t;
+
+typedef irqreturn_t (*irq_handler_t)(int irq, void *dev_id);
+
+#define IRQF_SHARED 0x00000080
+#define IRQF_ONESHOT 0x00002000
+
+int request_threaded_irq(unsigned int irq, irq_handler_t handler,
+			 irq_handler_t thread_fn, unsigned long flags,
+			 const char *name, void *dev);
+void free_irq(unsigned int irq, void *dev_id);
+
+// procfs and seq_file.
+
+struct proc_dir_entry;
+
+struct proc_ops {
+	int (*proc_open)(struct inode *inode, struct file *file);
+	ssize_t (*proc_read)(struct file *file, char __user *buf, size_t size,
+			     loff_t *ppos);
+	ssize_t (*proc_write)(struct file *file, const char __user *buf,
+			      size_t size, loff_t *ppos);
+	loff_t (*proc_lseek)(struct file *file, loff_t offset, int whence);
+	int (*proc_release)(struct inode *inode, struct file *file);
+};
+
+struct proc_dir_entry *proc_mkdir(const char *name,
+				  struct proc_dir_entry *parent);
+struct proc_dir_entry *proc_create(const char *name, unsigned short mode,
+				   struct proc_dir_entry *parent,
+				   const struct proc_ops *proc_ops);
+void proc_remove(struct proc_dir_entry *de);
+
+struct seq_file {
+	char *buf;
+	size_t size;
+	size_t count;
+	int (*show)(struct seq_file *m, void *v);
+	void *private;
+};
+
+void seq_printf(struct seq_file *m, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void seq_puts(struct seq_file *m, const char *s);
+void seq_putc(struct seq_file *m, char c);
+int single_open(struct file *file, int (*show)(struct seq_file *, void *),
+		void *data);
+int single_release(struct inode *inode, struct file *file);
+ssize_t seq_read(struct file *file, char __user *buf, size_t size,
+		 loff_t *ppos);
+loff_t seq_lseek(struct file *file, loff_t offset, int whence);
+
+#endif
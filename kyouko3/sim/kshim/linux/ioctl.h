@@ -0,0 +1,2 @@
+// The UAPI header, for kyouko3.h.
+#include_next <linux/ioctl.h>
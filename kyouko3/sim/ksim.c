@@ -0,0 +1,709 @@
+/*
+ * Kyouko3 device model: register file, command FIFO processor and DMA packet
+ * decoder. Rasterization lives in ksim_raster.c.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ksim.h"
+
+#define KSIM_PAGE 4096u
+#define KSIM_MAX_EXTENTS 4096
+
+// An allocated range of the DMA arena, kept sorted by offset.
+struct ksim_extent {
+	uint32_t off;
+	uint32_t len;
+};
+
+/*
+ * Everything the card and the host can both see lives in one memfd, so that
+ * the kernel shim can map any part of it a second time, the way the kernel
+ * maps BARs and DMA memory into a process: the control registers first, then
+ * device RAM, then the DMA arena.
+ */
+struct ksim {
+	int memfd;
+	uint8_t *mem;
+	size_t mem_len;
+	uint32_t *regs;
+	uint32_t *ram;
+	size_t ram_len;
+
+	uint8_t *arena;
+	struct ksim_extent ext[KSIM_MAX_EXTENTS];
+	int next;
+	pthread_mutex_t alloc_lock;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	// Signalled on FIFO_HEAD writes and when the card goes idle.
+	pthread_cond_t kick;
+	pthread_cond_t idle;
+	bool stop;
+
+	void (*isr)(void *arg);
+	void *isr_arg;
+
+	// Pipeline state set through the FIFO.
+	float clear[4];
+	struct ksim_vtx cur;
+	struct ksim_vtx tri[3];
+	int nvtx;
+	uint32_t prim;
+	uint32_t bufa_addr;
+	// FRAME_STARTADDRESS as of the last ENC_FRAME write: what the encoder
+	// shows.
+	uint32_t scanout;
+
+	// Compare every triangle against the scalar rasterizer.
+	bool raster_check;
+	struct ksim_stats stats;
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline float u2f(uint32_t u)
+{
+	float f;
+
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static inline uint32_t reg_load(struct ksim *k, uint32_t reg)
+{
+	return __atomic_load_n(&k->regs[reg >> 2], __ATOMIC_ACQUIRE);
+}
+
+static inline void reg_store(struct ksim *k, uint32_t reg, uint32_t val)
+{
+	__atomic_store_n(&k->regs[reg >> 2], val, __ATOMIC_RELEASE);
+}
+
+/*
+ * Translate a bus address range into a host pointer, or NULL if it falls
+ * outside the DMA arena.
+ */
+static void *bus_to_host(struct ksim *k, uint32_t bus, uint32_t len)
+{
+	if (bus < KSIM_BUS_BASE || bus - KSIM_BUS_BASE > KSIM_DMA_ARENA ||
+	    len > KSIM_DMA_ARENA - (bus - KSIM_BUS_BASE)) {
+		return NULL;
+	}
+	return k->arena + (bus - KSIM_BUS_BASE);
+}
+
+// The surface at device RAM offset start, in the FRAME_ geometry.
+static struct ksim_surface surface_at(struct ksim *k, uint32_t start)
+{
+	struct ksim_surface s;
+	uint32_t pitch = reg_load(k, FRAME_ROWPITCH);
+
+	s.width = reg_load(k, FRAME_COLUMNS);
+	s.height = reg_load(k, FRAME_ROWS);
+	s.pitch = pitch / 4;
+	s.pixels = k->ram + start / 4;
+	if (s.width == 0 || s.height == 0 || s.pitch < s.width ||
+	    start + (uint64_t)pitch * s.height > k->ram_len) {
+		s.width = s.height = 0;
+	}
+	return s;
+}
+
+// The surface the rasterizer draws into.
+static struct ksim_surface render_target(struct ksim *k)
+{
+	return surface_at(k, reg_load(k, FRAME_STARTADDRESS));
+}
+
+// The encoder takes up the frame as FRAME_STARTADDRESS now describes it.
+static void enc_frame(struct ksim *k, uint32_t val)
+{
+	reg_store(k, ENC_FRAME, val);
+	__atomic_store_n(&k->scanout, reg_load(k, FRAME_STARTADDRESS),
+			 __ATOMIC_RELEASE);
+}
+
+static void raster_clear(struct ksim *k, uint32_t mask)
+{
+	struct ksim_surface s = render_target(k);
+	uint64_t t0 = now_ns();
+	uint32_t px;
+	int x, y;
+
+	if (!(mask & 1)) {
+		return;
+	}
+	px = (uint32_t)(k->clear[0] * 255.0f + 0.5f) << 16 |
+	     (uint32_t)(k->clear[1] * 255.0f + 0.5f) << 8 |
+	     (uint32_t)(k->clear[2] * 255.0f + 0.5f);
+	for (y = 0; y < s.height; y++) {
+		for (x = 0; x < s.width; x++) {
+			s.pixels[y * s.pitch + x] = px;
+		}
+	}
+	k->stats.clears++;
+	k->stats.clear_ns += now_ns() - t0;
+}
+
+static void raster_batch(struct ksim *k, const struct ksim_vtx *v, int ntri)
+{
+	struct ksim_surface s = render_target(k);
+	uint64_t t0 = now_ns();
+	int i;
+
+	for (i = 0; i < ntri; i++) {
+		if (k->raster_check) {
+			k->stats.pixels += ksim_raster_check(
+			    &s, v + 3 * i, &k->stats.raster_mismatches);
+		} else {
+			k->stats.pixels += ksim_raster_triangle(&s, v + 3 * i);
+		}
+	}
+	k->stats.triangles += ntri;
+	k->stats.raster_ns += now_ns() - t0;
+}
+
+/*
+ * Walk a DMA buffer of kyouko3_dma_hdr packets. Vertices of each packet are
+ * decoded into a scratch array first and then rasterized as a batch, so the
+ * parse and raster stages are timed separately.
+ */
+static void run_dma(struct ksim *k, uint32_t bus, uint32_t len)
+{
+	static __thread struct ksim_vtx *scratch;
+	static __thread size_t scratch_len;
+	uint32_t *p = bus_to_host(k, bus, len);
+	uint32_t *end;
+	uint64_t t0 = now_ns();
+	uint64_t raster0 = k->stats.raster_ns;
+
+	k->stats.dma_bufs++;
+	k->stats.dma_bytes += len;
+	if (!p) {
+		k->stats.bad_packets++;
+		return;
+	}
+	end = p + len / 4;
+
+	while (p < end) {
+		struct kyouko3_dma_hdr hdr;
+		uint32_t nwords, step, i;
+
+		memcpy(&hdr, p++, sizeof(hdr));
+		nwords = (hdr.rgb ? 3 : 0) + (hdr.w ? 4 : 3);
+		step = hdr.stride + 1 > nwords ? hdr.stride + 1 : nwords;
+		if (p + (size_t)hdr.count * step > end) {
+			k->stats.bad_packets++;
+			break;
+		}
+		// A zero word is padding.
+		if (hdr.opcode == 0 && hdr.count == 0) {
+			continue;
+		}
+		// Only triangle lists (opcode 0x14) are modelled; skip the rest.
+		if (hdr.opcode != 0x14) {
+			k->stats.bad_packets++;
+			p += hdr.count * step;
+			continue;
+		}
+
+		if (scratch_len < hdr.count) {
+			free(scratch);
+			scratch_len = hdr.count;
+			scratch = malloc(scratch_len * sizeof(*scratch));
+		}
+		for (i = 0; i < hdr.count; i++) {
+			struct ksim_vtx *v = &scratch[i];
+			const uint32_t *w = p + i * step;
+
+			*v = k->cur;
+			if (hdr.rgb) {
+				v->r = u2f(*w++);
+				v->g = u2f(*w++);
+				v->b = u2f(*w++);
+			}
+			v->x = u2f(*w++);
+			v->y = u2f(*w++);
+			v->z = u2f(*w++);
+			v->w = hdr.w ? u2f(*w++) : 1.0f;
+		}
+		p += hdr.count * step;
+		raster_batch(k, scratch, hdr.count / 3);
+	}
+
+	k->stats.dma_ns += now_ns() - t0 - (k->stats.raster_ns - raster0);
+}
+
+static void raise_irq(struct ksim *k, uint32_t bits)
+{
+	__atomic_fetch_or(&k->regs[INFO_STATUS >> 2], bits, __ATOMIC_ACQ_REL);
+	if ((reg_load(k, CONF_INTERRUPT) & bits) && k->isr) {
+		k->stats.interrupts++;
+		k->isr(k->isr_arg);
+	}
+}
+
+// Execute one FIFO command.
+static void exec(struct ksim *k, uint32_t cmd, uint32_t val)
+{
+	if (cmd >= CLEAR_COLOR && cmd < CLEAR_COLOR + 0x10) {
+		k->clear[(cmd - CLEAR_COLOR) / 4] = u2f(val);
+		return;
+	}
+	if (cmd >= VERTEX_COORD && cmd < VERTEX_COORD + 0x10) {
+		(&k->cur.x)[(cmd - VERTEX_COORD) / 4] = u2f(val);
+		return;
+	}
+	if (cmd >= VERTEX_COLOR && cmd < VERTEX_COLOR + 0x10) {
+		(&k->cur.r)[(cmd - VERTEX_COLOR) / 4] = u2f(val);
+		return;
+	}
+
+	switch (cmd) {
+	case COMMAND_PRIMITIVE:
+		k->prim = val;
+		k->nvtx = 0;
+		break;
+	case VERTEX_EMIT:
+		if (k->prim != 1) {
+			break;
+		}
+		k->tri[k->nvtx++] = k->cur;
+		if (k->nvtx == 3) {
+			raster_batch(k, k->tri, 1);
+			k->nvtx = 0;
+		}
+		break;
+	case RASTER_CLEAR:
+		raster_clear(k, val);
+		break;
+	case RASTER_FLUSH:
+		// Drawing is synchronous, there is nothing to wait for.
+		k->stats.flushes++;
+		break;
+	case BUFA_ADDR:
+		k->bufa_addr = val;
+		break;
+	case BUFA_CONF:
+		run_dma(k, k->bufa_addr, val);
+		raise_irq(k, KSIM_INT_DMA);
+		break;
+	case ENC_FRAME:
+		enc_frame(k, val);
+		break;
+	default:
+		if (cmd < KYOUKO_CONTROL_SIZE) {
+			reg_store(k, cmd, val);
+		}
+		break;
+	}
+}
+
+/*
+ * The card: consume FIFO entries between FIFO_TAIL and FIFO_HEAD.
+ */
+static void *card_thread(void *arg)
+{
+	struct ksim *k = arg;
+	uint32_t head, tail, nent;
+	struct fifo_entry *fifo;
+
+	pthread_mutex_lock(&k->lock);
+	for (;;) {
+		while (!k->stop &&
+		       reg_load(k, FIFO_TAIL) == reg_load(k, FIFO_HEAD)) {
+			pthread_cond_broadcast(&k->idle);
+			pthread_cond_wait(&k->kick, &k->lock);
+		}
+		if (k->stop) {
+			break;
+		}
+		head = reg_load(k, FIFO_HEAD);
+		tail = reg_load(k, FIFO_TAIL);
+		nent = (reg_load(k, FIFO_END) - reg_load(k, FIFO_START)) / 8;
+		fifo = bus_to_host(k, reg_load(k, FIFO_START), nent * 8);
+		pthread_mutex_unlock(&k->lock);
+
+		if (fifo && nent) {
+			uint64_t t0 = now_ns();
+			uint64_t inner0 = k->stats.dma_ns + k->stats.raster_ns +
+					  k->stats.clear_ns;
+
+			while (tail != head && head < nent) {
+				exec(k, fifo[tail].command, fifo[tail].value);
+				k->stats.fifo_entries++;
+				if (++tail == nent) {
+					tail = 0;
+				}
+				reg_store(k, FIFO_TAIL, tail);
+			}
+			k->stats.fifo_ns += now_ns() - t0 -
+					    (k->stats.dma_ns +
+					     k->stats.raster_ns +
+					     k->stats.clear_ns - inner0);
+		}
+		if (!fifo || !nent || head >= nent) {
+			// Garbage FIFO setup; swallow the kick.
+			reg_store(k, FIFO_TAIL, head);
+		}
+		pthread_mutex_lock(&k->lock);
+	}
+	pthread_mutex_unlock(&k->lock);
+	return NULL;
+}
+
+// Map the memfd and point regs, ram and arena into it.
+static int ksim_map(struct ksim *k, void *at)
+{
+	k->mem = mmap(at, k->mem_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_NORESERVE | (at ? MAP_FIXED : 0),
+		      k->memfd, 0);
+	if (k->mem == MAP_FAILED) {
+		return -1;
+	}
+	k->regs = (uint32_t *)k->mem;
+	k->ram = (uint32_t *)(k->mem + KYOUKO_CONTROL_SIZE);
+	k->arena = k->mem + KYOUKO_CONTROL_SIZE + k->ram_len;
+	return 0;
+}
+
+static void ksim_start(struct ksim *k)
+{
+	pthread_mutex_init(&k->alloc_lock, NULL);
+	pthread_mutex_init(&k->lock, NULL);
+	pthread_cond_init(&k->kick, NULL);
+	pthread_cond_init(&k->idle, NULL);
+	k->stop = false;
+	pthread_create(&k->thread, NULL, card_thread, k);
+}
+
+struct ksim *ksim_create(unsigned int ram_mb)
+{
+	struct ksim *k = calloc(1, sizeof(*k));
+
+	if (!k) {
+		return NULL;
+	}
+	k->ram_len = (size_t)ram_mb * 1024 * 1024;
+	k->mem_len = KYOUKO_CONTROL_SIZE + k->ram_len + KSIM_DMA_ARENA;
+	k->memfd = memfd_create("ksim", MFD_CLOEXEC);
+	if (ram_mb == 0 || ram_mb > KSIM_RAM_MB_MAX || k->memfd < 0 ||
+	    ftruncate(k->memfd, k->mem_len) < 0 || ksim_map(k, NULL) < 0) {
+		if (k->memfd >= 0) {
+			close(k->memfd);
+		}
+		free(k);
+		return NULL;
+	}
+
+	reg_store(k, Device_RAM, ram_mb);
+	k->cur.w = 1.0f;
+	k->raster_check = getenv("KSIM_RASTER_CHECK") != NULL;
+	ksim_start(k);
+	return k;
+}
+
+void ksim_destroy(struct ksim *k)
+{
+	pthread_mutex_lock(&k->lock);
+	k->stop = true;
+	pthread_cond_broadcast(&k->kick);
+	pthread_mutex_unlock(&k->lock);
+	pthread_join(k->thread, NULL);
+
+	munmap(k->mem, k->mem_len);
+	close(k->memfd);
+	free(k);
+}
+
+void ksim_fork_prepare(struct ksim *k)
+{
+	pthread_mutex_lock(&k->alloc_lock);
+	pthread_mutex_lock(&k->lock);
+}
+
+void ksim_fork_parent(struct ksim *k)
+{
+	pthread_mutex_unlock(&k->lock);
+	pthread_mutex_unlock(&k->alloc_lock);
+}
+
+/*
+ * The child gets a card of its own: a private copy of the parent's memory,
+ * mapped where the parent's was, and a new card thread that carries on from
+ * the FIFO_TAIL it inherited. Only the parts of the memfd that were ever
+ * written are copied.
+ */
+int ksim_fork_child(struct ksim *k)
+{
+	int fd = memfd_create("ksim", MFD_CLOEXEC);
+	off_t data = 0, hole;
+
+	if (fd < 0 || ftruncate(fd, k->mem_len) < 0) {
+		return -1;
+	}
+	while ((data = lseek(k->memfd, data, SEEK_DATA)) >= 0) {
+		hole = lseek(k->memfd, data, SEEK_HOLE);
+		if (hole < 0 ||
+		    pwrite(fd, k->mem + data, hole - data, data) != hole - data) {
+			close(fd);
+			return -1;
+		}
+		data = hole;
+	}
+	close(k->memfd);
+	k->memfd = fd;
+	if (ksim_map(k, k->mem) < 0) {
+		return -1;
+	}
+	ksim_start(k);
+	return 0;
+}
+
+uint32_t ksim_read_reg(struct ksim *k, uint32_t reg)
+{
+	return reg_load(k, reg);
+}
+
+void ksim_write_reg(struct ksim *k, uint32_t reg, uint32_t value)
+{
+	switch (reg) {
+	case INFO_STATUS:
+		// Write one to clear.
+		__atomic_fetch_and(&k->regs[reg >> 2], ~value, __ATOMIC_ACQ_REL);
+		break;
+	case FIFO_START:
+		reg_store(k, reg, value);
+		reg_store(k, FIFO_HEAD, 0);
+		reg_store(k, FIFO_TAIL, 0);
+		break;
+	case FIFO_HEAD:
+		pthread_mutex_lock(&k->lock);
+		reg_store(k, reg, value);
+		pthread_cond_signal(&k->kick);
+		pthread_mutex_unlock(&k->lock);
+		break;
+	case ENC_FRAME:
+		enc_frame(k, value);
+		break;
+	case FIFO_TAIL:
+	case Device_RAM:
+		// Read only.
+		break;
+	default:
+		reg_store(k, reg, value);
+		break;
+	}
+}
+
+size_t ksim_ram_len(struct ksim *k)
+{
+	return k->ram_len;
+}
+
+int ksim_memfd(struct ksim *k)
+{
+	return k->memfd;
+}
+
+/*
+ * Offset into the memfd of len bytes at physical address phys, or -1 if they
+ * do not lie within one of the card's BARs or the DMA window.
+ */
+int64_t ksim_phys_offset(struct ksim *k, uint64_t phys, uint64_t len)
+{
+	if (phys >= KSIM_CONTROL_PHYS &&
+	    phys + len <= KSIM_CONTROL_PHYS + KYOUKO_CONTROL_SIZE) {
+		return phys - KSIM_CONTROL_PHYS;
+	}
+	if (phys >= KSIM_RAM_PHYS && phys + len <= KSIM_RAM_PHYS + k->ram_len) {
+		return KYOUKO_CONTROL_SIZE + phys - KSIM_RAM_PHYS;
+	}
+	if (phys >= KSIM_BUS_BASE &&
+	    phys + len <= KSIM_BUS_BASE + (uint64_t)KSIM_DMA_ARENA) {
+		return KYOUKO_CONTROL_SIZE + k->ram_len + phys - KSIM_BUS_BASE;
+	}
+	return -1;
+}
+
+void *ksim_phys_to_virt(struct ksim *k, uint64_t phys, uint64_t len)
+{
+	int64_t off = ksim_phys_offset(k, phys, len);
+
+	return off < 0 ? NULL : k->mem + off;
+}
+
+uint64_t ksim_virt_to_phys(struct ksim *k, const void *p)
+{
+	const uint8_t *b = p;
+
+	if (b >= k->arena && b < k->arena + KSIM_DMA_ARENA) {
+		return KSIM_BUS_BASE + (b - k->arena);
+	}
+	if (b >= (uint8_t *)k->ram && b < (uint8_t *)k->ram + k->ram_len) {
+		return KSIM_RAM_PHYS + (b - (uint8_t *)k->ram);
+	}
+	if (b >= (uint8_t *)k->regs &&
+	    b < (uint8_t *)k->regs + KYOUKO_CONTROL_SIZE) {
+		return KSIM_CONTROL_PHYS + (b - (uint8_t *)k->regs);
+	}
+	return 0;
+}
+
+/*
+ * First-fit allocator over the DMA arena. Allocations are rare (bind time),
+ * so a sorted array is plenty. Memory comes back zeroed.
+ */
+void *ksim_dma_alloc(struct ksim *k, size_t len, uint32_t *bus)
+{
+	uint32_t off = 0;
+	int i;
+
+	len = (len + KSIM_PAGE - 1) & ~(size_t)(KSIM_PAGE - 1);
+	if (len == 0 || len > KSIM_DMA_ARENA) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&k->alloc_lock);
+	if (k->next == KSIM_MAX_EXTENTS) {
+		goto fail;
+	}
+	for (i = 0; i <= k->next; i++) {
+		uint32_t end = i < k->next ? k->ext[i].off : KSIM_DMA_ARENA;
+
+		if (end - off >= len) {
+			break;
+		}
+		if (i < k->next) {
+			off = k->ext[i].off + k->ext[i].len;
+		}
+	}
+	if (i > k->next) {
+		goto fail;
+	}
+	memmove(&k->ext[i + 1], &k->ext[i], (k->next - i) * sizeof(k->ext[0]));
+	k->ext[i].off = off;
+	k->ext[i].len = len;
+	k->next++;
+	pthread_mutex_unlock(&k->alloc_lock);
+
+	// Free ranges are holes in the memfd, so this reads back as zeroes.
+	*bus = KSIM_BUS_BASE + off;
+	return k->arena + off;
+fail:
+	pthread_mutex_unlock(&k->alloc_lock);
+	return NULL;
+}
+
+// Frees the memory behind the allocation too.
+void ksim_dma_free(struct ksim *k, void *p)
+{
+	uint32_t off = (uint8_t *)p - k->arena;
+	int i;
+
+	pthread_mutex_lock(&k->alloc_lock);
+	for (i = 0; i < k->next; i++) {
+		if (k->ext[i].off == off) {
+			fallocate(k->memfd,
+				  FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  k->arena - k->mem + off, k->ext[i].len);
+			memmove(&k->ext[i], &k->ext[i + 1],
+				(k->next - i - 1) * sizeof(k->ext[0]));
+			k->next--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&k->alloc_lock);
+}
+
+void ksim_set_isr(struct ksim *k, void (*isr)(void *arg), void *arg)
+{
+	k->isr_arg = arg;
+	k->isr = isr;
+}
+
+void ksim_idle(struct ksim *k)
+{
+	pthread_mutex_lock(&k->lock);
+	while (reg_load(k, FIFO_TAIL) != reg_load(k, FIFO_HEAD)) {
+		pthread_cond_wait(&k->idle, &k->lock);
+	}
+	pthread_mutex_unlock(&k->lock);
+}
+
+void ksim_get_stats(struct ksim *k, struct ksim_stats *st)
+{
+	*st = k->stats;
+}
+
+static void print_rate(FILE *f, const char *what, uint64_t n, uint64_t ns)
+{
+	fprintf(f, "  %-10s %12llu in %10.3f ms", what, (unsigned long long)n,
+		ns / 1e6);
+	if (ns) {
+		fprintf(f, "  (%.3g/s)", n * 1e9 / ns);
+	}
+	fputc('\n', f);
+}
+
+void ksim_print_stats(struct ksim *k, FILE *f)
+{
+	struct ksim_stats *st = &k->stats;
+
+	fprintf(f, "ksim: per-stage statistics\n");
+	print_rate(f, "fifo", st->fifo_entries, st->fifo_ns);
+	print_rate(f, "dma bufs", st->dma_bufs, st->dma_ns);
+	print_rate(f, "dma bytes", st->dma_bytes, st->dma_ns);
+	print_rate(f, "triangles", st->triangles, st->raster_ns);
+	print_rate(f, "pixels", st->pixels, st->raster_ns);
+	print_rate(f, "clears", st->clears, st->clear_ns);
+	fprintf(f, "  flushes %llu, interrupts %llu, bad packets %llu\n",
+		(unsigned long long)st->flushes,
+		(unsigned long long)st->interrupts,
+		(unsigned long long)st->bad_packets);
+	fprintf(f, "  rasterizer %s", ksim_raster_name());
+	if (k->raster_check) {
+		fprintf(f, ", %llu pixels differ from scalar",
+			(unsigned long long)st->raster_mismatches);
+	}
+	fputc('\n', f);
+}
+
+// Write the visible surface as a binary PPM.
+int ksim_dump_ppm(struct ksim *k, const char *path)
+{
+	struct ksim_surface s =
+	    surface_at(k, __atomic_load_n(&k->scanout, __ATOMIC_ACQUIRE));
+	FILE *f = fopen(path, "wb");
+	int x, y;
+
+	if (!f) {
+		return -1;
+	}
+	fprintf(f, "P6\n%d %d\n255\n", s.width, s.height);
+	for (y = 0; y < s.height; y++) {
+		for (x = 0; x < s.width; x++) {
+			uint32_t px = s.pixels[y * s.pitch + x];
+
+			fputc((px >> 16) & 0xff, f);
+			fputc((px >> 8) & 0xff, f);
+			fputc(px & 0xff, f);
+		}
+	}
+	return fclose(f);
+}
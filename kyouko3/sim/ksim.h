@@ -0,0 +1,126 @@
+/*
+ * Software model of the Kyouko3 virtual graphics card.
+ *
+ * The model implements the register map from kyouko3.h, consumes the command
+ * FIFO and DMA packets in a background "card" thread, rasterizes into an
+ * in-memory framebuffer and keeps per-stage timing. The real driver,
+ * kyouko3.c, is built against the kernel API stand-ins in kshim/ and drives
+ * it, and ksim_preload.c interposes on libc so unmodified clients run against
+ * the pair with LD_PRELOAD.
+ */
+#ifndef KSIM_H
+#define KSIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../kyouko3.h"
+
+// Bus address at which host memory visible to the card starts.
+#define KSIM_BUS_BASE 0x10000000u
+// Size of that window.
+#define KSIM_DMA_ARENA (256u * 1024 * 1024)
+// Default amount of device RAM, in MiB, reported through Device_RAM.
+#define KSIM_RAM_MB 32
+#define KSIM_RAM_MB_MAX 1024
+// Physical addresses of the control registers (BAR 1) and device RAM (BAR 2).
+#define KSIM_CONTROL_PHYS 0xf0000000u
+#define KSIM_RAM_PHYS 0x80000000u
+
+// Interrupt status bits in INFO_STATUS / CONF_INTERRUPT.
+#define KSIM_INT_DMA 0x02
+
+struct ksim_vtx {
+	float x, y, z, w;
+	float r, g, b, a;
+};
+
+// A render target: 32bpp pixels, pitch in pixels.
+struct ksim_surface {
+	uint32_t *pixels;
+	int width;
+	int height;
+	int pitch;
+};
+
+struct ksim_stats {
+	uint64_t fifo_entries;
+	uint64_t dma_bufs;
+	uint64_t dma_bytes;
+	uint64_t triangles;
+	uint64_t pixels;
+	uint64_t clears;
+	uint64_t flushes;
+	uint64_t interrupts;
+	uint64_t bad_packets;
+	// Pixels that differed from the scalar rasterizer, with KSIM_RASTER_CHECK.
+	uint64_t raster_mismatches;
+	// Wall time spent in each stage, in nanoseconds. fifo_ns excludes the
+	// time spent in DMA parsing and rasterization triggered from the FIFO.
+	uint64_t fifo_ns;
+	uint64_t dma_ns;
+	uint64_t raster_ns;
+	uint64_t clear_ns;
+};
+
+struct ksim;
+
+struct ksim *ksim_create(unsigned int ram_mb);
+void ksim_destroy(struct ksim *k);
+
+// Register access, as the driver would do through the control BAR.
+uint32_t ksim_read_reg(struct ksim *k, uint32_t reg);
+void ksim_write_reg(struct ksim *k, uint32_t reg, uint32_t value);
+
+size_t ksim_ram_len(struct ksim *k);
+
+/*
+ * The card's physical address space: the registers at KSIM_CONTROL_PHYS,
+ * device RAM at KSIM_RAM_PHYS and host memory the card can DMA from at
+ * KSIM_BUS_BASE. All of it is backed by ksim_memfd(), at the offsets
+ * ksim_phys_offset() gives, for mapping into a process.
+ */
+int ksim_memfd(struct ksim *k);
+int64_t ksim_phys_offset(struct ksim *k, uint64_t phys, uint64_t len);
+void *ksim_phys_to_virt(struct ksim *k, uint64_t phys, uint64_t len);
+// 0 if p is not the model's memory.
+uint64_t ksim_virt_to_phys(struct ksim *k, const void *p);
+
+// Allocate host memory the card can DMA from. *bus gets its bus address.
+void *ksim_dma_alloc(struct ksim *k, size_t len, uint32_t *bus);
+void ksim_dma_free(struct ksim *k, void *p);
+
+/*
+ * fork() support, for pthread_atfork(). The child carries on with a private
+ * copy of the card, at the same addresses; ksim_memfd() changes, so any
+ * other mapping of it has to be redone.
+ */
+void ksim_fork_prepare(struct ksim *k);
+void ksim_fork_parent(struct ksim *k);
+int ksim_fork_child(struct ksim *k);
+
+// Interrupt handler, called from the card thread.
+void ksim_set_isr(struct ksim *k, void (*isr)(void *arg), void *arg);
+
+// Block until the card thread has consumed every FIFO entry written so far.
+void ksim_idle(struct ksim *k);
+
+void ksim_get_stats(struct ksim *k, struct ksim_stats *st);
+void ksim_print_stats(struct ksim *k, FILE *f);
+int ksim_dump_ppm(struct ksim *k, const char *path);
+
+// Rasterize one triangle in NDC into s. Returns the number of pixels written.
+uint64_t ksim_raster_triangle(const struct ksim_surface *s,
+			      const struct ksim_vtx v[3]);
+// The same with the scalar reference rasterizer.
+uint64_t ksim_raster_triangle_ref(const struct ksim_surface *s,
+				  const struct ksim_vtx v[3]);
+// ksim_raster_triangle(), adding to *mismatches every pixel it got different
+// from the reference.
+uint64_t ksim_raster_check(const struct ksim_surface *s,
+			   const struct ksim_vtx v[3], uint64_t *mismatches);
+// Name of the back end ksim_raster_triangle() uses.
+const char *ksim_raster_name(void);
+
+#endif
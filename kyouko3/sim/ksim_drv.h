@@ -0,0 +1,25 @@
+/*
+ * Entry points for ksim_preload.c into the driver, through the kernel shim in
+ * kshim.c. Each one runs the corresponding file operation of kyouko3.c on
+ * the struct file behind fd and returns a negative errno on failure.
+ */
+#ifndef KSIM_DRV_H
+#define KSIM_DRV_H
+
+#include <sys/types.h>
+
+int kdrv_open(int fd);
+int kdrv_is_dev(int fd);
+int kdrv_release(int fd);
+long kdrv_ioctl(int fd, unsigned long cmd, void *arg);
+// MAP_FAILED with errno set on failure.
+void *kdrv_mmap(int fd, size_t len, int prot, int flags, off_t off);
+ssize_t kdrv_read(int fd, void *buf, size_t len);
+short kdrv_poll(int fd, short events);
+// Sleep until the driver state changes or timeout_ms elapses.
+void kdrv_wait(int timeout_ms);
+// Whether [addr, addr + len) overlaps a mapping of the device.
+int kdrv_owns(const void *addr, size_t len);
+int kdrv_munmap(void *addr, size_t len);
+
+#endif
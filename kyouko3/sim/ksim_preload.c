@@ -0,0 +1,200 @@
+/*
+ * LD_PRELOAD shim that routes /dev/kyouko3 to the device model:
+ *
+ *   LD_PRELOAD=sim/libksim.so ./demos
+ *
+ * open() of the device hands back a real fd on /dev/null so fcntl() and
+ * close() bookkeeping keep working; ioctl(), mmap(), read() and poll() on
+ * that fd go to the driver's file operations, through kshim.c.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ksim_drv.h"
+
+#define KSIM_DEV "/dev/kyouko3"
+#define EXPORT __attribute__((visibility("default")))
+
+#define REAL(name) (real_##name ? real_##name : lookup_##name())
+#define DEFINE_REAL(ret, name, ...)                                            \
+	static ret (*real_##name)(__VA_ARGS__);                                \
+	static ret (*lookup_##name(void))(__VA_ARGS__)                         \
+	{                                                                      \
+		real_##name = dlsym(RTLD_NEXT, #name);                         \
+		return real_##name;                                            \
+	}
+
+DEFINE_REAL(int, open, const char *, int, ...)
+DEFINE_REAL(int, open64, const char *, int, ...)
+DEFINE_REAL(int, close, int)
+DEFINE_REAL(int, ioctl, int, unsigned long, ...)
+DEFINE_REAL(void *, mmap, void *, size_t, int, int, int, off_t)
+DEFINE_REAL(void *, mmap64, void *, size_t, int, int, int, off_t)
+DEFINE_REAL(int, munmap, void *, size_t)
+DEFINE_REAL(ssize_t, read, int, void *, size_t)
+DEFINE_REAL(int, poll, struct pollfd *, nfds_t, int)
+
+static inline int ret_errno(long ret)
+{
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	return ret;
+}
+
+static int open_dev(int flags)
+{
+	int fd = REAL(open)("/dev/null", O_RDWR | (flags & O_NONBLOCK));
+	int ret;
+
+	if (fd < 0) {
+		return fd;
+	}
+	ret = kdrv_open(fd);
+	if (ret) {
+		REAL(close)(fd);
+		return ret_errno(ret);
+	}
+	return fd;
+}
+
+EXPORT int open(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode;
+
+	if (strcmp(path, KSIM_DEV) == 0) {
+		return open_dev(flags);
+	}
+	va_start(ap, flags);
+	mode = va_arg(ap, mode_t);
+	va_end(ap);
+	return REAL(open)(path, flags, mode);
+}
+
+EXPORT int open64(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode;
+
+	if (strcmp(path, KSIM_DEV) == 0) {
+		return open_dev(flags);
+	}
+	va_start(ap, flags);
+	mode = va_arg(ap, mode_t);
+	va_end(ap);
+	return REAL(open64)(path, flags, mode);
+}
+
+EXPORT int close(int fd)
+{
+	if (kdrv_is_dev(fd)) {
+		kdrv_release(fd);
+	}
+	return REAL(close)(fd);
+}
+
+EXPORT int ioctl(int fd, unsigned long request, ...)
+{
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (kdrv_is_dev(fd)) {
+		return ret_errno(kdrv_ioctl(fd, request, arg));
+	}
+	return REAL(ioctl)(fd, request, arg);
+}
+
+EXPORT void *mmap(void *addr, size_t len, int prot, int flags, int fd,
+		  off_t off)
+{
+	if (kdrv_is_dev(fd)) {
+		return kdrv_mmap(fd, len, prot, flags, off);
+	}
+	return REAL(mmap)(addr, len, prot, flags, fd, off);
+}
+
+EXPORT void *mmap64(void *addr, size_t len, int prot, int flags, int fd,
+		    off_t off)
+{
+	if (kdrv_is_dev(fd)) {
+		return kdrv_mmap(fd, len, prot, flags, off);
+	}
+	return REAL(mmap64)(addr, len, prot, flags, fd, off);
+}
+
+EXPORT int munmap(void *addr, size_t len)
+{
+	if (kdrv_owns(addr, len)) {
+		return ret_errno(kdrv_munmap(addr, len));
+	}
+	return REAL(munmap)(addr, len);
+}
+
+EXPORT ssize_t read(int fd, void *buf, size_t len)
+{
+	if (kdrv_is_dev(fd)) {
+		return ret_errno(kdrv_read(fd, buf, len));
+	}
+	return REAL(read)(fd, buf, len);
+}
+
+/*
+ * poll() over a mix of device and ordinary fds: the device fds are checked
+ * directly and the rest with a zero-timeout real poll(), in a loop that
+ * sleeps on driver events in between.
+ */
+EXPORT int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct timespec start, now;
+	nfds_t i;
+	int ours = 0;
+
+	for (i = 0; i < nfds; i++) {
+		ours |= kdrv_is_dev(fds[i].fd);
+	}
+	if (!ours) {
+		return REAL(poll)(fds, nfds, timeout);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		int ready = 0;
+		long elapsed;
+
+		for (i = 0; i < nfds; i++) {
+			if (kdrv_is_dev(fds[i].fd)) {
+				fds[i].revents = kdrv_poll(fds[i].fd,
+							   fds[i].events);
+			} else {
+				REAL(poll)(&fds[i], 1, 0);
+			}
+			ready += fds[i].revents != 0;
+		}
+		if (ready || timeout == 0) {
+			return ready;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+			  (now.tv_nsec - start.tv_nsec) / 1000000;
+		if (timeout > 0 && elapsed >= timeout) {
+			return 0;
+		}
+		kdrv_wait(1);
+	}
+}
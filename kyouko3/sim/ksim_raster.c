@@ -0,0 +1,261 @@
+/*
+ * Edge-function triangle rasterizer with Gouraud shading.
+ *
+ * Triangle setup is shared; the per-pixel work is done by one of the back
+ * ends in ksim_raster_simd.c, or by the scalar loop below, which is the
+ * reference they are checked against. The fastest back end the CPU supports
+ * is used unless KSIM_RASTER names another one ("scalar", "sse2", "avx2").
+ */
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ksim_raster.h"
+
+static inline uint32_t pack_rgb(float r, float g, float b)
+{
+	r = r < 0.0f ? 0.0f : r > 1.0f ? 1.0f : r;
+	g = g < 0.0f ? 0.0f : g > 1.0f ? 1.0f : g;
+	b = b < 0.0f ? 0.0f : b > 1.0f ? 1.0f : b;
+	return (uint32_t)(r * 255.0f + 0.5f) << 16 |
+	       (uint32_t)(g * 255.0f + 0.5f) << 8 |
+	       (uint32_t)(b * 255.0f + 0.5f);
+}
+
+/*
+ * A pixel on an edge belongs to the triangle only if the edge is a top or
+ * left edge, so pixels on an edge shared by two triangles are drawn once.
+ */
+static inline int on_top_left(float a, float b)
+{
+	return a > 0.0f || (a == 0.0f && b < 0.0f);
+}
+
+// Returns 0 if the triangle covers no pixel centre of s.
+static int tri_setup(const struct ksim_surface *s, const struct ksim_vtx v[3],
+		     struct ksim_tri *t)
+{
+	const struct ksim_vtx *p[3] = {&v[0], &v[1], &v[2]};
+	float sx[3], sy[3];
+	float area;
+	int i;
+
+	if (s->width <= 0 || s->height <= 0) {
+		return 0;
+	}
+
+	// NDC to window coordinates, y pointing down.
+	for (i = 0; i < 3; i++) {
+		float w = p[i]->w != 0.0f ? p[i]->w : 1.0f;
+
+		sx[i] = (p[i]->x / w + 1.0f) * 0.5f * s->width;
+		sy[i] = (1.0f - p[i]->y / w) * 0.5f * s->height;
+	}
+
+	area = (sx[1] - sx[0]) * (sy[2] - sy[0]) -
+	       (sy[1] - sy[0]) * (sx[2] - sx[0]);
+	if (area == 0.0f || isnan(area)) {
+		return 0;
+	}
+	// No culling: flip clockwise triangles around.
+	if (area < 0.0f) {
+		const struct ksim_vtx *tp = p[1];
+		float tmp;
+
+		p[1] = p[2];
+		p[2] = tp;
+		tmp = sx[1], sx[1] = sx[2], sx[2] = tmp;
+		tmp = sy[1], sy[1] = sy[2], sy[2] = tmp;
+		area = -area;
+	}
+	t->inv_area = 1.0f / area;
+
+	for (i = 0; i < 3; i++) {
+		int j = (i + 1) % 3, k = (i + 2) % 3;
+
+		t->ea[i] = sy[j] - sy[k];
+		t->eb[i] = sx[k] - sx[j];
+		t->ec[i] = sx[j] * sy[k] - sy[j] * sx[k];
+		t->tl[i] = on_top_left(t->ea[i], t->eb[i]);
+		t->r[i] = p[i]->r;
+		t->g[i] = p[i]->g;
+		t->b[i] = p[i]->b;
+	}
+
+	t->minx = (int)floorf(fminf(sx[0], fminf(sx[1], sx[2])));
+	t->maxx = (int)ceilf(fmaxf(sx[0], fmaxf(sx[1], sx[2])));
+	t->miny = (int)floorf(fminf(sy[0], fminf(sy[1], sy[2])));
+	t->maxy = (int)ceilf(fmaxf(sy[0], fmaxf(sy[1], sy[2])));
+	t->minx = t->minx < 0 ? 0 : t->minx;
+	t->miny = t->miny < 0 ? 0 : t->miny;
+	t->maxx = t->maxx > s->width - 1 ? s->width - 1 : t->maxx;
+	t->maxy = t->maxy > s->height - 1 ? s->height - 1 : t->maxy;
+	return t->minx <= t->maxx && t->miny <= t->maxy;
+}
+
+uint64_t ksim_raster_scalar(const struct ksim_surface *s,
+			    const struct ksim_tri *t)
+{
+	uint64_t n = 0;
+	int x, y, i;
+
+	for (y = t->miny; y <= t->maxy; y++) {
+		uint32_t *row = s->pixels + (size_t)y * s->pitch;
+		float py = y + 0.5f;
+
+		for (x = t->minx; x <= t->maxx; x++) {
+			float px = x + 0.5f;
+			float w[3], b0, b1, b2;
+
+			for (i = 0; i < 3; i++) {
+				w[i] = t->ea[i] * px + t->eb[i] * py + t->ec[i];
+				if (w[i] < 0.0f || (w[i] == 0.0f && !t->tl[i])) {
+					break;
+				}
+			}
+			if (i < 3) {
+				continue;
+			}
+
+			b0 = w[0] * t->inv_area;
+			b1 = w[1] * t->inv_area;
+			b2 = w[2] * t->inv_area;
+			row[x] = pack_rgb(
+			    b0 * t->r[0] + b1 * t->r[1] + b2 * t->r[2],
+			    b0 * t->g[0] + b1 * t->g[1] + b2 * t->g[2],
+			    b0 * t->b[0] + b1 * t->b[1] + b2 * t->b[2]);
+			n++;
+		}
+	}
+	return n;
+}
+
+static const struct {
+	const char *name;
+	ksim_raster_fn fn;
+	const char *cpu;
+} backends[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", ksim_raster_avx2, "avx2"},
+    {"sse2", ksim_raster_sse2, "sse2"},
+#endif
+    {"scalar", ksim_raster_scalar, NULL},
+};
+
+#define NBACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+static unsigned int backend = NBACKENDS - 1;
+
+static int cpu_has(const char *feature)
+{
+	if (!feature) {
+		return 1;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (strcmp(feature, "avx2") == 0) {
+		return __builtin_cpu_supports("avx2");
+	}
+	if (strcmp(feature, "sse2") == 0) {
+		return __builtin_cpu_supports("sse2");
+	}
+#endif
+	return 0;
+}
+
+static void pick_backend(void)
+{
+	const char *want = getenv("KSIM_RASTER");
+	unsigned int i;
+
+	for (i = 0; i < NBACKENDS; i++) {
+		if (!cpu_has(backends[i].cpu)) {
+			continue;
+		}
+		if (!want || strcmp(want, backends[i].name) == 0) {
+			backend = i;
+			return;
+		}
+	}
+}
+
+const char *ksim_raster_name(void)
+{
+	pthread_once(&backend_once, pick_backend);
+	return backends[backend].name;
+}
+
+uint64_t ksim_raster_triangle(const struct ksim_surface *s,
+			      const struct ksim_vtx v[3])
+{
+	struct ksim_tri t;
+
+	pthread_once(&backend_once, pick_backend);
+	if (!tri_setup(s, v, &t)) {
+		return 0;
+	}
+	return backends[backend].fn(s, &t);
+}
+
+uint64_t ksim_raster_triangle_ref(const struct ksim_surface *s,
+				  const struct ksim_vtx v[3])
+{
+	struct ksim_tri t;
+
+	if (!tri_setup(s, v, &t)) {
+		return 0;
+	}
+	return ksim_raster_scalar(s, &t);
+}
+
+/*
+ * Draw the triangle with the selected back end and compare the pixels it
+ * touched against the scalar reference. The bounding box is saved first,
+ * drawn with the reference, then restored and drawn again.
+ */
+uint64_t ksim_raster_check(const struct ksim_surface *s,
+			   const struct ksim_vtx v[3], uint64_t *mismatches)
+{
+	struct ksim_tri t;
+	uint32_t *save, *ref;
+	uint64_t n, nref, diff = 0;
+	size_t w, h, y, x;
+
+	pthread_once(&backend_once, pick_backend);
+	if (!tri_setup(s, v, &t)) {
+		return 0;
+	}
+	w = t.maxx - t.minx + 1;
+	h = t.maxy - t.miny + 1;
+	save = malloc(w * h * sizeof(*save));
+	ref = malloc(w * h * sizeof(*ref));
+	if (!save || !ref) {
+		free(save);
+		free(ref);
+		return backends[backend].fn(s, &t);
+	}
+
+#define BOX_ROW(y) (s->pixels + (size_t)(t.miny + (y)) * s->pitch + t.minx)
+	for (y = 0; y < h; y++) {
+		memcpy(save + y * w, BOX_ROW(y), w * sizeof(*save));
+	}
+	nref = ksim_raster_scalar(s, &t);
+	for (y = 0; y < h; y++) {
+		memcpy(ref + y * w, BOX_ROW(y), w * sizeof(*ref));
+		memcpy(BOX_ROW(y), save + y * w, w * sizeof(*save));
+	}
+	n = backends[backend].fn(s, &t);
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			diff += BOX_ROW(y)[x] != ref[y * w + x];
+		}
+	}
+#undef BOX_ROW
+	// A pixel redrawn with the colour it already had still counts.
+	*mismatches += diff ? diff : n != nref;
+	free(save);
+	free(ref);
+	return n;
+}
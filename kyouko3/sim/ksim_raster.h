@@ -0,0 +1,65 @@
+/*
+ * Internal interface between the triangle setup in ksim_raster.c and the
+ * rasterizer back ends.
+ */
+#ifndef KSIM_RASTER_H
+#define KSIM_RASTER_H
+
+#include "ksim.h"
+
+// Back ends walk the bounding box in square tiles of this many pixels.
+#define KSIM_TILE 8
+
+/*
+ * A triangle in window coordinates, wound counter-clockwise. Edge i is
+ * opposite vertex i, with e_i(x, y) = ea*x + eb*y + ec evaluated at pixel
+ * centres; a pixel with e_i == 0 is inside only if tl[i] is set. Every back
+ * end evaluates the edges and colours with the same operations in the same
+ * order, so they all produce the same pixels as the scalar one.
+ */
+struct ksim_tri {
+	float ea[3], eb[3], ec[3];
+	int tl[3];
+	float inv_area;
+	float r[3], g[3], b[3];
+	// Inclusive bounding box, clipped to the surface.
+	int minx, maxx, miny, maxy;
+};
+
+typedef uint64_t (*ksim_raster_fn)(const struct ksim_surface *s,
+				   const struct ksim_tri *t);
+
+uint64_t ksim_raster_scalar(const struct ksim_surface *s,
+			    const struct ksim_tri *t);
+#if defined(__x86_64__) || defined(__i386__)
+uint64_t ksim_raster_sse2(const struct ksim_surface *s,
+			  const struct ksim_tri *t);
+uint64_t ksim_raster_avx2(const struct ksim_surface *s,
+			  const struct ksim_tri *t);
+#endif
+
+/*
+ * True if no pixel centre of the tile at (tx, ty) can be inside. Only
+ * rejects when every edge test would fail by a margin well above float
+ * rounding, so skipping the tile never changes the result.
+ */
+static inline int ksim_tile_outside(const struct ksim_tri *t, int tx, int ty)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		// The corner pixel centre where the edge function is largest.
+		float x = tx + (t->ea[i] >= 0.0f ? KSIM_TILE - 0.5f : 0.5f);
+		float y = ty + (t->eb[i] >= 0.0f ? KSIM_TILE - 0.5f : 0.5f);
+		float ax = t->ea[i] * x, by = t->eb[i] * y;
+		float mag = (ax < 0 ? -ax : ax) + (by < 0 ? -by : by) +
+			    (t->ec[i] < 0 ? -t->ec[i] : t->ec[i]);
+
+		if (ax + by + t->ec[i] < -1e-5f * mag) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#endif
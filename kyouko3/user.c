@@ -18,8 +18,13 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
 
 #include "kyouko3.h"
+#include "k3cmd.h"
 
 // Debug macros
 
@@ -62,9 +67,16 @@ void fifo_queue(unsigned int cmd, unsigned int val) {
   ioctl(k3.fd, FIFO_QUEUE, &entry);
 }
 
+void fifo_queue_batch(struct fifo_entry *entries, int count) {
+  struct fifo_batch batch = {(unsigned long)entries, count, 0};
+  ioctl(k3.fd, FIFO_QUEUE_BATCH, &batch);
+}
+
 static inline void fifo_flush() {
   printf("flushing fifo\n");
-  ioctl(k3.fd, FIFO_FLUSH, 0);
+  if (ioctl(k3.fd, FIFO_FLUSH, 0) < 0) {
+    perror("FIFO_FLUSH");
+  }
 }
 
 void bind_dma(struct dma_req *req) {
@@ -72,7 +84,35 @@ void bind_dma(struct dma_req *req) {
   ioctl(k3.fd, BIND_DMA, (unsigned long)&req->u_base);
 }
 
-void start_dma(struct dma_req *req) { ioctl(k3.fd, START_DMA, &req->count); }
+// START_DMA reads the byte count and writes back the next buffer's address
+// through the same unsigned long.
+void start_dma(struct dma_req *req) {
+  unsigned long arg = req->count;
+  ioctl(k3.fd, START_DMA, &arg);
+  req->u_base = (unsigned int *)arg;
+}
+
+// Bind a DMA ring with a custom geometry. The driver writes back what it
+// actually chose.
+void bind_dma_geom(struct dma_req *req, struct kyouko3_dma_bind *bind) {
+  if (ioctl(k3.fd, BIND_DMA_GEOM, bind) < 0) {
+    perror("BIND_DMA_GEOM");
+  }
+  req->u_base = (unsigned int *)(unsigned long)bind->u_base;
+}
+
+// Submit the current buffer and return its fence.
+__u64 start_dma_fence(struct dma_req *req) {
+  struct kyouko3_dma_start start = {.count = req->count};
+  ioctl(k3.fd, START_DMA_FENCE, &start);
+  req->u_base = (unsigned int *)(unsigned long)start.next_buf;
+  return start.fence;
+}
+
+int wait_fence(__u64 fence, unsigned int timeout_ms) {
+  struct kyouko3_fence_wait fw = {.fence = fence, .timeout_ms = timeout_ms};
+  return ioctl(k3.fd, WAIT_FENCE, &fw);
+}
 
 void unbind_dma(void) {
   printf("unbind dma\n");
@@ -95,11 +135,21 @@ void user_exit() {
   close(k3.fd);
 }
 
+float rand_float(float min, float max) {
+  return (max - min) * ((((float)rand()) / (float)RAND_MAX)) + min;
+}
+
 unsigned int rand_f_range(float min, float max) {
-  float f = (max - min) * ((((float)rand()) / (float)RAND_MAX)) + min;
+  float f = rand_float(min, max);
   return *(unsigned int *)&f;
 }
 
+static unsigned int f2u(float f) {
+  unsigned int u;
+  memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
 unsigned int rand_col(void) { return rand_f_range(0, 1); }
 
 unsigned int rand_vtx(void) { return rand_f_range(-1, 1); }
@@ -120,20 +170,27 @@ void fifo_triangle() {
       {{0.125, 0.5, 0, 1.0}, {0, 0, 1.0, 0}},
   };
 
-  fifo_queue(COMMAND_PRIMITIVE, 1);
+  // The whole triangle goes down in a single FIFO_QUEUE_BATCH call.
+  struct fifo_entry cmds[32];
+  int n = 0;
+
+  cmds[n++] = (struct fifo_entry){COMMAND_PRIMITIVE, 1};
 
   for (int i = 0; i < 3; i++) {
     float *pos = triangle[i][0];
     float *col = triangle[i][1];
 
     for (int j = 0; j < 4; j++) {
-      fifo_queue(VERTEX_COORD + 4 * j, *(unsigned int *)&pos[j]);
-      fifo_queue(VERTEX_COLOR + 4 * j, *(unsigned int *)&col[j]);
+      cmds[n++] = (struct fifo_entry){VERTEX_COORD + 4 * j,
+                                      *(unsigned int *)&pos[j]};
+      cmds[n++] = (struct fifo_entry){VERTEX_COLOR + 4 * j,
+                                      *(unsigned int *)&col[j]};
     }
-    fifo_queue(VERTEX_EMIT, 0);
+    cmds[n++] = (struct fifo_entry){VERTEX_EMIT, 0};
   }
-  fifo_queue(COMMAND_PRIMITIVE, 0);
-  fifo_queue(RASTER_FLUSH, 0);
+  cmds[n++] = (struct fifo_entry){COMMAND_PRIMITIVE, 0};
+  cmds[n++] = (struct fifo_entry){RASTER_FLUSH, 0};
+  fifo_queue_batch(cmds, n);
   fifo_flush();
 
   sleep(2);
@@ -165,17 +222,33 @@ void dma_triangles() {
   sleep(2);
   gfx_on();
 
-  struct dma_req req;
-
-  bind_dma(&req);
-
-  for (int i = 0; i < 1000; i++) {
-    gen_dma_triangles(&req, 2);
-    start_dma(&req);
-    fifo_queue(RASTER_FLUSH, 0);
+  // 2000 random triangles, packed into as few buffers as they fit in.
+  struct k3cmd c;
+  if (k3cmd_init(&c, k3.fd, NULL) < 0) {
+    perror("k3cmd_init");
+    return;
+  }
+  for (int i = 0; i < 2000; i++) {
+    unsigned int n = 1;
+    struct k3_vtx_rgb_xyz *v = k3cmd_tris(&c, K3_VTX_RGB_XYZ, &n);
+    if (!v) {
+      perror("k3cmd_tris");
+      break;
+    }
+    for (int j = 0; j < 3; j++) {
+      v[j] = (struct k3_vtx_rgb_xyz){rand_float(0, 1), rand_float(0, 1),
+                                     rand_float(0, 1), rand_float(-1, 1),
+                                     rand_float(-1, 1), rand_float(-1, 1)};
+    }
+  }
+  if (k3cmd_finish(&c, 5000) < 0) {
+    perror("k3cmd_finish");
   }
+  printf("%llu dma buffers submitted\n",
+         (unsigned long long)c.bufs_submitted);
+  fifo_queue(RASTER_FLUSH, 0);
   fifo_flush();
-  unbind_dma();
+  k3cmd_fini(&c);
 
   sleep(6);
   gfx_off();
@@ -195,7 +268,8 @@ int demos() {
 
 void test_fifo_stress_simple() {
   // Works most of the time. However, sometimes K_WRITE_REG fifo_head
-  // doesn't seem to work, and it ends up in an infinite loop.
+  // doesn't seem to work. FIFO_FLUSH then times out with ETIMEDOUT instead
+  // of hanging.
   for (int i=0; i < 100; i++) {
     fifo_triangle();
   }
@@ -233,17 +307,1599 @@ void test_dma_bind_close() {
   user_exit();
 }
 
+void test_two_clients_dma() {
+  // Two processes stream DMA at the same time, each with its own buffers.
+  PFN();
+  pid_t pid = fork();
+  user_init();
+  gfx_on();
+  struct dma_req req;
+  bind_dma(&req);
+  for (int i = 0; i < 500; i++) {
+    gen_dma_triangles(&req, 2);
+    start_dma(&req);
+  }
+  fifo_flush();
+  unbind_dma();
+  user_exit();
+  if (pid == 0) {
+    exit(0);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+void test_dma_fence() {
+  // Waiting on the last fence should cover every earlier buffer, and read()
+  // should report it as the latest completion. poll() should find the file
+  // readable until it has.
+  PFN();
+  user_init();
+  gfx_on();
+  struct dma_req req;
+  struct pollfd pfd = {.fd = k3.fd, .events = POLLIN};
+  __u64 fence = 0, done = 0;
+  int bad = 0;
+  bind_dma(&req);
+  for (int i = 0; i < 100; i++) {
+    gen_dma_triangles(&req, 2);
+    fence = start_dma_fence(&req);
+  }
+  if (wait_fence(fence, 1000) < 0) {
+    perror("WAIT_FENCE");
+    bad++;
+  }
+  bad += poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN);
+  if (read(k3.fd, &done, sizeof(done)) != sizeof(done)) {
+    perror("read");
+  }
+  bad += done != fence;
+  bad += poll(&pfd, 1, 0) != 0;
+  printf("last fence %llu, read %llu, %d wrong\n", fence, done, bad);
+  unbind_dma();
+  user_exit();
+}
+
+void test_dma_geom() {
+  // A shallow ring that is not a power of two, with small buffers.
+  PFN();
+  user_init();
+  gfx_on();
+  struct dma_req req;
+  struct kyouko3_dma_bind bind = {.nbufs = 3, .bufsize = 16 * 1024};
+  bind_dma_geom(&req, &bind);
+  printf("bound %u buffers of %u bytes\n", bind.nbufs, bind.bufsize);
+  for (int i = 0; i < 100; i++) {
+    gen_dma_triangles(&req, 2);
+    start_dma(&req);
+  }
+  unbind_dma();
+  user_exit();
+}
+
+void test_dma_rebind() {
+  // Binding again with the same geometry must give back the same buffers,
+  // at the same address unless the client unmapped them, and a ring must
+  // work whether its buffers are new, reused or pooled. Buffers the client
+  // still maps itself cannot be replaced.
+  PFN();
+  user_init();
+  gfx_on();
+  struct dma_req req;
+  struct kyouko3_dma_bind geom[] = {{.nbufs = 4, .bufsize = 16 * 1024},
+                                    {.nbufs = 4, .bufsize = 16 * 1024},
+                                    {.nbufs = 4, .bufsize = 16 * 1024},
+                                    {.nbufs = 3, .bufsize = 16 * 1024},
+                                    {.nbufs = 4, .bufsize = 16 * 1024}};
+  __u64 first = 0;
+  int bad = 0;
+  for (int i = 0; i < 5; i++) {
+    __u64 fence = 0;
+    if (i == 3) {
+      // The client's own mapping of the 4-buffer ring holds it.
+      void *own = mmap(0, 4 * 16 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       k3.fd, VM_PGOFF_DMA);
+      bad += own == MAP_FAILED;
+      bad += ioctl(k3.fd, BIND_DMA_GEOM, &geom[3]) != -1 || errno != EBUSY;
+      munmap(own, 4 * 16 * 1024);
+    }
+    bind_dma_geom(&req, &geom[i]);
+    if (!req.u_base) {
+      bad++;
+      break;
+    }
+    if (i == 0) {
+      first = geom[0].u_base;
+    } else if (i == 1) {
+      bad += geom[1].u_base != first;
+    }
+    for (int j = 0; j < 20; j++) {
+      gen_dma_triangles(&req, 2);
+      fence = start_dma_fence(&req);
+    }
+    bad += wait_fence(fence, 1000) < 0;
+    ioctl(k3.fd, UNBIND_DMA, 0);
+    if (i == 1) {
+      // The driver must map the buffers again rather than trust the old
+      // address.
+      munmap((void *)(unsigned long)first, 4 * 16 * 1024);
+    }
+  }
+  printf("5 binds, %d wrong\n", bad);
+  user_exit();
+}
+
+void test_dma_large() {
+  // The largest buffers fit a full ring and run when packed end to end with
+  // packets.
+  PFN();
+  user_init();
+  gfx_on();
+  struct dma_req req;
+  struct kyouko3_dma_bind bind = {.nbufs = 4, .bufsize = DMA_BUFSIZE_MAX};
+  __u64 fence = 0;
+  int bad = 0;
+  bind_dma_geom(&req, &bind);
+  if (!req.u_base) {
+    user_exit();
+    return;
+  }
+  bad += bind.nbufs != 4 || bind.bufsize != DMA_BUFSIZE_MAX;
+  for (int i = 0; i < 2; i++) {
+    size_t len, n;
+    // Zero-area triangles, so the card's time goes to reading the buffer.
+    gen_dma_triangles(&req, 100);
+    for (int v = 0; v < 300; v++) {
+      memset(req.u_base + 1 + v * 6 + 3, 0, 3 * sizeof(unsigned int));
+    }
+    len = req.count;
+    for (n = 1; (n + 1) * len <= bind.bufsize; n++) {
+      memcpy((char *)req.u_base + n * len, req.u_base, len);
+    }
+    req.count = n * len;
+    fence = start_dma_fence(&req);
+  }
+  bad += wait_fence(fence, 1000) < 0;
+  printf("bound %u buffers of %u bytes, %d wrong\n", bind.nbufs,
+         bind.bufsize, bad);
+  unbind_dma();
+  user_exit();
+}
+
+void test_dma_nonblock() {
+  // With O_NONBLOCK a full ring returns EAGAIN, and poll() reports POLLOUT
+  // once the card frees a buffer.
+  PFN();
+  user_init();
+  gfx_on();
+  struct dma_req req;
+  int eagain = 0;
+  bind_dma(&req);
+  fcntl(k3.fd, F_SETFL, fcntl(k3.fd, F_GETFL) | O_NONBLOCK);
+  for (int i = 0; i < 200; i++) {
+    gen_dma_triangles(&req, 2);
+    unsigned long arg = req.count;
+    while (ioctl(k3.fd, START_DMA, &arg) < 0 && errno == EAGAIN) {
+      struct pollfd pfd = {.fd = k3.fd, .events = POLLOUT};
+      eagain++;
+      poll(&pfd, 1, 1000);
+    }
+    req.u_base = (unsigned int *)arg;
+  }
+  printf("ring full %d times\n", eagain);
+  fcntl(k3.fd, F_SETFL, fcntl(k3.fd, F_GETFL) & ~O_NONBLOCK);
+  unbind_dma();
+  user_exit();
+}
+
+void test_k3cmd_rollover() {
+  // Small buffers force the builder to roll over, and mixing vertex formats
+  // packs several packets into each buffer.
+  PFN();
+  user_init();
+  gfx_on();
+  struct k3cmd c;
+  struct kyouko3_dma_bind bind = {.nbufs = 3, .bufsize = 4096};
+  if (k3cmd_init(&c, k3.fd, &bind) < 0) {
+    perror("k3cmd_init");
+    user_exit();
+    return;
+  }
+  for (int i = 0; i < 1000; i++) {
+    unsigned int n = 1;
+    if (i % 10 == 0) {
+      struct k3_vtx_rgb_xyzw *v = k3cmd_tris(&c, K3_VTX_RGB_XYZW, &n);
+      for (int j = 0; j < 3; j++) {
+        v[j] = (struct k3_vtx_rgb_xyzw){1, 1, 1, rand_float(-1, 1),
+                                        rand_float(-1, 1), 0, 1};
+      }
+    } else {
+      struct k3_vtx_rgb_xyz *v = k3cmd_tris(&c, K3_VTX_RGB_XYZ, &n);
+      for (int j = 0; j < 3; j++) {
+        v[j] = (struct k3_vtx_rgb_xyz){rand_float(0, 1), 0, 0,
+                                       rand_float(-1, 1), rand_float(-1, 1),
+                                       0};
+      }
+    }
+  }
+  if (k3cmd_finish(&c, 1000) < 0) {
+    perror("k3cmd_finish");
+  }
+  printf("%llu buffers, %llu bytes\n", (unsigned long long)c.bufs_submitted,
+         (unsigned long long)c.bytes_submitted);
+  k3cmd_fini(&c);
+  user_exit();
+}
+
+void test_pack_soa() {
+  // The packer must match a plain interleave at every start alignment it
+  // accepts and for lengths that leave a partial SIMD group.
+  PFN();
+  enum { N = 61 };
+  float arr[6][N];
+  __u32 out[N * 6 + 8] __attribute__((aligned(32)));
+  struct k3_soa a = {arr[3], arr[4], arr[5], arr[0], arr[1], arr[2]};
+  int bad = 0;
+
+  for (int i = 0; i < 6; i++) {
+    for (int j = 0; j < N; j++) {
+      arr[i][j] = rand_float(-1, 1);
+    }
+  }
+  for (int off = 0; off < 8; off += 2) {
+    for (int first = 0; first < 3; first++) {
+      __u32 *dst = out + off;
+      int n = N - first;
+      k3_pack_rgb_xyz(dst, &a, first, n);
+      for (int j = 0; j < n; j++) {
+        for (int w = 0; w < 6; w++) {
+          bad += memcmp(&dst[j * 6 + w], &arr[w][first + j], 4) != 0;
+        }
+      }
+    }
+  }
+  printf("%s: %d words wrong\n", k3_pack_name(), bad);
+}
+
+struct ticket_worker {
+  pthread_t thread;
+  struct k3cmd c;
+  int delay_ms;
+  int ret;
+};
+
+static void *ticket_worker(void *arg) {
+  struct ticket_worker *w = arg;
+  struct k3_vtx_rgb_xyz v[3 * 8];
+  for (int i = 0; i < 3 * 8; i++) {
+    v[i] = (struct k3_vtx_rgb_xyz){0, rand_float(0, 1), 0, rand_float(-1, 1),
+                                   rand_float(-1, 1), 0};
+  }
+  usleep(w->delay_ms * 1000);
+  w->ret = k3cmd_emit(&w->c, K3_VTX_RGB_XYZ, v, 8);
+  if (k3cmd_submit(&w->c) < 0) {
+    w->ret = -1;
+  }
+  return NULL;
+}
+
+void test_dma_tickets() {
+  // Tickets are taken in order on this thread, then workers record and
+  // submit them in reverse. Each fence must still follow its ticket, and
+  // START_DMA must refuse to jump the queue while tickets are held.
+  PFN();
+  user_init();
+  gfx_on();
+  enum { N = 4 };
+  struct k3cmd c;
+  struct ticket_worker w[N];
+  struct kyouko3_dma_bind bind = {.nbufs = 8};
+  unsigned long arg = 4;
+  int bad = 0;
+  if (k3cmd_init(&c, k3.fd, &bind) < 0) {
+    perror("k3cmd_init");
+    user_exit();
+    return;
+  }
+  for (int i = 0; i < N; i++) {
+    k3cmd_init_worker(&w[i].c, &c);
+    if (k3cmd_acquire(&w[i].c) < 0) {
+      perror("k3cmd_acquire");
+    }
+    w[i].delay_ms = 10 * (N - i);
+  }
+  if (ioctl(k3.fd, START_DMA, &arg) == 0 || errno != EBUSY) {
+    printf("START_DMA with tickets held did not fail with EBUSY\n");
+    bad++;
+  }
+  for (int i = 0; i < N; i++) {
+    pthread_create(&w[i].thread, NULL, ticket_worker, &w[i]);
+  }
+  for (int i = 0; i < N; i++) {
+    pthread_join(w[i].thread, NULL);
+    bad += w[i].ret < 0 || w[i].c.fence != w[i].c.ticket + 1;
+  }
+  if (k3cmd_finish(&w[N - 1].c, 1000) < 0) {
+    perror("k3cmd_finish");
+    bad++;
+  }
+  printf("%d workers, %d wrong\n", N, bad);
+  k3cmd_fini(&c);
+  user_exit();
+}
+
+void test_dma_submit_batch() {
+  // Several buffers handed over in one SUBMIT_DMA_BATCH, one of them empty.
+  // A batch naming a ticket twice must be refused as a whole.
+  PFN();
+  user_init();
+  gfx_on();
+  enum { N = 4 };
+  struct k3cmd c, w[N], *ws[N];
+  struct kyouko3_dma_bind bind = {.nbufs = 8, .bufsize = 4096};
+  int bad = 0;
+  if (k3cmd_init(&c, k3.fd, &bind) < 0) {
+    perror("k3cmd_init");
+    user_exit();
+    return;
+  }
+  for (int i = 0; i < N; i++) {
+    k3cmd_init_worker(&w[i], &c);
+    k3cmd_acquire(&w[i]);
+    ws[i] = &w[i];
+  }
+  struct kyouko3_dma_submit dup[2] = {{.ticket = w[0].ticket},
+                                      {.ticket = w[0].ticket}};
+  struct kyouko3_dma_submit_batch batch = {.subs = (unsigned long)dup,
+                                           .count = 2};
+  if (ioctl(k3.fd, SUBMIT_DMA_BATCH, &batch) == 0 || errno != EINVAL) {
+    printf("duplicate ticket accepted\n");
+    bad++;
+  }
+  for (int i = 1; i < N; i++) {
+    for (int j = 0; j < 20; j++) {
+      unsigned int n = 1;
+      struct k3_vtx_rgb_xyz *v = k3cmd_tris(&w[i], K3_VTX_RGB_XYZ, &n);
+      for (int k = 0; k < 3; k++) {
+        v[k] = (struct k3_vtx_rgb_xyz){0, 0, rand_float(0, 1),
+                                       rand_float(-1, 1), rand_float(-1, 1),
+                                       0};
+      }
+    }
+  }
+  if (k3cmd_submit_batch(ws, N) < 0) {
+    perror("k3cmd_submit_batch");
+    bad++;
+  }
+  for (int i = 0; i < N; i++) {
+    bad += w[i].base != NULL || w[i].fence != w[i].ticket + 1;
+  }
+  if (k3cmd_finish(&w[N - 1], 1000) < 0) {
+    perror("k3cmd_finish");
+    bad++;
+  }
+  printf("%d buffers, %d wrong\n", N, bad);
+  k3cmd_fini(&c);
+  user_exit();
+}
+
+void test_dma_ring() {
+  // Buffers go through the shared submission ring; every one of them must
+  // come back on the completion ring, in order, and the legacy ioctls must
+  // stay out of the way.
+  PFN();
+  user_init();
+  gfx_on();
+  struct k3cmd c;
+  struct kyouko3_dma_bind bind = {.nbufs = 4, .bufsize = 4096};
+  struct k3_vtx_rgb_xyz v[3 * 40];
+  __u64 fences[K3_RING_CQ_ENTRIES], expect;
+  unsigned long arg = 4;
+  int bad = 0;
+  __u64 done = 0;
+  if (k3cmd_init_ring(&c, k3.fd, &bind) < 0) {
+    perror("k3cmd_init_ring");
+    user_exit();
+    return;
+  }
+  expect = c.ring->fence_base + 1;
+  if (ioctl(k3.fd, START_DMA, &arg) == 0 || errno != EBUSY) {
+    printf("START_DMA on a ring did not fail with EBUSY\n");
+    bad++;
+  }
+  for (int i = 0; i < 3 * 40; i++) {
+    v[i] = (struct k3_vtx_rgb_xyz){rand_float(0, 1), rand_float(0, 1), 0,
+                                   rand_float(-1, 1), rand_float(-1, 1), 0};
+  }
+  for (int i = 0; i < 100; i++) {
+    if (k3cmd_emit(&c, K3_VTX_RGB_XYZ, v, 40) < 0) {
+      perror("k3cmd_emit");
+      bad++;
+      break;
+    }
+    unsigned int n = k3cmd_reap(&c, fences, K3_RING_CQ_ENTRIES);
+    for (unsigned int j = 0; j < n; j++) {
+      bad += fences[j] != expect++;
+    }
+    done += n;
+  }
+  if (k3cmd_finish(&c, 1000) < 0) {
+    perror("k3cmd_finish");
+    bad++;
+  }
+  unsigned int n = k3cmd_reap(&c, fences, K3_RING_CQ_ENTRIES);
+  for (unsigned int j = 0; j < n; j++) {
+    bad += fences[j] != expect++;
+  }
+  done += n;
+  bad += done != c.bufs_submitted || c.ring->cq_overflow != 0;
+  printf("%llu buffers, %llu completions, %llu wakeups, %d wrong\n",
+         (unsigned long long)c.bufs_submitted, (unsigned long long)done,
+         (unsigned long long)c.wakeups, bad);
+  k3cmd_fini(&c);
+  user_exit();
+}
+
+void test_blit() {
+  // Upload a pattern from a padded buffer, fill a rectangle over part of it,
+  // and read the whole area back.
+  PFN();
+  user_init();
+  gfx_on();
+  enum { W = 300, H = 200, PAD = 7 };
+  unsigned int *src = malloc((W + PAD) * H * 4);
+  unsigned int *dst = malloc(W * H * 4);
+  int bad = 0;
+  for (int i = 0; i < (W + PAD) * H; i++) {
+    src[i] = rand() & 0xffffff;
+  }
+  struct kyouko3_blit up = {.data = (unsigned long)src, .op = K3_BLIT_UPLOAD,
+                            .data_pitch = (W + PAD) * 4, .x = 10, .y = 20,
+                            .width = W, .height = H};
+  struct kyouko3_blit fill = {.op = K3_BLIT_FILL, .x = 60, .y = 70,
+                              .width = 50, .height = 40, .color = 0xabcdef};
+  struct kyouko3_blit rd = {.data = (unsigned long)dst, .op = K3_BLIT_READ,
+                            .x = 10, .y = 20, .width = W, .height = H};
+  if (ioctl(k3.fd, BLIT, &up) < 0 || ioctl(k3.fd, BLIT, &fill) < 0 ||
+      ioctl(k3.fd, BLIT, &rd) < 0) {
+    perror("BLIT");
+    bad++;
+  }
+  for (int y = 0; y < H; y++) {
+    for (int x = 0; x < W; x++) {
+      int filled = x >= 50 && x < 100 && y >= 50 && y < 90;
+      bad += dst[y * W + x] !=
+             (filled ? 0xabcdef : src[y * (W + PAD) + x]);
+    }
+  }
+  // The mapping of device RAM must agree.
+  bad += k3.u_fb_base[20 * 1024 + 10] != src[0];
+  printf("%d pixels, %d wrong\n", W * H, bad);
+  free(src);
+  free(dst);
+  user_exit();
+}
+
+void test_capture() {
+  // More captures than can be in flight, each of a different rectangle into
+  // its own slot of the capture buffer, checked against what was uploaded.
+  PFN();
+  user_init();
+  gfx_on();
+  enum { W = 64, H = 48, N = K3_CAPTURE_DEPTH + 4 };
+  unsigned int *src = malloc(1024 * 768 * 4);
+  struct kyouko3_capture_setup cs = {.size = N * W * H * 4};
+  struct kyouko3_capture c[N];
+  int bad = 0;
+  for (int i = 0; i < 1024 * 768; i++) {
+    src[i] = rand() & 0xffffff;
+  }
+  struct kyouko3_blit up = {.data = (unsigned long)src, .op = K3_BLIT_UPLOAD,
+                            .width = 1024, .height = 768};
+  if (ioctl(k3.fd, BLIT, &up) < 0 || ioctl(k3.fd, SETUP_CAPTURE, &cs) < 0) {
+    perror("SETUP_CAPTURE");
+    free(src);
+    user_exit();
+    return;
+  }
+  const unsigned int *cap = (const unsigned int *)(unsigned long)cs.u_base;
+  for (int i = 0; i < N; i++) {
+    c[i] = (struct kyouko3_capture){
+        .rect = {.x = 13 * i, .y = 7 * i, .width = W, .height = H},
+        .buf_offset = i * W * H * 4};
+    if (ioctl(k3.fd, CAPTURE, &c[i]) < 0) {
+      perror("CAPTURE");
+      bad++;
+    }
+  }
+  struct kyouko3_capture_wait cw = {.seq = c[N - 1].seq, .timeout_ms = 1000};
+  if (ioctl(k3.fd, CAPTURE_WAIT, &cw) < 0) {
+    perror("CAPTURE_WAIT");
+    bad++;
+  }
+  // The first capture's outcome has been dropped by now.
+  cw.seq = c[0].seq;
+  bad += ioctl(k3.fd, CAPTURE_WAIT, &cw) == 0 || errno != ESTALE;
+  for (int i = 0; i < N; i++) {
+    bad += c[i].seq != c[0].seq + i;
+    for (int y = 0; y < H; y++) {
+      for (int x = 0; x < W; x++) {
+        bad += cap[i * W * H + y * W + x] !=
+               src[(7 * i + y) * 1024 + 13 * i + x];
+      }
+    }
+  }
+  printf("%d captures, %d wrong\n", N, bad);
+  cs.size = 0;
+  ioctl(k3.fd, SETUP_CAPTURE, &cs);
+  free(src);
+  user_exit();
+}
+
+void test_vram() {
+  // Blocks of several sizes and alignments must not overlap each other or the
+  // screen, and must hold what is copied into them.
+  PFN();
+  user_init();
+  gfx_on();
+  struct kyouko3_vram_stats st0, st;
+  struct kyouko3_vram_alloc va[4] = {{.size = 100000},
+                                     {.size = 4096, .align = 65536},
+                                     {.size = 1000, .align = 4096}};
+  unsigned int src[64 * 16], dst[64 * 16];
+  int bad = 0;
+  ioctl(k3.fd, VRAM_STATS, &st0);
+  for (int i = 0; i < 3; i++) {
+    if (ioctl(k3.fd, VRAM_ALLOC, &va[i]) < 0) {
+      perror("VRAM_ALLOC");
+      user_exit();
+      return;
+    }
+    unsigned int align = va[i].align ? va[i].align : K3_VRAM_ALIGN;
+    bad += va[i].offset % align != 0 || va[i].offset < 1024 * 768 * 4 ||
+           va[i].offset + va[i].size > st0.total;
+    for (int j = 0; j < i; j++) {
+      bad += va[i].offset < va[j].offset + va[j].size &&
+             va[j].offset < va[i].offset + va[i].size;
+    }
+  }
+  ioctl(k3.fd, VRAM_STATS, &st);
+  bad += st.allocs != st0.allocs + 3 || st.used < st0.used + 105096;
+
+  for (int i = 0; i < 64 * 16; i++) {
+    src[i] = rand();
+  }
+  struct kyouko3_blit up = {.data = (unsigned long)src, .op = K3_BLIT_UPLOAD,
+                            .offset = va[1].offset, .pitch = 64 * 4,
+                            .width = 64, .height = 16};
+  struct kyouko3_blit rd = up;
+  rd.data = (unsigned long)dst;
+  rd.op = K3_BLIT_READ;
+  if (ioctl(k3.fd, BLIT, &up) < 0 || ioctl(k3.fd, BLIT, &rd) < 0) {
+    perror("BLIT");
+    bad++;
+  }
+  bad += memcmp(src, dst, sizeof(src)) != 0;
+
+  // Too big, then everything that is left.
+  va[3].size = st.total;
+  bad += ioctl(k3.fd, VRAM_ALLOC, &va[3]) != -1 || errno != ENOSPC;
+  va[3].size = st.largest_free;
+  bad += ioctl(k3.fd, VRAM_ALLOC, &va[3]) < 0;
+
+  for (int i = 0; i < 4; i++) {
+    bad += ioctl(k3.fd, VRAM_FREE, va[i].handle) < 0;
+  }
+  bad += ioctl(k3.fd, VRAM_FREE, va[0].handle) != -1 || errno != EINVAL;
+  ioctl(k3.fd, VRAM_STATS, &st);
+  bad += st.used != st0.used || st.allocs != st0.allocs ||
+         st.peak < st0.used + 105096;
+  printf("%u of %u bytes free in the largest gap, %d wrong\n",
+         st.largest_free, st.total, bad);
+  user_exit();
+}
+
+void test_list() {
+  // A list that clears the screen and draws one full-screen triangle, replayed
+  // with its vertex colours patched between replays.
+  PFN();
+  user_init();
+  gfx_on();
+  struct fifo_entry e[] = {{CLEAR_COLOR, f2u(0.5f)},
+                           {CLEAR_COLOR + 4, f2u(0.5f)},
+                           {CLEAR_COLOR + 8, f2u(0.5f)},
+                           {CLEAR_COLOR + 12, 0},
+                           {RASTER_CLEAR, 3}};
+  float xy[3][2] = {{-1, -1}, {3, -1}, {-1, 3}};
+  unsigned int data[1 + 3 * 6];
+  struct kyouko3_dma_hdr hdr = {
+      .stride = 5, .rgb = 1, .b12 = 1, .opcode = 0x14, .count = 3};
+  int bad = 0;
+  memcpy(&data[0], &hdr, 4);
+  for (int i = 0; i < 3; i++) {
+    unsigned int *v = &data[1 + 6 * i];
+    v[0] = v[1] = v[2] = f2u(0);
+    v[3] = f2u(xy[i][0]);
+    v[4] = f2u(xy[i][1]);
+    v[5] = f2u(0);
+  }
+  struct kyouko3_list kl = {.entries = (unsigned long)e,
+                            .data = (unsigned long)data,
+                            .count = sizeof(e) / sizeof(e[0]),
+                            .size = sizeof(data)};
+  if (ioctl(k3.fd, LIST_CREATE, &kl) < 0) {
+    perror("LIST_CREATE");
+    user_exit();
+    return;
+  }
+  unsigned int want[3] = {0xff0000, 0x00ff00, 0x0000ff};
+  for (int i = 0; i < 30; i++) {
+    // Colour channel i % 3 on, the others off.
+    struct kyouko3_list_patch p[9];
+    for (int j = 0; j < 9; j++) {
+      p[j] = (struct kyouko3_list_patch){
+          .offset = 4 * (1 + 6 * (j / 3) + j % 3),
+          .value = f2u(j % 3 == i % 3 ? 1.0f : 0.0f)};
+    }
+    struct kyouko3_list_replay r = {.patches = (unsigned long)p,
+                                    .handle = kl.handle, .npatches = 9};
+    if (ioctl(k3.fd, LIST_REPLAY, &r) < 0) {
+      perror("LIST_REPLAY");
+      bad++;
+      break;
+    }
+    // A replay without patches queues behind the one before, and the flush
+    // waits for both.
+    r.npatches = 0;
+    ioctl(k3.fd, LIST_REPLAY, &r);
+    fifo_queue(RASTER_FLUSH, 0);
+    fifo_flush();
+    bad += (k3.u_fb_base[384 * 1024 + 512] & 0xffffff) != want[i % 3];
+  }
+  struct kyouko3_list_replay r = {.handle = kl.handle};
+  bad += ioctl(k3.fd, LIST_DESTROY, kl.handle) < 0;
+  bad += ioctl(k3.fd, LIST_REPLAY, &r) != -1 || errno != EINVAL;
+  printf("30 replays, %d wrong\n", bad);
+  user_exit();
+}
+
+void test_bo() {
+  // Three resident buffer objects, each a full-screen triangle of one colour,
+  // submitted out of creation order and more than once.
+  PFN();
+  user_init();
+  gfx_on();
+  enum { N = 3 };
+  struct kyouko3_bo bo[N];
+  unsigned int want[N] = {0xff0000, 0x00ff00, 0x0000ff};
+  float xy[3][2] = {{-1, -1}, {3, -1}, {-1, 3}};
+  struct kyouko3_dma_hdr hdr = {
+      .stride = 5, .rgb = 1, .b12 = 1, .opcode = 0x14, .count = 3};
+  int bad = 0;
+  for (int i = 0; i < N; i++) {
+    bo[i] = (struct kyouko3_bo){.size = 19 * 4};
+    if (ioctl(k3.fd, BO_CREATE, &bo[i]) < 0) {
+      perror("BO_CREATE");
+      user_exit();
+      return;
+    }
+    unsigned int *p = mmap(0, bo[i].size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           k3.fd, bo[i].offset);
+    if (p == MAP_FAILED) {
+      perror("mmap");
+      user_exit();
+      return;
+    }
+    memcpy(p, &hdr, 4);
+    for (int j = 0; j < 3; j++) {
+      unsigned int *v = &p[1 + 6 * j];
+      for (int c = 0; c < 3; c++) {
+        v[c] = f2u(c == i ? 1.0f : 0.0f);
+      }
+      v[3] = f2u(xy[j][0]);
+      v[4] = f2u(xy[j][1]);
+      v[5] = f2u(0);
+    }
+    munmap(p, bo[i].size);
+    bad += i > 0 && bo[i].offset == bo[i - 1].offset;
+  }
+  for (int i = 0; i < 3 * N; i++) {
+    int n = (2 * i + 1) % N;
+    struct kyouko3_bo_submit sub = {.handle = bo[n].handle, .count = 19 * 4};
+    if (ioctl(k3.fd, BO_SUBMIT, &sub) < 0) {
+      perror("BO_SUBMIT");
+      bad++;
+      break;
+    }
+    struct kyouko3_bo_wait bw = {.handle = bo[n].handle, .timeout_ms = 1000};
+    bad += ioctl(k3.fd, BO_WAIT, &bw) < 0;
+    fifo_queue(RASTER_FLUSH, 0);
+    fifo_flush();
+    bad += (k3.u_fb_base[384 * 1024 + 512] & 0xffffff) != want[n];
+  }
+  // A submission still queued when its buffer object is destroyed must
+  // still run.
+  struct kyouko3_bo_submit last = {.handle = bo[0].handle, .count = 19 * 4};
+  bad += ioctl(k3.fd, BO_SUBMIT, &last) < 0;
+  for (int i = 0; i < N; i++) {
+    bad += ioctl(k3.fd, BO_DESTROY, bo[i].handle) < 0;
+  }
+  fifo_queue(RASTER_FLUSH, 0);
+  fifo_flush();
+  bad += (k3.u_fb_base[384 * 1024 + 512] & 0xffffff) != want[0];
+  struct kyouko3_bo_submit sub = {.handle = bo[0].handle, .count = 4};
+  bad += ioctl(k3.fd, BO_SUBMIT, &sub) != -1 || errno != EINVAL;
+  printf("%d submissions, %d wrong\n", 3 * N, bad);
+  user_exit();
+}
+
+void test_flip() {
+  // Triple buffering: every frame is one full-screen triangle of its own
+  // colour, drawn with DMA and then flipped. The flips must run in order and
+  // each surface must end up with the last frame drawn into it.
+  PFN();
+  user_init();
+  gfx_on();
+  enum { N = 12 };
+  struct k3cmd c;
+  struct kyouko3_flip_setup fs = {.nbufs = 3};
+  struct kyouko3_flip fl = {0};
+  unsigned int want[3] = {0xff0000, 0x00ff00, 0x0000ff};
+  float xy[3][2] = {{-1, -1}, {3, -1}, {-1, 3}};
+  int bad = 0;
+  if (k3cmd_init(&c, k3.fd, NULL) < 0) {
+    perror("k3cmd_init");
+    user_exit();
+    return;
+  }
+  if (ioctl(k3.fd, SETUP_FLIP, &fs) < 0) {
+    perror("SETUP_FLIP");
+    k3cmd_fini(&c);
+    user_exit();
+    return;
+  }
+  unsigned int size = fs.size;
+  bad += ioctl(k3.fd, SETUP_FLIP, &fs) != -1 || errno != EBUSY;
+  for (int i = 0; i < N; i++) {
+    struct k3_vtx_rgb_xyz v[3];
+    for (int j = 0; j < 3; j++) {
+      v[j] = (struct k3_vtx_rgb_xyz){i % 3 == 0, i % 3 == 1, i % 3 == 2,
+                                     xy[j][0], xy[j][1], 0};
+    }
+    if (k3cmd_emit(&c, K3_VTX_RGB_XYZ, v, 1) < 0 || k3cmd_submit(&c) < 0) {
+      perror("k3cmd_submit");
+      bad++;
+      break;
+    }
+    if (ioctl(k3.fd, FLIP, &fl) < 0) {
+      perror("FLIP");
+      bad++;
+      break;
+    }
+    bad += fl.seq != (__u64)i + 1 || fl.back != (i + 2) % 3u;
+  }
+  struct kyouko3_flip_wait fw = {.seq = fl.seq, .timeout_ms = 1000};
+  if (ioctl(k3.fd, FLIP_WAIT, &fw) < 0) {
+    perror("FLIP_WAIT");
+    bad++;
+  }
+  // Frame i was drawn into surface (i + 1) % 3.
+  for (int s = 0; s < 3; s++) {
+    int i = N - 3 + (s + 2) % 3;
+    bad += (k3.u_fb_base[s * size / 4 + 384 * 1024 + 512] & 0xffffff) !=
+           want[i % 3];
+  }
+  fs.nbufs = 0;
+  bad += ioctl(k3.fd, SETUP_FLIP, &fs) < 0;
+  printf("%d flips of %u byte surfaces, %d wrong\n", N, size, bad);
+  k3cmd_fini(&c);
+  user_exit();
+}
+
 int tests() {
   test_gfx_on_then_close();
   test_dma_bind_unbind();
   test_dma_bind_close();
+  test_two_clients_dma();
+  test_dma_fence();
+  test_dma_geom();
+  test_dma_rebind();
+  test_dma_large();
+  test_dma_nonblock();
+  test_k3cmd_rollover();
+  test_pack_soa();
+  test_dma_tickets();
+  test_dma_submit_batch();
+  test_dma_ring();
+  test_blit();
+  test_capture();
+  test_vram();
+  test_list();
+  test_bo();
+  test_flip();
   return 0;
 }
 
 
-int main() {
+#ifdef BENCH
+/*
+ * Benchmarks, built with -DBENCH:
+ *
+ *   ./bench [-o out.csv] [-s scale]
+ *           [fifo|batch|dma|bigdma|cmd|ring|mt|submit|soa|fb|blit|capture|
+ *            list|bo|bind|flush ...]
+ *
+ * Each run appends one CSV row. ops is the number of timed calls the latency
+ * percentiles describe (one ioctl, or one frame for fb); the rates cover the
+ * whole run including the final wait for the card.
+ */
+#include <getopt.h>
+
+#define BENCH_TRI_WORDS 18
+#define BENCH_TRI_ENTRIES 24
+#define BENCH_PKT_TRIS (1023 / 3)
+
+struct lat {
+  unsigned long long *ns;
+  size_t n, cap;
+};
+
+static FILE *csv;
+static int scale = 1;
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void lat_add(struct lat *l, unsigned long long ns) {
+  if (l->n == l->cap) {
+    l->cap = l->cap ? 2 * l->cap : 1024;
+    l->ns = realloc(l->ns, l->cap * sizeof(*l->ns));
+  }
+  l->ns[l->n++] = ns;
+}
+
+static int cmp_ull(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile; l must be sorted.
+static unsigned long long lat_pct(struct lat *l, double p) {
+  size_t i = (size_t)(p * l->n + 0.999999);
+  if (!l->n) {
+    return 0;
+  }
+  return l->ns[i ? i - 1 : 0];
+}
+
+static void report(const char *bench, long param, struct lat *l, double secs,
+                   double tris, double bytes) {
+  qsort(l->ns, l->n, sizeof(*l->ns), cmp_ull);
+  fprintf(csv, "%s,%ld,%zu,%.6f,%.0f,%.0f,%llu,%llu,%llu,%llu\n", bench, param,
+          l->n, secs, tris / secs, bytes / secs, lat_pct(l, 0.50),
+          lat_pct(l, 0.99), lat_pct(l, 0.999), l->n ? l->ns[l->n - 1] : 0);
+  fflush(csv);
+  free(l->ns);
+  *l = (struct lat){0};
+}
+
+// A small random triangle, as x y z r g b for each vertex, 1/40 of the screen
+// across so the card's raster time does not dominate.
+static void bench_tri(float v[3][6]) {
+  float cx = (float)rand() / RAND_MAX * 1.9f - 0.95f;
+  float cy = (float)rand() / RAND_MAX * 1.9f - 0.95f;
+  for (int j = 0; j < 3; j++) {
+    v[j][0] = cx + ((float)rand() / RAND_MAX - 0.5f) * 0.05f;
+    v[j][1] = cy + ((float)rand() / RAND_MAX - 0.5f) * 0.05f;
+    v[j][2] = 0;
+    for (int k = 3; k < 6; k++) {
+      v[j][k] = (float)rand() / RAND_MAX;
+    }
+  }
+}
+
+// FIFO entries for one triangle: coordinates, colours and an emit per vertex.
+static int bench_tri_entries(struct fifo_entry *e) {
+  float v[3][6];
+  int n = 0;
+  bench_tri(v);
+  for (int j = 0; j < 3; j++) {
+    for (int k = 0; k < 3; k++) {
+      e[n++] = (struct fifo_entry){VERTEX_COORD + 4 * k, f2u(v[j][k])};
+      e[n++] = (struct fifo_entry){VERTEX_COLOR + 4 * k, f2u(v[j][k + 3])};
+    }
+    e[n++] = (struct fifo_entry){VERTEX_COORD + 12, f2u(1.0f)};
+    e[n++] = (struct fifo_entry){VERTEX_EMIT, 0};
+  }
+  return n;
+}
+
+static void bench_flush_wait(void) {
+  fifo_queue(RASTER_FLUSH, 0);
+  if (ioctl(k3.fd, FIFO_FLUSH, 0) < 0) {
+    perror("FIFO_FLUSH");
+  }
+}
+
+// One FIFO_QUEUE ioctl per entry.
+void bench_fifo(void) {
+  struct fifo_entry e[BENCH_TRI_ENTRIES];
+  struct lat l = {0};
+  int ntris = 2000 * scale, per = 0;
+  unsigned long long t0 = now_ns();
+
+  fifo_queue(COMMAND_PRIMITIVE, 1);
+  for (int i = 0; i < ntris; i++) {
+    per = bench_tri_entries(e);
+    for (int j = 0; j < per; j++) {
+      unsigned long long t = now_ns();
+      ioctl(k3.fd, FIFO_QUEUE, &e[j]);
+      lat_add(&l, now_ns() - t);
+    }
+  }
+  fifo_queue(COMMAND_PRIMITIVE, 0);
+  bench_flush_wait();
+  report("fifo", 1, &l, (now_ns() - t0) / 1e9, ntris,
+         (double)ntris * per * sizeof(struct fifo_entry));
+}
+
+// FIFO_QUEUE_BATCH with `tris` triangles per call.
+void bench_batch(int tris) {
+  struct fifo_entry *e = malloc(tris * BENCH_TRI_ENTRIES * sizeof(*e));
+  struct lat l = {0};
+  int calls = 20000 * scale / tris + 1, n = 0;
+  unsigned long long t0 = now_ns();
+
+  fifo_queue(COMMAND_PRIMITIVE, 1);
+  for (int i = 0; i < calls; i++) {
+    n = 0;
+    for (int j = 0; j < tris; j++) {
+      n += bench_tri_entries(e + n);
+    }
+    struct fifo_batch batch = {(unsigned long)e, n, 0};
+    unsigned long long t = now_ns();
+    if (ioctl(k3.fd, FIFO_QUEUE_BATCH, &batch) < 0) {
+      perror("FIFO_QUEUE_BATCH");
+      free(e);
+      return;
+    }
+    lat_add(&l, now_ns() - t);
+  }
+  fifo_queue(COMMAND_PRIMITIVE, 0);
+  bench_flush_wait();
+  report("batch", tris, &l, (now_ns() - t0) / 1e9, (double)calls * tris,
+         (double)calls * n * sizeof(struct fifo_entry));
+  free(e);
+}
+
+static size_t bench_dma_len(int tris) {
+  int pkts = (tris + BENCH_PKT_TRIS - 1) / BENCH_PKT_TRIS;
+  return (pkts + (size_t)tris * BENCH_TRI_WORDS) * 4;
+}
+
+// DMA packets for `tris` triangles, split at the header's 10-bit count.
+static size_t bench_dma_fill(unsigned int *buf, int tris) {
+  unsigned int *p = buf;
+  while (tris > 0) {
+    int n = tris < BENCH_PKT_TRIS ? tris : BENCH_PKT_TRIS;
+    struct kyouko3_dma_hdr hdr = {
+        .stride = 5, .rgb = 1, .b12 = 1, .opcode = 0x14, .count = n * 3};
+    memcpy(p++, &hdr, sizeof(hdr));
+    for (int i = 0; i < n; i++) {
+      float v[3][6];
+      bench_tri(v);
+      for (int j = 0; j < 3; j++) {
+        for (int k = 0; k < 3; k++) {
+          *p++ = f2u(v[j][k + 3]);
+        }
+        for (int k = 0; k < 3; k++) {
+          *p++ = f2u(v[j][k]);
+        }
+      }
+    }
+    tris -= n;
+  }
+  return (p - buf) * sizeof(*p);
+}
+
+// START_DMA_FENCE with buffers of `bufsize` bytes (0 for the default)
+// holding `tris` triangles each. The buffer contents are prepared up front
+// and copied in, so rand() is not timed.
+void bench_dma(const char *name, unsigned int bufsize, int tris) {
+  struct kyouko3_dma_bind bind = {.bufsize = bufsize};
+  struct dma_req req;
+  struct lat l = {0};
+  unsigned int *tmpl;
+  size_t len;
+  int bufs = 2000 * scale;
+  __u64 fence = 0;
+
+  bind_dma_geom(&req, &bind);
+  if (!req.u_base) {
+    return;
+  }
+  tmpl = malloc(bind.bufsize);
+  if (tris > bind.bufsize / (BENCH_TRI_WORDS * 4)) {
+    tris = bind.bufsize / (BENCH_TRI_WORDS * 4);
+  }
+  while (bench_dma_len(tris) > bind.bufsize) {
+    tris--;
+  }
+  len = bench_dma_fill(tmpl, tris);
+  if (bufs * (double)tris > 2000000.0 * scale) {
+    bufs = 2000000.0 * scale / tris + 1;
+  }
+
+  unsigned long long t0 = now_ns();
+  for (int i = 0; i < bufs; i++) {
+    memcpy(req.u_base, tmpl, len);
+    req.count = len;
+    unsigned long long t = now_ns();
+    fence = start_dma_fence(&req);
+    lat_add(&l, now_ns() - t);
+  }
+  if (wait_fence(fence, 10000) < 0) {
+    perror("WAIT_FENCE");
+  }
+  report(name, tris, &l, (now_ns() - t0) / 1e9, (double)bufs * tris,
+         (double)bufs * len);
+  ioctl(k3.fd, UNBIND_DMA, 0);
+  free(tmpl);
+}
+
+// Triangles one at a time through the command buffer builder, which packs
+// them into full buffers. Latency is per k3cmd_tris() call, so the tail
+// shows the submissions at rollover. With `ring` set those go through the
+// shared submission ring instead of START_DMA_FENCE.
+void bench_cmd(int ring) {
+  struct k3_vtx_rgb_xyz pool[1024][3];
+  struct k3cmd c;
+  struct lat l = {0};
+  int ntris = 200000 * scale;
+
+  for (int i = 0; i < 1024; i++) {
+    float v[3][6];
+    bench_tri(v);
+    for (int j = 0; j < 3; j++) {
+      pool[i][j] = (struct k3_vtx_rgb_xyz){v[j][3], v[j][4], v[j][5],
+                                           v[j][0], v[j][1], v[j][2]};
+    }
+  }
+  if ((ring ? k3cmd_init_ring(&c, k3.fd, NULL)
+           : k3cmd_init(&c, k3.fd, NULL)) < 0) {
+    perror("k3cmd_init");
+    return;
+  }
+
+  unsigned long long t0 = now_ns();
+  for (int i = 0; i < ntris; i++) {
+    unsigned int n = 1;
+    unsigned long long t = now_ns();
+    struct k3_vtx_rgb_xyz *v = k3cmd_tris(&c, K3_VTX_RGB_XYZ, &n);
+    if (!v) {
+      perror("k3cmd_tris");
+      break;
+    }
+    memcpy(v, pool[i & 1023], sizeof(pool[0]));
+    lat_add(&l, now_ns() - t);
+  }
+  if (k3cmd_finish(&c, 10000) < 0) {
+    perror("k3cmd_finish");
+  }
+  report(ring ? "ring" : "cmd", c.bufsize, &l, (now_ns() - t0) / 1e9, ntris,
+         c.bytes_submitted);
+  k3cmd_fini(&c);
+}
+
+struct bench_mt_worker {
+  pthread_t thread;
+  struct k3cmd c;
+  struct k3_vtx_rgb_xyz (*pool)[3];
+  int ntris;
+  struct lat l;
+};
+
+static void *bench_mt_worker(void *arg) {
+  struct bench_mt_worker *w = arg;
+
+  for (int done = 0; done < w->ntris; done += 256) {
+    unsigned long long t = now_ns();
+    if (k3cmd_emit(&w->c, K3_VTX_RGB_XYZ, w->pool, 256) < 0) {
+      perror("k3cmd_emit");
+      break;
+    }
+    lat_add(&w->l, now_ns() - t);
+  }
+  k3cmd_submit(&w->c);
+  return NULL;
+}
+
+// The cmd workload recorded by `threads` workers at once, each through its
+// own ACQUIRE_DMA tickets. ops is the number of 256-triangle k3cmd_emit()
+// calls across all workers.
+void bench_mt(int threads) {
+  struct k3_vtx_rgb_xyz pool[256][3];
+  struct bench_mt_worker w[threads];
+  struct k3cmd c;
+  struct lat l = {0};
+  // Whole emit calls per worker.
+  int per = (200000 * scale / threads + 255) / 256 * 256;
+  double bytes = 0;
+  __u64 fence = 0;
+
+  for (int i = 0; i < 256; i++) {
+    float v[3][6];
+    bench_tri(v);
+    for (int j = 0; j < 3; j++) {
+      pool[i][j] = (struct k3_vtx_rgb_xyz){v[j][3], v[j][4], v[j][5],
+                                           v[j][0], v[j][1], v[j][2]};
+    }
+  }
+  if (k3cmd_init(&c, k3.fd, NULL) < 0) {
+    perror("k3cmd_init");
+    return;
+  }
+
+  unsigned long long t0 = now_ns();
+  for (int i = 0; i < threads; i++) {
+    k3cmd_init_worker(&w[i].c, &c);
+    w[i].pool = pool;
+    w[i].ntris = per;
+    w[i].l = (struct lat){0};
+    pthread_create(&w[i].thread, NULL, bench_mt_worker, &w[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(w[i].thread, NULL);
+    for (size_t j = 0; j < w[i].l.n; j++) {
+      lat_add(&l, w[i].l.ns[j]);
+    }
+    free(w[i].l.ns);
+    bytes += w[i].c.bytes_submitted;
+    fence = w[i].c.fence > fence ? w[i].c.fence : fence;
+  }
+  struct kyouko3_fence_wait fw = {.fence = fence, .timeout_ms = 10000};
+  if (fence && ioctl(k3.fd, WAIT_FENCE, &fw) < 0) {
+    perror("WAIT_FENCE");
+  }
+  report("mt", threads, &l, (now_ns() - t0) / 1e9, (double)per * threads,
+         bytes);
+  k3cmd_fini(&c);
+}
+
+// Small buffers recorded by one thread and handed over `per_call` at a
+// time, through SUBMIT_DMA_BATCH, or SUBMIT_DMA when per_call is 1. ops is
+// the number of submit calls.
+void bench_submit(int per_call) {
+  struct k3_vtx_rgb_xyz pool[16][3];
+  struct kyouko3_dma_bind bind = {.nbufs = 16, .bufsize = 4096};
+  struct k3cmd c, w[8], *ws[8];
+  struct lat l = {0};
+  int nbufs = 20000 * scale / per_call * per_call;
+  double bytes = 0;
+  __u64 fence = 0;
+
+  for (int i = 0; i < 16; i++) {
+    float v[3][6];
+    bench_tri(v);
+    for (int j = 0; j < 3; j++) {
+      pool[i][j] = (struct k3_vtx_rgb_xyz){v[j][3], v[j][4], v[j][5],
+                                           v[j][0], v[j][1], v[j][2]};
+    }
+  }
+  if (k3cmd_init(&c, k3.fd, &bind) < 0) {
+    perror("k3cmd_init");
+    return;
+  }
+  for (int i = 0; i < per_call; i++) {
+    k3cmd_init_worker(&w[i], &c);
+    ws[i] = &w[i];
+  }
+
+  unsigned long long t0 = now_ns();
+  for (int done = 0; done < nbufs; done += per_call) {
+    for (int i = 0; i < per_call; i++) {
+      k3cmd_emit(&w[i], K3_VTX_RGB_XYZ, pool, 16);
+    }
+    unsigned long long t = now_ns();
+    int ret = per_call == 1 ? k3cmd_submit(&w[0])
+                            : k3cmd_submit_batch(ws, per_call);
+    lat_add(&l, now_ns() - t);
+    if (ret < 0) {
+      perror("submit");
+      break;
+    }
+  }
+  for (int i = 0; i < per_call; i++) {
+    bytes += w[i].bytes_submitted;
+    fence = w[i].fence > fence ? w[i].fence : fence;
+  }
+  struct kyouko3_fence_wait fw = {.fence = fence, .timeout_ms = 10000};
+  if (fence && ioctl(k3.fd, WAIT_FENCE, &fw) < 0) {
+    perror("WAIT_FENCE");
+  }
+  report("submit", per_call, &l, (now_ns() - t0) / 1e9, 16.0 * nbufs, bytes);
+  k3cmd_fini(&c);
+}
+
+// Triangles from structure-of-arrays vertex data, packed by
+// k3cmd_emit_soa(). The row is named after the packer, param is the number of
+// vertices per call.
+void bench_soa(void) {
+  int nverts = 3 * 4096, ntris = 200000 * scale;
+  float *arr = malloc(6 * nverts * sizeof(float));
+  struct k3_soa a = {arr, arr + nverts, arr + 2 * nverts, arr + 3 * nverts,
+                     arr + 4 * nverts, arr + 5 * nverts};
+  struct k3cmd c;
+  struct lat l = {0};
+
+  for (int i = 0; i < nverts; i += 3) {
+    float v[3][6];
+    bench_tri(v);
+    for (int j = 0; j < 3; j++) {
+      for (int k = 0; k < 6; k++) {
+        arr[k * nverts + i + j] = v[j][k];
+      }
+    }
+  }
+  if (k3cmd_init(&c, k3.fd, NULL) < 0) {
+    perror("k3cmd_init");
+    free(arr);
+    return;
+  }
+
+  unsigned long long t0 = now_ns();
+  for (int done = 0; done < ntris; done += nverts / 3) {
+    unsigned long long t = now_ns();
+    if (k3cmd_emit_soa(&c, &a, nverts / 3) < 0) {
+      perror("k3cmd_emit_soa");
+      break;
+    }
+    lat_add(&l, now_ns() - t);
+  }
+  if (k3cmd_finish(&c, 10000) < 0) {
+    perror("k3cmd_finish");
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "soa-%s", k3_pack_name());
+  report(name, nverts, &l, (now_ns() - t0) / 1e9, ntris, c.bytes_submitted);
+  k3cmd_fini(&c);
+  free(arr);
+}
+
+// Whole 1024x768 frames through U_WRITE_FB.
+void bench_fb(void) {
+  struct lat l = {0};
+  int frames = 20 * scale, pixels = 1024 * 768;
+  unsigned long long t0 = now_ns();
+
+  for (int f = 0; f < frames; f++) {
+    unsigned long long t = now_ns();
+    for (int i = 0; i < pixels; i++) {
+      U_WRITE_FB(i, f << 16 | i);
+    }
+    lat_add(&l, now_ns() - t);
+  }
+  report("fb", pixels, &l, (now_ns() - t0) / 1e9, 0,
+         (double)frames * pixels * 4);
+}
+
+// bench_fb() through BLIT: upload a full frame, then read it back.
+void bench_blit(void) {
+  struct lat up = {0}, rd = {0};
+  int frames = 20 * scale, pixels = 1024 * 768;
+  unsigned int *buf = malloc(pixels * 4);
+  struct kyouko3_blit b = {.data = (unsigned long)buf, .width = 1024,
+                           .height = 768};
+  unsigned long long t0, ns_up = 0, ns_rd = 0;
+
+  for (int i = 0; i < pixels; i++) {
+    buf[i] = i;
+  }
+  for (int f = 0; f < frames; f++) {
+    b.op = K3_BLIT_UPLOAD;
+    t0 = now_ns();
+    ioctl(k3.fd, BLIT, &b);
+    lat_add(&up, now_ns() - t0);
+    ns_up += now_ns() - t0;
+  }
+  for (int f = 0; f < frames; f++) {
+    b.op = K3_BLIT_READ;
+    t0 = now_ns();
+    ioctl(k3.fd, BLIT, &b);
+    lat_add(&rd, now_ns() - t0);
+    ns_rd += now_ns() - t0;
+  }
+  report("blit_up", pixels, &up, ns_up / 1e9, 0,
+         (double)frames * pixels * 4);
+  report("blit_read", pixels, &rd, ns_rd / 1e9, 0,
+         (double)frames * pixels * 4);
+  free(buf);
+}
+
+// The same static triangles every call, recorded once as a display list and
+// replayed by handle, against "dma" re-copying them into a fresh buffer.
+void bench_list(int tris) {
+  unsigned int *tmpl = malloc(bench_dma_len(tris));
+  struct kyouko3_list kl = {.data = (unsigned long)tmpl};
+  struct lat l = {0};
+  int calls = 2000000 * scale / tris + 1;
+  if (calls > 2000 * scale) {
+    calls = 2000 * scale;
+  }
+  kl.size = bench_dma_fill(tmpl, tris);
+  if (ioctl(k3.fd, LIST_CREATE, &kl) < 0) {
+    perror("LIST_CREATE");
+    free(tmpl);
+    return;
+  }
+  struct kyouko3_list_replay r = {.handle = kl.handle};
+  unsigned long long t0 = now_ns();
+  for (int i = 0; i < calls; i++) {
+    unsigned long long t = now_ns();
+    if (ioctl(k3.fd, LIST_REPLAY, &r) < 0) {
+      perror("LIST_REPLAY");
+      break;
+    }
+    lat_add(&l, now_ns() - t);
+  }
+  bench_flush_wait();
+  report("list", tris, &l, (now_ns() - t0) / 1e9, (double)calls * tris,
+         (double)calls * kl.size);
+  ioctl(k3.fd, LIST_DESTROY, kl.handle);
+  free(tmpl);
+}
+
+// The same static triangles every call from a resident buffer object, which
+// the card reads in place, against "dma" copying them into a ring buffer.
+void bench_bo(int tris) {
+  struct kyouko3_bo bo = {.size = bench_dma_len(tris)};
+  struct lat l = {0};
+  int calls = 2000000 * scale / tris + 1;
+  if (calls > 2000 * scale) {
+    calls = 2000 * scale;
+  }
+  if (ioctl(k3.fd, BO_CREATE, &bo) < 0) {
+    perror("BO_CREATE");
+    return;
+  }
+  unsigned int *p = mmap(0, bo.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         k3.fd, bo.offset);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    ioctl(k3.fd, BO_DESTROY, bo.handle);
+    return;
+  }
+  struct kyouko3_bo_submit sub = {.handle = bo.handle,
+                                  .count = bench_dma_fill(p, tris)};
+  unsigned long long t0 = now_ns();
+  for (int i = 0; i < calls; i++) {
+    unsigned long long t = now_ns();
+    if (ioctl(k3.fd, BO_SUBMIT, &sub) < 0) {
+      perror("BO_SUBMIT");
+      break;
+    }
+    lat_add(&l, now_ns() - t);
+  }
+  bench_flush_wait();
+  report("bo", tris, &l, (now_ns() - t0) / 1e9, (double)calls * tris,
+         (double)calls * sub.count);
+  munmap(p, bo.size);
+  ioctl(k3.fd, BO_DESTROY, bo.handle);
+}
+
+// Full-frame captures, two in flight: queue the next before waiting for the
+// previous one. Latency is from queueing a capture to its completion.
+void bench_capture(void) {
+  struct lat l = {0};
+  int frames = 20 * scale, pixels = 1024 * 768;
+  struct kyouko3_capture_setup cs = {.size = 2 * pixels * 4};
+  struct kyouko3_capture c = {.rect = {.width = 1024, .height = 768}};
+  struct kyouko3_capture_wait cw = {.timeout_ms = 1000};
+  unsigned long long t0 = now_ns(), queued[2];
+
+  if (ioctl(k3.fd, SETUP_CAPTURE, &cs) < 0) {
+    perror("SETUP_CAPTURE");
+    return;
+  }
+  for (int f = 0; f <= frames; f++) {
+    if (f < frames) {
+      c.buf_offset = f % 2 * pixels * 4;
+      queued[f % 2] = now_ns();
+      ioctl(k3.fd, CAPTURE, &c);
+    }
+    if (f > 0) {
+      cw.seq = c.seq - (f < frames);
+      ioctl(k3.fd, CAPTURE_WAIT, &cw);
+      lat_add(&l, now_ns() - queued[(f - 1) % 2]);
+    }
+  }
+  report("capture", pixels, &l, (now_ns() - t0) / 1e9, 0,
+         (double)frames * pixels * 4);
+  cs.size = 0;
+  ioctl(k3.fd, SETUP_CAPTURE, &cs);
+}
+
+// BIND_DMA_GEOM and UNBIND_DMA back to back, on the same file or (with
+// `reopen` set) on a fresh one each time, whose buffers come from the pool.
+// Latency is per bind, including the first touch of every buffer.
+void bench_bind(int reopen) {
+  struct kyouko3_dma_bind bind = {0};
+  struct lat l = {0};
+  int n = 1000 * scale;
+  int fd = k3.fd;
+  unsigned long long t0 = now_ns();
+
+  for (int i = 0; i < n; i++) {
+    if (reopen) {
+      fd = open("/dev/kyouko3", O_RDWR);
+    }
+    bind.nbufs = bind.bufsize = 0;
+    unsigned long long t = now_ns();
+    if (ioctl(fd, BIND_DMA_GEOM, &bind) < 0) {
+      perror("BIND_DMA_GEOM");
+      break;
+    }
+    volatile unsigned int *buf = (unsigned int *)(unsigned long)bind.u_base;
+    for (unsigned int j = 0; j < bind.nbufs; j++) {
+      buf[j * bind.bufsize / 4] = 0;
+    }
+    lat_add(&l, now_ns() - t);
+    ioctl(fd, UNBIND_DMA, 0);
+    if (reopen) {
+      // The mapping holds the file open; without this, release never runs
+      // and the buffers never make it back to the pool.
+      munmap((void *)buf, (size_t)bind.nbufs * bind.bufsize);
+      close(fd);
+    }
+  }
+  report("bind", reopen, &l, (now_ns() - t0) / 1e9, 0, 0);
+}
+
+// Round trip of an otherwise idle FIFO_FLUSH.
+void bench_flush(void) {
+  struct lat l = {0};
+  int n = 2000 * scale;
+  unsigned long long t0 = now_ns();
+
+  for (int i = 0; i < n; i++) {
+    fifo_queue(RASTER_FLUSH, 0);
+    unsigned long long t = now_ns();
+    ioctl(k3.fd, FIFO_FLUSH, 0);
+    lat_add(&l, now_ns() - t);
+  }
+  report("flush", 1, &l, (now_ns() - t0) / 1e9, 0,
+         (double)n * sizeof(struct fifo_entry));
+}
+
+int bench(int argc, char **argv) {
+  int opt;
+
+  csv = stdout;
+  while ((opt = getopt(argc, argv, "o:s:")) != -1) {
+    switch (opt) {
+    case 'o':
+      csv = fopen(optarg, "w");
+      if (!csv) {
+        perror(optarg);
+        return 1;
+      }
+      break;
+    case 's':
+      scale = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-o out.csv] [-s scale] "
+                      "[fifo|batch|dma|bigdma|cmd|ring|mt|submit|soa|fb|blit|"
+                      "capture|list|bo|bind|flush ...]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  user_init();
+  if (k3.fd < 0) {
+    perror("/dev/kyouko3");
+    return 1;
+  }
+  gfx_on();
+  fprintf(csv, "bench,param,ops,secs,tris_per_s,bytes_per_s,"
+               "p50_ns,p99_ns,p999_ns,max_ns\n");
+
+  for (int i = optind; i < argc || i == optind; i++) {
+    const char *b = i < argc ? argv[i] : NULL;
+    if (!b || !strcmp(b, "fifo")) {
+      bench_fifo();
+    }
+    if (!b || !strcmp(b, "batch")) {
+      // Up to the most triangles a single batch can hold.
+      int sizes[] = {1, 8, 32, (FIFO_ENTRIES - 1) / BENCH_TRI_ENTRIES};
+      for (int j = 0; j < 4; j++) {
+        bench_batch(sizes[j]);
+      }
+    }
+    if (!b || !strcmp(b, "dma")) {
+      // Fill levels from a single triangle up to a full default buffer.
+      int fills[] = {1, 16, 128, 512, 1024, 1 << 30};
+      for (int j = 0; j < 6; j++) {
+        bench_dma("dma", 0, fills[j]);
+      }
+    }
+    if (!b || !strcmp(b, "bigdma")) {
+      // The same triangle counts in buffers of the largest size, so each
+      // interrupt covers up to a full large buffer.
+      int fills[] = {1024, 16384, 1 << 30};
+      for (int j = 0; j < 3; j++) {
+        bench_dma("bigdma", DMA_BUFSIZE_MAX, fills[j]);
+      }
+    }
+    if (!b || !strcmp(b, "cmd")) {
+      bench_cmd(0);
+    }
+    if (!b || !strcmp(b, "ring")) {
+      bench_cmd(1);
+    }
+    if (!b || !strcmp(b, "mt")) {
+      int threads[] = {1, 2, 4};
+      for (int j = 0; j < 3; j++) {
+        bench_mt(threads[j]);
+      }
+    }
+    if (!b || !strcmp(b, "submit")) {
+      int per_call[] = {1, 2, 4, 8};
+      for (int j = 0; j < 4; j++) {
+        bench_submit(per_call[j]);
+      }
+    }
+    if (!b || !strcmp(b, "soa")) {
+      bench_soa();
+    }
+    if (!b || !strcmp(b, "fb")) {
+      bench_fb();
+    }
+    if (!b || !strcmp(b, "blit")) {
+      bench_blit();
+    }
+    if (!b || !strcmp(b, "capture")) {
+      bench_capture();
+    }
+    if (!b || !strcmp(b, "list")) {
+      int tris[] = {10, 100, 1000};
+      for (int j = 0; j < 3; j++) {
+        bench_list(tris[j]);
+      }
+    }
+    if (!b || !strcmp(b, "bo")) {
+      int tris[] = {10, 100, 1000};
+      for (int j = 0; j < 3; j++) {
+        bench_bo(tris[j]);
+      }
+    }
+    if (!b || !strcmp(b, "bind")) {
+      bench_bind(0);
+      bench_bind(1);
+    }
+    if (!b || !strcmp(b, "flush")) {
+      bench_flush();
+    }
+  }
+
+  gfx_off();
+  user_exit();
+  if (csv != stdout) {
+    fclose(csv);
+  }
+  return 0;
+}
+#endif
+
+int main(int argc, char **argv) {
 #ifdef TESTING
   return tests();
+#elif defined(BENCH)
+  return bench(argc, argv);
 #else
   return demos();
 #endif